@@ -15,6 +15,22 @@
   _IOW(AFL_SNAPSHOT_IOCTL_MAGIC, 4, struct afl_snapshot_vmrange_args *)
 #define AFL_SNAPSHOT_IOCTL_TAKE _IOW(AFL_SNAPSHOT_IOCTL_MAGIC, 5, int)
 #define AFL_SNAPSHOT_IOCTL_RESTORE _IO(AFL_SNAPSHOT_IOCTL_MAGIC, 6)
+#define AFL_SNAPSHOT_SHADOW_VMRANGE \
+  _IOW(AFL_SNAPSHOT_IOCTL_MAGIC, 7, struct afl_snapshot_vmrange_args *)
+#define AFL_SNAPSHOT_IOCTL_PUSH _IO(AFL_SNAPSHOT_IOCTL_MAGIC, 8)
+#define AFL_SNAPSHOT_IOCTL_POP _IO(AFL_SNAPSHOT_IOCTL_MAGIC, 9)
+#define AFL_SNAPSHOT_IOCTL_RESTORE_LEVEL _IOW(AFL_SNAPSHOT_IOCTL_MAGIC, 10, int)
+#define AFL_SNAPSHOT_IOCTL_REBASE _IO(AFL_SNAPSHOT_IOCTL_MAGIC, 11)
+#define AFL_SNAPSHOT_IOCTL_FORK _IOW(AFL_SNAPSHOT_IOCTL_MAGIC, 12, int)
+#define AFL_SNAPSHOT_IOCTL_SAVE _IOW(AFL_SNAPSHOT_IOCTL_MAGIC, 13, int)
+#define AFL_SNAPSHOT_IOCTL_LOAD _IOW(AFL_SNAPSHOT_IOCTL_MAGIC, 14, int)
+#define AFL_SNAPSHOT_IOCTL_STATS \
+  _IOR(AFL_SNAPSHOT_IOCTL_MAGIC, 15, struct afl_snapshot_stats *)
+#define AFL_SNAPSHOT_IOCTL_LIMITS \
+  _IOW(AFL_SNAPSHOT_IOCTL_MAGIC, 16, struct afl_snapshot_limits *)
+#define AFL_SNAPSHOT_IOCTL_CRASH_REPORT \
+  _IOR(AFL_SNAPSHOT_IOCTL_MAGIC, 17, struct afl_snapshot_crash_report *)
+#define AFL_SNAPSHOT_IOCTL_START _IO(AFL_SNAPSHOT_IOCTL_MAGIC, 18)
 
 // Trace new mmaped ares and unmap them on restore.
 #define AFL_SNAPSHOT_MMAP 1
@@ -32,6 +48,38 @@
 #define AFL_SNAPSHOT_NOCOW 32
 // Do not snapshot Stack pages
 #define AFL_SNAPSHOT_NOSTACK 64
+// Snapshot writable shared mappings (MAP_SHARED, memfd, SysV shm)
+#define AFL_SNAPSHOT_SHARED 128
+// Reset sanitizer shadow mappings by zapping the touched pages
+#define AFL_SNAPSHOT_SHADOW 256
+// Restore the contents and size of regular files written during an iteration
+#define AFL_SNAPSHOT_FILEDATA 512
+// Rewind the other threads instead of killing them
+#define AFL_SNAPSHOT_THREADS 1024
+// Restore signal handlers, the blocked mask, pending signals and itimers
+#define AFL_SNAPSHOT_SIGNALS 2048
+// Kill and reap the child processes spawned during an iteration
+#define AFL_SNAPSHOT_CHILDREN 4096
+// Restore by swapping in a clone of the whole address space
+#define AFL_SNAPSHOT_SWAP 8192
+// Pick the memory restore strategy from the measured costs
+#define AFL_SNAPSHOT_AUTO 16384
+// Restore instead of dying on SIGSEGV, SIGABRT and the other crash signals
+#define AFL_SNAPSHOT_CRASH 32768
+// Queue the data pending in pipes and unix stream sockets again on restore
+#define AFL_SNAPSHOT_STREAMS 65536
+
+// Returned at the snapshot point: taken, restored on request, or restored by
+// the module because the iteration went wrong.
+#define AFL_SNAPSHOT_STATUS_RESTORED 0
+#define AFL_SNAPSHOT_STATUS_TAKEN 1
+#define AFL_SNAPSHOT_STATUS_BUDGET 2
+#define AFL_SNAPSHOT_STATUS_TIMEOUT 3
+#define AFL_SNAPSHOT_STATUS_CRASH 4
+
+// Memory restore strategies reported by AFL_SNAPSHOT_IOCTL_STATS
+#define AFL_SNAPSHOT_STRATEGY_PAGE 0
+#define AFL_SNAPSHOT_STRATEGY_SWAP 1
 
 struct afl_snapshot_vmrange_args {
 
@@ -39,5 +87,39 @@ struct afl_snapshot_vmrange_args {
 
 };
 
+struct afl_snapshot_stats {
+
+  unsigned long long iterations;
+  unsigned long long dirty_pages;   // restored by the last page restore
+  unsigned long long restore_ns;    // memory restore of the last iteration
+  unsigned long long page_cost_ns;  // average per iteration, 0 if unmeasured
+  unsigned long long swap_cost_ns;  // average per iteration, 0 if unmeasured
+  unsigned int       strategy;
+  unsigned int       switches;
+
+};
+
+// Per iteration, 0 for no limit.
+struct afl_snapshot_limits {
+
+  unsigned long long max_dirty_pages;
+  unsigned long long max_saved_bytes;  // page copies added to the snapshot
+  unsigned long long timeout_us;       // wall clock since afl_snapshot_start
+
+};
+
+struct afl_snapshot_crash_report {
+
+  int                signo;
+  int                code;   // si_code
+  int                tid;
+  unsigned int       count;  // crashes intercepted since the take
+  unsigned long long addr;   // faulting address, 0 for raised signals
+  unsigned long long ip, sp, bp, flags;
+  unsigned long long ax, bx, cx, dx, si, di;
+  unsigned long long r8, r9, r10, r11, r12, r13, r14, r15;
+
+};
+
 #endif
 
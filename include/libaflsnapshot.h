@@ -1,14 +1,28 @@
 #ifndef LIB_AFL_SNAPSHOT_H
 #define LIB_AFL_SNAPSHOT_H
 
+#include <sys/types.h>
+
 #include "afl_snapshot.h"
 
 int  afl_snapshot_init();
 void afl_snapshot_exclude_vmrange(void *start, void *end);
 void afl_snapshot_include_vmrange(void *start, void *end);
+void afl_snapshot_shadow_vmrange(void *start, void *end);
 int  afl_snapshot_do(void);
 int  afl_snapshot_take(int config);
 void afl_snapshot_restore(void);
+int  afl_snapshot_rebase(void);
+pid_t afl_snapshot_fork(void);
+int  afl_snapshot_push(void);
+int  afl_snapshot_pop(void);
+void afl_snapshot_restore_level(int level);
+int  afl_snapshot_save(int fd);
+int  afl_snapshot_load(int fd);
+int  afl_snapshot_stats(struct afl_snapshot_stats *stats);
+int  afl_snapshot_limits(const struct afl_snapshot_limits *limits);
+int  afl_snapshot_crash_report(struct afl_snapshot_crash_report *report);
+int  afl_snapshot_start(void);
 void afl_snapshot_clean(void);
 
 #endif
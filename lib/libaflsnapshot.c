@@ -3,6 +3,7 @@
 #include <sys/ioctl.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 static int dev_fd;
 
@@ -29,6 +30,14 @@ void afl_snapshot_include_vmrange(void *start, void *end) {
 
 }
 
+void afl_snapshot_shadow_vmrange(void *start, void *end) {
+
+  struct afl_snapshot_vmrange_args args = {(unsigned long)start,
+                                           (unsigned long)end};
+  ioctl(dev_fd, AFL_SNAPSHOT_SHADOW_VMRANGE, &args);
+
+}
+
 int afl_snapshot_take(int config) {
 
   return ioctl(dev_fd, AFL_SNAPSHOT_IOCTL_TAKE, config);
@@ -47,6 +56,97 @@ void afl_snapshot_restore(void) {
 
 }
 
+int afl_snapshot_rebase(void) {
+
+  return ioctl(dev_fd, AFL_SNAPSHOT_IOCTL_REBASE);
+
+}
+
+pid_t afl_snapshot_fork(void) {
+
+  int   fds[2];
+  char  c;
+  pid_t pid;
+
+  if (pipe(fds)) return -1;
+
+  pid = fork();
+  if (pid == 0) {
+
+    // The module closes the write end once it is done with our snapshot.
+    close(fds[0]);
+    if (ioctl(dev_fd, AFL_SNAPSHOT_IOCTL_FORK, fds[1]) < 0) _exit(1);
+    return 0;
+
+  }
+
+  close(fds[1]);
+  if (pid > 0) {
+
+    while (read(fds[0], &c, 1) > 0)
+      ;
+
+  }
+
+  close(fds[0]);
+  return pid;
+
+}
+
+int afl_snapshot_push(void) {
+
+  return ioctl(dev_fd, AFL_SNAPSHOT_IOCTL_PUSH);
+
+}
+
+int afl_snapshot_pop(void) {
+
+  return ioctl(dev_fd, AFL_SNAPSHOT_IOCTL_POP);
+
+}
+
+void afl_snapshot_restore_level(int level) {
+
+  ioctl(dev_fd, AFL_SNAPSHOT_IOCTL_RESTORE_LEVEL, level);
+
+}
+
+int afl_snapshot_save(int fd) {
+
+  return ioctl(dev_fd, AFL_SNAPSHOT_IOCTL_SAVE, fd);
+
+}
+
+int afl_snapshot_load(int fd) {
+
+  return ioctl(dev_fd, AFL_SNAPSHOT_IOCTL_LOAD, fd);
+
+}
+
+int afl_snapshot_stats(struct afl_snapshot_stats *stats) {
+
+  return ioctl(dev_fd, AFL_SNAPSHOT_IOCTL_STATS, stats);
+
+}
+
+int afl_snapshot_limits(const struct afl_snapshot_limits *limits) {
+
+  return ioctl(dev_fd, AFL_SNAPSHOT_IOCTL_LIMITS, limits);
+
+}
+
+int afl_snapshot_crash_report(struct afl_snapshot_crash_report *report) {
+
+  return ioctl(dev_fd, AFL_SNAPSHOT_IOCTL_CRASH_REPORT, report);
+
+}
+
+int afl_snapshot_start(void) {
+
+  return ioctl(dev_fd, AFL_SNAPSHOT_IOCTL_START);
+
+}
+
 void afl_snapshot_clean(void) {
 
   ioctl(dev_fd, AFL_SNAPSHOT_IOCTL_CLEAN);
@@ -0,0 +1,117 @@
+#include "debug.h"
+#include "linux/hrtimer.h"
+#include "linux/uaccess.h"
+#include "task_data.h"
+#include "snapshot.h"
+
+/*
+ * Runaway inputs can make the target dirty gigabytes in a single iteration,
+ * and every dirtied page is copied into the snapshot. The pages dirtied and
+ * the page copies added since the last restore are checked against the limits
+ * of the snapshot as the faults log them. The anonymous pages faulted in
+ * outside the snapshotted ranges, in mappings created or grown during the
+ * iteration, count as dirtied too. Past a limit the iteration is cut
+ * short by a forced restore and the snapshot point returns
+ * AFL_SNAPSHOT_STATUS_BUDGET. The check is on the page restore, a swap
+ * snapshot does not log its pages.
+ *
+ * A hung iteration is cut short the same way by a timer, the snapshot point
+ * then returns AFL_SNAPSHOT_STATUS_TIMEOUT. The harness arms it once it has
+ * the input, the wait for the next input is not part of the iteration, and
+ * every take and restore disarms it.
+ * A target blocked in an interruptible syscall is woken up by the task work,
+ * one spinning in user mode runs it on its next interrupt.
+ */
+
+int set_snapshot_limits(struct afl_snapshot_limits __user *arg)
+{
+	struct task_data *data = ensure_task_data(current);
+	struct afl_snapshot_limits limits;
+
+	if (!data)
+		return -ENOMEM;
+
+	if (copy_from_user(&limits, arg, sizeof(limits)))
+		return -EFAULT;
+
+	data->ss.limits = limits;
+
+	// The iteration in progress is measured from now on.
+	if (have_snapshot(data))
+		reset_iteration_budget(data);
+
+	return 0;
+}
+
+static enum hrtimer_restart iteration_timeout(struct hrtimer *timer)
+{
+	struct task_data *data =
+		container_of(timer, struct task_data, ss.iteration_timer);
+
+	DBG_PRINT("iteration timed out\n");
+	force_restore_snapshot(data, AFL_SNAPSHOT_STATUS_TIMEOUT);
+
+	return HRTIMER_NORESTART;
+}
+
+void init_iteration_budget(struct task_data *data)
+{
+	hrtimer_init(&data->ss.iteration_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL_SOFT);
+	data->ss.iteration_timer.function = iteration_timeout;
+}
+
+void reset_iteration_budget(struct task_data *data)
+{
+	// A timeout firing now belongs to the iteration that ends.
+	hrtimer_cancel(&data->ss.iteration_timer);
+	WRITE_ONCE(data->ss.iteration_epoch, data->ss.iteration_epoch + 1);
+
+	atomic_long_set(&data->ss.iteration_pages, 0);
+	data->ss.iteration_bytes = atomic_long_read(&data->ss.saved_bytes);
+}
+
+int start_iteration_timer(void)
+{
+	struct task_data *data = get_task_data(current);
+	u64 timeout_us;
+
+	if (!data || !have_snapshot(data))
+		return -EINVAL;
+
+	timeout_us = data->ss.limits.timeout_us;
+	if (timeout_us)
+		hrtimer_start(&data->ss.iteration_timer,
+			      ns_to_ktime(timeout_us * NSEC_PER_USEC),
+			      HRTIMER_MODE_REL_SOFT);
+
+	return 0;
+}
+
+void clean_iteration_budget(struct task_data *data)
+{
+	hrtimer_cancel(&data->ss.iteration_timer);
+}
+
+// Called from the fault paths for every page logged or newly allocated.
+void charge_dirty_page(struct task_data *data)
+{
+	struct afl_snapshot_limits *limits = &data->ss.limits;
+	long pages = atomic_long_inc_return(&data->ss.iteration_pages);
+	long bytes;
+
+	if (limits->max_dirty_pages && pages > limits->max_dirty_pages)
+		goto over;
+
+	bytes = atomic_long_read(&data->ss.saved_bytes) -
+		data->ss.iteration_bytes;
+	if (limits->max_saved_bytes && bytes > 0 &&
+	    bytes > limits->max_saved_bytes)
+		goto over;
+
+	return;
+
+over:
+	DBG_PRINT("iteration over budget, %ld pages dirtied\n", pages);
+	force_restore_snapshot(data, AFL_SNAPSHOT_STATUS_BUDGET);
+}
@@ -0,0 +1,171 @@
+#include "debug.h"
+#include "linux/pid.h"
+#include "linux/sched/signal.h"
+#include "linux/sched/task.h"
+#include "linux/slab.h"
+#include "linux/wait.h"
+#include "task_data.h"
+#include "snapshot.h"
+
+/*
+ * The processes descending from the target at snapshot time are recorded.
+ * On restore every descendant that is not in the record was spawned during
+ * the iteration, it is killed and, once it is a child of the target, reaped
+ * before the restore returns. The ones reparented elsewhere cannot be waited
+ * for, the restore waits until they have exited. Either way no helper holds
+ * its files or ports into the next iteration. The recorded processes are left
+ * running as they are.
+ */
+
+walk_process_tree_t walk_process_tree_ptr;
+kernel_wait4_t kernel_wait4_ptr;
+
+struct children_walk {
+	struct task_data *data;
+	struct list_head *list;
+	int error;
+};
+
+static int add_child(struct list_head *list, struct task_struct *p)
+{
+	struct snapshot_child *child;
+
+	// Called with tasklist_lock held.
+	child = kmalloc(sizeof(struct snapshot_child), GFP_ATOMIC);
+	if (!child) {
+		FATAL("snapshot_child allocation failed");
+		return -ENOMEM;
+	}
+
+	child->pid = get_pid(task_tgid(p));
+	child->task = NULL;
+	list_add_tail(&child->node, list);
+
+	return 0;
+}
+
+static void free_children(struct list_head *list)
+{
+	struct snapshot_child *child, *next;
+
+	list_for_each_entry_safe (child, next, list, node) {
+		list_del(&child->node);
+		put_pid(child->pid);
+		if (child->task)
+			put_task_struct(child->task);
+		kfree(child);
+	}
+}
+
+static int record_child(struct task_struct *p, void *private)
+{
+	struct children_walk *walk = private;
+
+	walk->error = add_child(walk->list, p);
+	return walk->error ? -1 : 1;
+}
+
+int take_children_snapshot(struct task_data *data)
+{
+	struct children_walk walk = {
+		.data = data,
+		.list = &data->ss.children,
+	};
+
+	if (!(data->config & AFL_SNAPSHOT_CHILDREN))
+		return 0;
+
+	walk_process_tree_ptr(current, record_child, &walk);
+
+	return walk.error;
+}
+
+// Workers forked from the snapshot are not killed as leftovers.
+int record_snapshot_child(struct task_data *data, struct task_struct *p)
+{
+	if (!(data->config & AFL_SNAPSHOT_CHILDREN))
+		return 0;
+
+	return add_child(&data->ss.children, p);
+}
+
+static bool is_recorded_child(struct task_data *data, struct task_struct *p)
+{
+	struct snapshot_child *child;
+	struct pid *pid = task_tgid(p);
+
+	list_for_each_entry (child, &data->ss.children, node) {
+		if (child->pid == pid)
+			return true;
+	}
+
+	return false;
+}
+
+static int kill_new_child(struct task_struct *p, void *private)
+{
+	struct children_walk *walk = private;
+
+	// The new processes below a recorded one are looked for as well.
+	if (is_recorded_child(walk->data, p))
+		return 1;
+
+	DBG_PRINT("killing child %d spawned during the iteration\n",
+		  task_tgid_nr(p));
+
+	walk->error = add_child(walk->list, p);
+	if (walk->error)
+		return -1;
+
+	get_task_struct(p);
+	list_last_entry(walk->list, struct snapshot_child, node)->task = p;
+
+	send_sig(SIGKILL, p, 1);
+	return 1;
+}
+
+// The files and the memory are dropped before the exit state is set.
+static void wait_for_exit(struct task_struct *p)
+{
+	while (!READ_ONCE(p->exit_state) && !fatal_signal_pending(current))
+		schedule_timeout_killable(1);
+}
+
+int recover_children_snapshot(struct task_data *data)
+{
+	struct snapshot_child *child;
+	LIST_HEAD(killed);
+	struct children_walk walk = {
+		.data = data,
+		.list = &killed,
+	};
+	pid_t nr;
+
+	if (!(data->config & AFL_SNAPSHOT_CHILDREN))
+		return 0;
+
+	walk_process_tree_ptr(current, kill_new_child, &walk);
+
+	/*
+	 * Parents come before their children in the list. Once a parent is
+	 * reaped its orphans are reparented, to the target when it is a
+	 * subreaper, and waiting on the others fails with -ECHILD.
+	 */
+	list_for_each_entry (child, &killed, node) {
+		nr = pid_vnr(child->pid);
+		if (nr)
+			kernel_wait4_ptr(nr, NULL, __WALL, NULL);
+	}
+
+	list_for_each_entry (child, &killed, node)
+		wait_for_exit(child->task);
+
+	free_children(&killed);
+
+	return walk.error;
+}
+
+void clean_children_snapshot(struct task_data *data)
+{
+	free_children(&data->ss.children);
+}
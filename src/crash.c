@@ -0,0 +1,207 @@
+#include "debug.h"
+#include "linux/ptrace.h"
+#include "linux/sched/signal.h"
+#include "linux/signal.h"
+#include "linux/slab.h"
+#include "linux/task_work.h"
+#include "linux/uaccess.h"
+#include "task_data.h"
+#include "snapshot.h"
+
+/*
+ * With AFL_SNAPSHOT_CRASH a crash signal that would kill the target is taken
+ * off the pending set when the task goes to deliver it, and a restore with
+ * AFL_SNAPSHOT_STATUS_CRASH is forced instead. get_signal() runs the pending
+ * task works before it looks at the signals, so the crashing task is back at
+ * the snapshot before the signal could be acted upon. The signal number, the
+ * faulting address and the registers are kept for the crash report.
+ * Signals the target installed a handler for are delivered as usual, and so
+ * is everything for a traced task, its debugger is meant to see the crash.
+ */
+
+#define CRASH_SIGNALS                                                      \
+	(sigmask(SIGSEGV) | sigmask(SIGBUS) | sigmask(SIGILL) |            \
+	 sigmask(SIGFPE) | sigmask(SIGABRT) | sigmask(SIGTRAP) |           \
+	 sigmask(SIGSYS))
+
+// Signals raised by a fault, si_addr is meaningful for them.
+#define FAULT_SIGNALS                                                      \
+	(sigmask(SIGSEGV) | sigmask(SIGBUS) | sigmask(SIGILL) |            \
+	 sigmask(SIGFPE) | sigmask(SIGTRAP))
+
+dequeue_signal_t dequeue_signal_ptr;
+bool get_signal_hooked;
+
+bool can_intercept_crashes(void)
+{
+	return get_signal_hooked && dequeue_signal_ptr;
+}
+
+// Called with the siglock held.
+static int next_crash_signal(void)
+{
+	struct sighand_struct *sighand = current->sighand;
+	sigset_t pending;
+	int sig;
+
+	sigorsets(&pending, &current->pending.signal,
+		  &current->signal->shared_pending.signal);
+
+	for (sig = 1; sig < 32; sig++) {
+		if (!(sigmask(sig) & CRASH_SIGNALS) ||
+		    !sigismember(&pending, sig) ||
+		    sigismember(&current->blocked, sig))
+			continue;
+
+		if (sighand->action[sig - 1].sa.sa_handler != SIG_DFL)
+			continue;
+
+		return sig;
+	}
+
+	return 0;
+}
+
+static void record_crash(struct task_data *data, kernel_siginfo_t *info)
+{
+	struct afl_snapshot_crash_report *report = &data->ss.crash;
+	struct pt_regs *regs = task_pt_regs(current);
+
+	report->signo = info->si_signo;
+	report->code = info->si_code;
+	report->tid = task_pid_vnr(current);
+	report->count++;
+
+	if (info->si_code > 0 && (sigmask(info->si_signo) & FAULT_SIGNALS))
+		report->addr = (unsigned long)info->si_addr;
+	else
+		report->addr = 0;
+
+	report->ip = regs->ip;
+	report->sp = regs->sp;
+	report->bp = regs->bp;
+	report->flags = regs->flags;
+	report->ax = regs->ax;
+	report->bx = regs->bx;
+	report->cx = regs->cx;
+	report->dx = regs->dx;
+	report->si = regs->si;
+	report->di = regs->di;
+	report->r8 = regs->r8;
+	report->r9 = regs->r9;
+	report->r10 = regs->r10;
+	report->r11 = regs->r11;
+	report->r12 = regs->r12;
+	report->r13 = regs->r13;
+	report->r14 = regs->r14;
+	report->r15 = regs->r15;
+}
+
+/*
+ * Another thread that crashed would only fault again once back in user mode.
+ * It sleeps in a task work instead, get_signal() runs it right after the
+ * hook, until the restore parks or kills it: both leave a signal pending.
+ */
+static void wait_for_restore(struct callback_head *work)
+{
+	kfree(work);
+
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (signal_pending(current))
+			break;
+		schedule();
+	}
+
+	__set_current_state(TASK_RUNNING);
+}
+
+static void park_crashed_thread(void)
+{
+	struct callback_head *work;
+
+	work = kmalloc(sizeof(struct callback_head), GFP_ATOMIC);
+	if (!work)
+		return;
+
+	init_task_work(work, wait_for_restore);
+	if (task_work_add(current, work, TWA_NONE))
+		kfree(work);
+}
+
+static int take_crash_signal(int sig, kernel_siginfo_t *info)
+{
+	sigset_t mask;
+
+	// dequeue_signal() takes the signals that are not in the mask.
+	siginitsetinv(&mask, sigmask(sig));
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+	{
+		enum pid_type type;
+
+		return dequeue_signal_ptr(current, &mask, info, &type);
+	}
+#else
+	return dequeue_signal_ptr(current, &mask, info);
+#endif
+}
+
+void get_signal_hook(unsigned long ip, unsigned long parent_ip,
+		     struct ftrace_ops *op, ftrace_regs_ptr regs)
+{
+	struct sighand_struct *sighand = current->sighand;
+	struct task_data *data;
+	kernel_siginfo_t info;
+	int sig;
+
+	if (!dequeue_signal_ptr || !current->mm || current->ptrace)
+		return;
+
+	data = get_task_data_by_mm(current->mm);
+	if (!data || !have_snapshot(data) ||
+	    !(data->config & AFL_SNAPSHOT_CRASH))
+		return;
+
+	// The task is dying anyway.
+	if (fatal_signal_pending(current))
+		return;
+
+	spin_lock_irq(&sighand->siglock);
+	sig = next_crash_signal();
+	spin_unlock_irq(&sighand->siglock);
+
+	if (!sig)
+		return;
+
+	// The restore must be on its way before the signal is dropped. Queueing
+	// it may take the siglock of the snapshotted task, which can be ours.
+	if (force_restore_snapshot(data, AFL_SNAPSHOT_STATUS_CRASH))
+		return;
+
+	spin_lock_irq(&sighand->siglock);
+	sig = take_crash_signal(sig, &info);
+	spin_unlock_irq(&sighand->siglock);
+
+	if (!sig)
+		return;
+
+	DBG_PRINT("intercepted signal %d in task %d\n", sig, current->pid);
+	record_crash(data, &info);
+
+	if (current != data->tsk)
+		park_crashed_thread();
+}
+
+int get_crash_report(struct afl_snapshot_crash_report __user *arg)
+{
+	struct task_data *data = get_task_data(current);
+
+	if (!data || !have_snapshot(data))
+		return -EINVAL;
+
+	if (copy_to_user(arg, &data->ss.crash, sizeof(data->ss.crash)))
+		return -EFAULT;
+
+	return 0;
+}
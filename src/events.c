@@ -0,0 +1,431 @@
+#include "debug.h"
+#include "linux/eventfd.h"
+#include "linux/eventpoll.h"
+#include "linux/fdtable.h"
+#include "linux/file.h"
+#include "linux/fs.h"
+#include "linux/kref.h"
+#include "linux/sched/signal.h"
+#include "linux/seq_file.h"
+#include "linux/slab.h"
+#include "linux/string.h"
+#include "linux/time64.h"
+#include "linux/wait.h"
+#include "task_data.h"
+#include "snapshot.h"
+
+/*
+ * The fd table snapshot keeps the same struct file objects, so the state of
+ * the event objects behind them is shared with the running iteration. The
+ * state that event loops depend on is saved at snapshot time and put back on
+ * restore: eventfd counters, timerfd arming, signalfd masks and epoll
+ * interest lists.
+ *
+ * These objects keep their state private. The eventfd and signalfd contexts
+ * are small and have kept their layout, they are mirrored and used directly.
+ * The epoll interest list has no accessor, it is read back through the
+ * show_fdinfo() output, the same text /proc/<pid>/fdinfo shows.
+ */
+
+#define FDINFO_MAX_SIZE (1 << 20)
+
+do_epoll_ctl_t do_epoll_ctl_ptr;
+bool epoll_ctl_hooked;
+do_timerfd_gettime_t do_timerfd_gettime_ptr;
+do_timerfd_settime_t do_timerfd_settime_ptr;
+
+// Mirrors the private struct signalfd_ctx of fs/signalfd.c.
+struct signalfd_ctx {
+	sigset_t sigmask;
+};
+
+// Completes the opaque struct eventfd_ctx as fs/eventfd.c defines it.
+struct eventfd_ctx {
+	struct kref kref;
+	wait_queue_head_t wqh;
+	__u64 count;
+	unsigned int flags;
+	int id;
+};
+
+static char *read_fdinfo(struct file *file)
+{
+	struct seq_file m = {};
+	size_t size = PAGE_SIZE;
+
+	if (!file->f_op->show_fdinfo)
+		return NULL;
+
+	for (;;) {
+		m.buf = kvmalloc(size, GFP_KERNEL);
+		if (!m.buf)
+			return NULL;
+
+		m.size = size - 1;
+		m.count = 0;
+		file->f_op->show_fdinfo(&m, file);
+		if (!seq_has_overflowed(&m))
+			break;
+
+		kvfree(m.buf);
+		size <<= 1;
+		if (size > FDINFO_MAX_SIZE) {
+			WARNF("fdinfo is too big to be snapshotted");
+			return NULL;
+		}
+	}
+
+	m.buf[m.count] = '\0';
+	return m.buf;
+}
+
+static int read_eventfd_count(struct file *file, u64 *count)
+{
+	struct eventfd_ctx *ctx = eventfd_ctx_fileget(file);
+
+	if (IS_ERR(ctx))
+		return PTR_ERR(ctx);
+
+	spin_lock_irq(&ctx->wqh.lock);
+	*count = ctx->count;
+	spin_unlock_irq(&ctx->wqh.lock);
+
+	eventfd_ctx_put(ctx);
+	return 0;
+}
+
+static int read_epoll_items(struct file *file,
+			    struct snapshot_epoll_item **items,
+			    unsigned int *nr_items)
+{
+	char *info = read_fdinfo(file);
+	char *cursor, *line;
+	struct snapshot_epoll_item item;
+	struct snapshot_epoll_item *array;
+	unsigned int nr = 0, size = 0;
+	long long pos;
+
+	*items = NULL;
+	*nr_items = 0;
+
+	if (!info)
+		return -ENOMEM;
+
+	cursor = info;
+	while ((line = strsep(&cursor, "\n"))) {
+		if (sscanf(line, "tfd: %d events: %x data: %llx pos:%lli ino:%lx",
+			   &item.tfd, &item.events, &item.data, &pos,
+			   &item.ino) != 5)
+			continue;
+
+		if (nr == size) {
+			size = size ? size * 2 : 16;
+			array = krealloc(*items, size * sizeof(item), GFP_KERNEL);
+			if (!array) {
+				kfree(*items);
+				*items = NULL;
+				kvfree(info);
+				return -ENOMEM;
+			}
+			*items = array;
+		}
+
+		(*items)[nr++] = item;
+	}
+
+	*nr_items = nr;
+	kvfree(info);
+	return 0;
+}
+
+static enum snapshot_event_type get_event_type(struct file *file)
+{
+	struct eventfd_ctx *ctx;
+	const char *name = file->f_path.dentry->d_name.name;
+
+	ctx = eventfd_ctx_fileget(file);
+	if (!IS_ERR(ctx)) {
+		eventfd_ctx_put(ctx);
+		return SNAPSHOT_EVENTFD;
+	}
+
+	if (!strcmp(name, "[timerfd]"))
+		return SNAPSHOT_TIMERFD;
+	if (!strcmp(name, "[signalfd]"))
+		return SNAPSHOT_SIGNALFD;
+	if (!strcmp(name, "[eventpoll]"))
+		return SNAPSHOT_EPOLL;
+
+	return SNAPSHOT_NOT_EVENT;
+}
+
+static int save_event_file(struct task_data *data, unsigned int fd,
+			   struct file *file)
+{
+	struct snapshot_event_file *ev;
+	int res = 0;
+
+	ev = kzalloc(sizeof(struct snapshot_event_file), GFP_KERNEL);
+	if (!ev) {
+		FATAL("snapshot_event_file allocation failed");
+		return -ENOMEM;
+	}
+
+	ev->type = get_event_type(file);
+	ev->fd = fd;
+
+	switch (ev->type) {
+	case SNAPSHOT_EVENTFD:
+		res = read_eventfd_count(file, &ev->count);
+		break;
+
+	case SNAPSHOT_TIMERFD:
+		if (!do_timerfd_gettime_ptr || !do_timerfd_settime_ptr) {
+			res = -ENOENT;
+			break;
+		}
+		res = do_timerfd_gettime_ptr(fd, &ev->timer);
+		break;
+
+	case SNAPSHOT_SIGNALFD:
+		spin_lock_irq(&current->sighand->siglock);
+		ev->sigmask = ((struct signalfd_ctx *)file->private_data)->sigmask;
+		spin_unlock_irq(&current->sighand->siglock);
+		break;
+
+	case SNAPSHOT_EPOLL:
+		// Without the hook the changes to the list go unnoticed.
+		if (!do_epoll_ctl_ptr || !epoll_ctl_hooked) {
+			res = -ENOENT;
+			break;
+		}
+		res = read_epoll_items(file, &ev->items, &ev->nr_items);
+		break;
+
+	default:
+		kfree(ev);
+		return 0;
+	}
+
+	if (res) {
+		WARNF("fd %u: event object state not snapshotted: %d", fd, res);
+		kfree(ev);
+		return 0;
+	}
+
+	DBG_PRINT("saved event object state of fd %u, type %d\n", fd, ev->type);
+
+	ev->file = get_file(file);
+	list_add_tail(&ev->node, &data->ss.event_files);
+
+	return 0;
+}
+
+int take_events_snapshot(struct task_data *data)
+{
+	struct files_struct *files = current->files;
+	struct file *file;
+	unsigned int max_fds;
+	unsigned int fd;
+	int error = 0;
+
+	if (!(data->config & AFL_SNAPSHOT_FDS))
+		return 0;
+
+	rcu_read_lock();
+	max_fds = files_fdtable(files)->max_fds;
+	rcu_read_unlock();
+
+	for (fd = 0; fd < max_fds && !error; fd++) {
+		file = fget(fd);
+		if (!file)
+			continue;
+
+		error = save_event_file(data, fd, file);
+		fput(file);
+	}
+
+	data->ss.epoll_dirty = false;
+
+	return error;
+}
+
+static int restore_eventfd(struct snapshot_event_file *ev)
+{
+	struct eventfd_ctx *ctx;
+
+	ctx = eventfd_ctx_fileget(ev->file);
+	if (IS_ERR(ctx))
+		return PTR_ERR(ctx);
+
+	// Set in one step, whatever the mode and the count.
+	spin_lock_irq(&ctx->wqh.lock);
+	if (ctx->count != ev->count) {
+		ctx->count = ev->count;
+		// Readers waiting for a count and writers for room.
+		if (waitqueue_active(&ctx->wqh))
+			wake_up_locked_poll(&ctx->wqh, EPOLLIN | EPOLLOUT);
+	}
+	spin_unlock_irq(&ctx->wqh.lock);
+
+	eventfd_ctx_put(ctx);
+	return 0;
+}
+
+static int restore_signalfd(struct snapshot_event_file *ev)
+{
+	struct signalfd_ctx *ctx = ev->file->private_data;
+
+	spin_lock_irq(&current->sighand->siglock);
+	ctx->sigmask = ev->sigmask;
+	spin_unlock_irq(&current->sighand->siglock);
+
+	wake_up(&current->sighand->signalfd_wqh);
+	return 0;
+}
+
+static bool fd_is_file(unsigned int fd, struct file *file)
+{
+	struct file *current_file = fget(fd);
+	bool res = current_file == file;
+
+	if (current_file)
+		fput(current_file);
+
+	return res;
+}
+
+static struct snapshot_epoll_item *
+find_epoll_item(struct snapshot_epoll_item *items, unsigned int nr_items,
+		struct snapshot_epoll_item *item)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_items; i++) {
+		if (items[i].tfd == item->tfd && items[i].ino == item->ino)
+			return &items[i];
+	}
+
+	return NULL;
+}
+
+static int restore_epoll(struct snapshot_event_file *ev)
+{
+	struct snapshot_epoll_item *items, *item, *saved;
+	struct epoll_event epds;
+	unsigned int nr_items, i;
+	int op, res;
+
+	res = read_epoll_items(ev->file, &items, &nr_items);
+	if (res)
+		return res;
+
+	// Drop the interests added during the iteration.
+	for (i = 0; i < nr_items; i++) {
+		if (find_epoll_item(ev->items, ev->nr_items, &items[i]))
+			continue;
+
+		DBG_PRINT("epoll fd %u: removing tfd %d\n", ev->fd, items[i].tfd);
+		do_epoll_ctl_ptr(ev->fd, EPOLL_CTL_DEL, items[i].tfd, NULL,
+				 false);
+	}
+
+	// Add back the removed interests and undo the modified ones.
+	for (i = 0; i < ev->nr_items; i++) {
+		saved = &ev->items[i];
+		item = find_epoll_item(items, nr_items, saved);
+		if (item && item->events == saved->events &&
+		    item->data == saved->data)
+			continue;
+
+		op = item ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+		epds.events = saved->events;
+		epds.data = saved->data;
+
+		DBG_PRINT("epoll fd %u: restoring tfd %d\n", ev->fd, saved->tfd);
+		res = do_epoll_ctl_ptr(ev->fd, op, saved->tfd, &epds, false);
+		if (res)
+			WARNF("epoll fd %u: could not restore tfd %d: %d", ev->fd,
+			      saved->tfd, res);
+	}
+
+	kfree(items);
+	return 0;
+}
+
+int recover_events_snapshot(struct task_data *data)
+{
+	struct snapshot_event_file *ev;
+	struct itimerspec64 old;
+	int error = 0;
+	int res = 0;
+
+	if (!(data->config & AFL_SNAPSHOT_FDS))
+		return 0;
+
+	list_for_each_entry (ev, &data->ss.event_files, node) {
+		switch (ev->type) {
+		case SNAPSHOT_EVENTFD:
+			res = restore_eventfd(ev);
+			break;
+
+		case SNAPSHOT_TIMERFD:
+			if (!fd_is_file(ev->fd, ev->file))
+				continue;
+			res = do_timerfd_settime_ptr(ev->fd, 0, &ev->timer, &old);
+			break;
+
+		case SNAPSHOT_SIGNALFD:
+			res = restore_signalfd(ev);
+			break;
+
+		case SNAPSHOT_EPOLL:
+			// Interest lists only change through epoll_ctl() or
+			// when a watched fd is closed.
+			if (!data->ss.epoll_dirty ||
+			    !fd_is_file(ev->fd, ev->file))
+				continue;
+			res = restore_epoll(ev);
+			break;
+
+		default:
+			continue;
+		}
+
+		if (res) {
+			FATAL("fd %u: could not restore event object state: %d",
+			      ev->fd, res);
+			error = res;
+		}
+	}
+
+	data->ss.epoll_dirty = false;
+
+	return error;
+}
+
+void clean_events_snapshot(struct task_data *data)
+{
+	struct snapshot_event_file *ev, *next;
+
+	list_for_each_entry_safe (ev, next, &data->ss.event_files, node) {
+		list_del(&ev->node);
+		fput(ev->file);
+		kfree(ev->items);
+		kfree(ev);
+	}
+}
+
+void do_epoll_ctl_hook(unsigned long ip, unsigned long parent_ip,
+		       struct ftrace_ops *op, ftrace_regs_ptr regs)
+{
+	struct task_data *data = NULL;
+
+	// The restore itself goes through do_epoll_ctl() too.
+	if (within_module(parent_ip, THIS_MODULE) || !current->mm)
+		return;
+
+	data = get_task_data_by_mm(current->mm);
+	if (data && have_snapshot(data))
+		data->ss.epoll_dirty = true;
+}
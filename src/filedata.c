@@ -0,0 +1,276 @@
+#include "debug.h"
+#include "linux/fs.h"
+#include "linux/gfp.h"
+#include "linux/mutex.h"
+#include "linux/slab.h"
+#include "linux/types.h"
+#include "linux/xarray.h"
+#include "task_data.h"
+#include "snapshot.h"
+
+/*
+ * Regular files written or truncated during an iteration keep a copy of the
+ * pages they had before the first change, taken through a private handle so
+ * the target's offsets and flags do not matter. On restore the pages are
+ * written back and the file is truncated to its old size. Only the content of
+ * files that existed is restored: files created, renamed or removed during
+ * the iteration stay as they are.
+ */
+
+rw_verify_area_t rw_verify_area_orig;
+do_truncate_t do_truncate_orig;
+vfs_truncate_t vfs_truncate_orig;
+
+static struct task_data *get_filedata_task_data(void)
+{
+	struct task_data *data = NULL;
+
+	if (!current->mm)
+		return NULL;
+
+	data = get_task_data_by_mm(current->mm);
+	if (!data || !have_snapshot(data) ||
+	    !(data->config & AFL_SNAPSHOT_FILEDATA))
+		return NULL;
+
+	// The writes done by the restore itself are not changes.
+	if (data->ss.restoring_files)
+		return NULL;
+
+	return data;
+}
+
+// Called with dirty_files_lock held.
+static struct snapshot_file *get_snapshot_file(struct task_data *data,
+					       const struct path *path)
+{
+	struct inode *inode = d_inode(path->dentry);
+	struct snapshot_file *sf;
+	struct file *backing;
+
+	if (!S_ISREG(inode->i_mode))
+		return NULL;
+
+	list_for_each_entry (sf, &data->ss.dirty_files, node) {
+		if (file_inode(sf->backing) == inode)
+			return sf;
+	}
+
+	backing = dentry_open(path, O_RDWR | O_LARGEFILE, current_cred());
+	if (IS_ERR(backing)) {
+		WARNF("could not open a private handle to the file: %ld",
+		      PTR_ERR(backing));
+		return NULL;
+	}
+
+	sf = kmalloc(sizeof(struct snapshot_file), GFP_KERNEL);
+	if (!sf) {
+		FATAL("snapshot_file allocation failed");
+		fput(backing);
+		return NULL;
+	}
+
+	DBG_PRINT("tracking file inode %lu\n", inode->i_ino);
+
+	sf->backing = backing;
+	sf->size = i_size_read(inode);
+	xa_init(&sf->pages);
+	list_add_tail(&sf->node, &data->ss.dirty_files);
+
+	return sf;
+}
+
+// Save the original pages of [start, end) that are not saved yet.
+static void save_file_range(struct snapshot_file *sf, loff_t start, loff_t end)
+{
+	pgoff_t index;
+	loff_t pos;
+	ssize_t res;
+	void *buf, *old;
+
+	end = min(end, sf->size);
+	if (start >= end)
+		return;
+
+	for (index = start >> PAGE_SHIFT; ((loff_t)index << PAGE_SHIFT) < end;
+	     index++) {
+		if (xa_load(&sf->pages, index))
+			continue;
+
+		buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if (!buf) {
+			FATAL("could not allocate memory for file data");
+			return;
+		}
+
+		pos = (loff_t)index << PAGE_SHIFT;
+		res = kernel_read(sf->backing, buf, PAGE_SIZE, &pos);
+		if (res < 0) {
+			FATAL("could not read file data: %zd", res);
+			kfree(buf);
+			return;
+		}
+
+		old = xa_store(&sf->pages, index, buf, GFP_KERNEL);
+		if (xa_is_err(old)) {
+			FATAL("could not store file data");
+			kfree(buf);
+			return;
+		}
+	}
+}
+
+int rw_verify_area_hook(int read_write, struct file *file, const loff_t *ppos,
+			size_t count)
+{
+	struct task_data *data = NULL;
+	struct snapshot_file *sf;
+	loff_t pos;
+	int res;
+
+	res = rw_verify_area_orig(read_write, file, ppos, count);
+	if (res || read_write != WRITE || !count)
+		return res;
+
+	data = get_filedata_task_data();
+	if (!data)
+		return res;
+
+	// Appends land at the end of the file whatever the offset says.
+	if (file->f_flags & O_APPEND)
+		pos = i_size_read(file_inode(file));
+	else if (ppos)
+		pos = *ppos;
+	else
+		return res;
+
+	mutex_lock(&data->ss.dirty_files_lock);
+	sf = get_snapshot_file(data, &file->f_path);
+	if (sf)
+		save_file_range(sf, pos, pos + count);
+	mutex_unlock(&data->ss.dirty_files_lock);
+
+	return res;
+}
+
+static void save_truncated_range(struct task_data *data,
+				 const struct path *path, loff_t length)
+{
+	struct snapshot_file *sf;
+
+	mutex_lock(&data->ss.dirty_files_lock);
+	sf = get_snapshot_file(data, path);
+	if (sf)
+		save_file_range(sf, length, sf->size);
+	mutex_unlock(&data->ss.dirty_files_lock);
+}
+
+// ftruncate() and open(O_TRUNC), truncate() is handled by vfs_truncate_hook.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+int do_truncate_hook(struct user_namespace *mnt_userns, struct dentry *dentry,
+		     loff_t length, unsigned int time_attrs, struct file *filp)
+#else
+int do_truncate_hook(struct dentry *dentry, loff_t length,
+		     unsigned int time_attrs, struct file *filp)
+#endif
+{
+	struct task_data *data = get_filedata_task_data();
+
+	if (data && filp)
+		save_truncated_range(data, &filp->f_path, length);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+	return do_truncate_orig(mnt_userns, dentry, length, time_attrs, filp);
+#else
+	return do_truncate_orig(dentry, length, time_attrs, filp);
+#endif
+}
+
+long vfs_truncate_hook(const struct path *path, loff_t length)
+{
+	struct task_data *data = get_filedata_task_data();
+
+	if (data)
+		save_truncated_range(data, path, length);
+
+	return vfs_truncate_orig(path, length);
+}
+
+static void free_snapshot_file(struct snapshot_file *sf)
+{
+	unsigned long index;
+	void *buf;
+
+	xa_for_each (&sf->pages, index, buf)
+		kfree(buf);
+	xa_destroy(&sf->pages);
+
+	fput(sf->backing);
+	list_del(&sf->node);
+	kfree(sf);
+}
+
+static int restore_file(struct snapshot_file *sf)
+{
+	unsigned long index;
+	loff_t pos;
+	size_t len;
+	ssize_t res;
+	void *buf;
+
+	xa_for_each (&sf->pages, index, buf) {
+		pos = (loff_t)index << PAGE_SHIFT;
+		len = min_t(loff_t, PAGE_SIZE, sf->size - pos);
+
+		res = kernel_write(sf->backing, buf, len, &pos);
+		if (res < 0) {
+			FATAL("could not write back file data: %zd", res);
+			return res;
+		}
+	}
+
+	if (i_size_read(file_inode(sf->backing)) == sf->size)
+		return 0;
+
+	return vfs_truncate(&sf->backing->f_path, sf->size);
+}
+
+int recover_filedata_snapshot(struct task_data *data)
+{
+	struct snapshot_file *sf, *next;
+	int error = 0;
+	int res;
+
+	if (!(data->config & AFL_SNAPSHOT_FILEDATA))
+		return 0;
+
+	mutex_lock(&data->ss.dirty_files_lock);
+	data->ss.restoring_files = true;
+
+	list_for_each_entry_safe (sf, next, &data->ss.dirty_files, node) {
+		DBG_PRINT("restoring file inode %lu\n",
+			  file_inode(sf->backing)->i_ino);
+
+		res = restore_file(sf);
+		if (res)
+			error = res;
+
+		// The next iteration starts tracking from scratch.
+		free_snapshot_file(sf);
+	}
+
+	data->ss.restoring_files = false;
+	mutex_unlock(&data->ss.dirty_files_lock);
+
+	return error;
+}
+
+void clean_filedata_snapshot(struct task_data *data)
+{
+	struct snapshot_file *sf, *next;
+
+	mutex_lock(&data->ss.dirty_files_lock);
+	list_for_each_entry_safe (sf, next, &data->ss.dirty_files, node)
+		free_snapshot_file(sf);
+	mutex_unlock(&data->ss.dirty_files_lock);
+}
@@ -1,17 +1,22 @@
 #include "hook.h"
 #include "debug.h"
+#include "linux/bitmap.h"
 #include "linux/fdtable.h"
+#include "linux/file.h"
 #include "linux/fs.h"
 #include "linux/gfp.h"
 #include "linux/kallsyms.h"
 #include "linux/mm.h"
 #include "linux/printk.h"
+#include "linux/rcupdate.h"
 #include "linux/sched.h"
 #include "linux/sched/signal.h"
 #include "linux/types.h"
 #include "task_data.h"
 #include "snapshot.h"
 
+bool fd_close_untracked;
+
 static int save_file_offset(const void *p, struct file *file, unsigned int fd)
 {
 	loff_t *offsets = (loff_t *)p;
@@ -28,8 +33,8 @@ static int restore_file_offset(const void *p, struct file *file,
 	loff_t *offsets = (loff_t *)p;
 	loff_t res = -1;
 
-	/* Restore offset only when valid */
-	if (offsets[fd] < 0)
+	/* Restore offset only when valid and moved */
+	if (offsets[fd] < 0 || READ_ONCE(file->f_pos) == offsets[fd])
 		return 0;
 
 	res = vfs_llseek(file, offsets[fd], SEEK_SET);
@@ -50,6 +55,20 @@ static int restore_file_offset(const void *p, struct file *file,
 	return 0;
 }
 
+// Without the close hooks a descriptor can change unnoticed, all of them are
+// compared with the snapshot.
+static void reset_touched_fds(struct open_files_snapshot *files_snap,
+			      unsigned long *touched)
+{
+	if (fd_close_untracked) {
+		bitmap_fill(touched, files_snap->max_fds);
+		files_snap->touched_high = true;
+	} else {
+		bitmap_zero(touched, files_snap->max_fds);
+		files_snap->touched_high = false;
+	}
+}
+
 int take_files_snapshot(struct task_data *data)
 {
 	struct open_files_snapshot *files_snap = &data->ss.ss_files;
@@ -59,12 +78,14 @@ int take_files_snapshot(struct task_data *data)
 
 	unsigned int max_fds = 0;
 	loff_t *offsets = NULL;
+	unsigned long *touched = NULL;
 
 	int error = 0;
 
 	if (!(data->config & AFL_SNAPSHOT_FDS)) {
 		files_snap->files = NULL;
 		files_snap->offsets = NULL;
+		RCU_INIT_POINTER(files_snap->touched, NULL);
 		return 0;
 	}
 
@@ -92,8 +113,18 @@ int take_files_snapshot(struct task_data *data)
 	if (error)
 		goto out_release;
 
+	touched = bitmap_zalloc(max_fds, GFP_KERNEL);
+	if (!touched) {
+		error = -ENOMEM;
+		goto out_release;
+	}
+
 	files_snap->files = files_copy;
 	files_snap->offsets = offsets;
+	files_snap->max_fds = max_fds;
+	reset_touched_fds(files_snap, touched);
+	// Published last, the hooks only track once the snapshot is complete.
+	rcu_assign_pointer(files_snap->touched, touched);
 
 	return 0;
 
@@ -105,67 +136,211 @@ out:
 	return error;
 }
 
+// Close the descriptors above the snapshotted table, they are all new.
+static void close_new_fds(struct open_files_snapshot *files_snap)
+{
+	struct files_struct *files = current->files;
+	struct fdtable *fdt;
+	unsigned int fd = files_snap->max_fds;
+	unsigned int max_fds;
+
+	for (;;) {
+		rcu_read_lock();
+		fdt = files_fdtable(files);
+		max_fds = fdt->max_fds;
+		fd = find_next_bit(fdt->open_fds, max_fds, fd);
+		rcu_read_unlock();
+
+		if (fd >= max_fds)
+			break;
+
+		DBG_PRINT("closing new fd: %u\n", fd);
+		close_fd(fd);
+		fd++;
+	}
+}
+
+// Put back the file the snapshot had at fd, or close fd if it had none.
+static int restore_fd(struct open_files_snapshot *files_snap, unsigned int fd)
+{
+	/*
+	 * Locking is not necessary for the snapshotted table, nothing else
+	 * holds a reference to it.
+	 */
+	struct fdtable *saved_fdt = rcu_dereference_raw(files_snap->files->fdt);
+	struct file *saved_file = saved_fdt->fd[fd];
+	struct file *file = NULL;
+	struct fdtable *fdt;
+	int res;
+
+	rcu_read_lock();
+	fdt = files_fdtable(current->files);
+	if (fd < fdt->max_fds)
+		file = rcu_dereference(fdt->fd[fd]);
+	rcu_read_unlock();
+
+	if (file == saved_file)
+		return 0;
+
+	if (!saved_file) {
+		DBG_PRINT("closing fd: %u\n", fd);
+		close_fd(fd);
+		return 0;
+	}
+
+	DBG_PRINT("reinstalling fd: %u\n", fd);
+	res = replace_fd(fd, saved_file,
+			 close_on_exec(fd, saved_fdt) ? O_CLOEXEC : 0);
+	if (res < 0) {
+		FATAL("could not reinstall fd %u: %d", fd, res);
+		return res;
+	}
+
+	return 0;
+}
+
 int recover_files_snapshot(struct task_data *data)
 {
 	struct open_files_snapshot *files_snap = &data->ss.ss_files;
-	struct task_struct *current_task = current;
-	struct task_struct *task_iter = NULL;
-
-	struct files_struct *restored_files = NULL;
-	struct files_struct *current_old_files = NULL;
-	struct files_struct *old_files = NULL;
+	unsigned long *touched = get_touched_fds(files_snap);
+	unsigned int fd;
 	int error = 0;
+	int res;
 
 	if (!(data->config & AFL_SNAPSHOT_FDS))
 		return 0;
 
-	if (!files_snap->files || !files_snap->offsets) {
-		error = -EINVAL;
-		goto out;
+	if (!files_snap->files || !files_snap->offsets || !touched)
+		return -EINVAL;
+
+	/*
+	 * Only the descriptors touched by the hooks since the last restore are
+	 * compared with the snapshot, the table is changed in place so threads
+	 * sharing it see the restored descriptors too.
+	 */
+	if (files_snap->touched_high)
+		close_new_fds(files_snap);
+
+	for_each_set_bit (fd, touched, files_snap->max_fds) {
+		res = restore_fd(files_snap, fd);
+		if (res)
+			error = res;
 	}
 
-	DBG_PRINT("duplicating snapshotted files structure\n");
-	restored_files = dup_fd(files_snap->files, NR_OPEN_MAX, &error);
-	if (!restored_files)
-		goto out;
+	// Closing a watched fd drops it from the epoll interest lists.
+	if (files_snap->touched_high ||
+	    !bitmap_empty(touched, files_snap->max_fds))
+		data->ss.epoll_dirty = true;
 
-	DBG_PRINT("seeking all files back to the original position\n");
-	error = iterate_fd(restored_files, 0, restore_file_offset,
-			   files_snap->offsets);
-	if (error)
-		goto out_release;
+	// Our own close_fd() and replace_fd() calls marked fds too.
+	reset_touched_fds(files_snap, touched);
 
-	current_old_files = current_task->files;
+	DBG_PRINT("seeking moved files back to the original position\n");
+	res = iterate_fd(files_snap->files, 0, restore_file_offset,
+			 files_snap->offsets);
+	if (res)
+		error = res;
 
-	for_each_thread (current_task, task_iter) {
-		if (task_iter->files != current_old_files)
-			continue;
+	return error;
+}
 
-		DBG_PRINT("replacing files structure for thread in current "
-			 "process\n");
+/*
+ * Called under rcu_read_lock(), the bitmap returned stays valid until it is
+ * dropped. A rebase or a clean frees the bitmap while the other threads of
+ * the target may still be installing or closing descriptors.
+ */
+static unsigned long *get_tracked_fds(struct open_files_snapshot **files_snap)
+{
+	struct task_data *data = NULL;
 
-		if (task_iter != current_task)
-			atomic_inc(&restored_files->count);
+	if (!current->mm)
+		return NULL;
 
-		old_files = task_iter->files;
-		task_lock(task_iter);
-		task_iter->files = restored_files;
-		task_unlock(task_iter);
-		put_files_struct(old_files);
-	}
+	data = get_task_data_by_mm(current->mm);
+	if (!data || !have_snapshot(data) ||
+	    !(data->config & AFL_SNAPSHOT_FDS))
+		return NULL;
 
-	return 0;
+	*files_snap = &data->ss.ss_files;
+	return rcu_dereference((*files_snap)->touched);
+}
 
-out_release:
-	put_files_struct(restored_files);
+static void mark_fd_touched(struct open_files_snapshot *files_snap,
+			    unsigned long *touched, unsigned int fd)
+{
+	if (fd < files_snap->max_fds)
+		set_bit(fd, touched);
+	else
+		files_snap->touched_high = true;
+}
+
+static void track_fd(unsigned int fd)
+{
+	struct open_files_snapshot *files_snap;
+	unsigned long *touched;
+
+	rcu_read_lock();
+	touched = get_tracked_fds(&files_snap);
+	if (touched)
+		mark_fd_touched(files_snap, touched, fd);
+	rcu_read_unlock();
+}
+
+void fd_install_hook(unsigned long ip, unsigned long parent_ip,
+		     struct ftrace_ops *op, ftrace_regs_ptr regs)
+{
+	struct pt_regs *pregs = ftrace_get_regs(regs);
+
+	track_fd(regs_get_kernel_argument(pregs, 0));
+}
+
+void close_fd_hook(unsigned long ip, unsigned long parent_ip,
+		   struct ftrace_ops *op, ftrace_regs_ptr regs)
+{
+	struct pt_regs *pregs = ftrace_get_regs(regs);
+
+	track_fd(regs_get_kernel_argument(pregs, 0));
+}
+
+void close_range_hook(unsigned long ip, unsigned long parent_ip,
+		      struct ftrace_ops *op, ftrace_regs_ptr regs)
+{
+	struct pt_regs *pregs = ftrace_get_regs(regs);
+	unsigned int fd = regs_get_kernel_argument(pregs, 0);
+	unsigned int max_fd = regs_get_kernel_argument(pregs, 1);
+	struct open_files_snapshot *files_snap;
+	unsigned long *touched;
+
+	rcu_read_lock();
+	touched = get_tracked_fds(&files_snap);
+	if (!touched || fd >= files_snap->max_fds || fd > max_fd)
+		goto out;
+
+	// Closing a new fd above the table needs no restore.
+	max_fd = min(max_fd, files_snap->max_fds - 1);
+	bitmap_set(touched, fd, max_fd - fd + 1);
 
 out:
-	return error;
+	rcu_read_unlock();
+}
+
+// dup2() and dup3() replace newfd without going through fd_install().
+void sys_dup_hook(unsigned long ip, unsigned long parent_ip,
+		  struct ftrace_ops *op, ftrace_regs_ptr regs)
+{
+	struct pt_regs *pregs = ftrace_get_regs(regs);
+
+#ifdef CONFIG_ARCH_HAS_SYSCALL_WRAPPER
+	// The syscall wrapper takes the user registers as its only argument.
+	pregs = (struct pt_regs *)regs_get_kernel_argument(pregs, 0);
+#endif
+	track_fd(regs_get_kernel_argument(pregs, 1));
 }
 
 void clean_files_snapshot(struct task_data *data)
 {
 	struct open_files_snapshot *files_snap = &data->ss.ss_files;
+	unsigned long *touched;
 
 	if (files_snap->files) {
 		DBG_PRINT("dropping files structure snapshot\n");
@@ -178,4 +353,12 @@ void clean_files_snapshot(struct task_data *data)
 		kfree(files_snap->offsets);
 		files_snap->offsets = NULL;
 	}
+
+	touched = get_touched_fds(files_snap);
+	if (touched) {
+		RCU_INIT_POINTER(files_snap->touched, NULL);
+		// The hooks of the other threads may still be setting bits.
+		synchronize_rcu();
+		bitmap_free(touched);
+	}
 }
@@ -1,49 +1,55 @@
 #include "hook.h"
 #include "debug.h"
+#include "linux/file.h"
+#include "linux/fs.h"
 #include "linux/gfp.h"
 #include "linux/list.h"
+#include "linux/llist.h"
 #include "linux/mm.h"
 #include "linux/mmap_lock.h"
 #include "linux/types.h"
 #include "linux/pagewalk.h"
+#include "linux/rculist.h"
+#include "linux/workqueue.h"
+#include "linux/moduleparam.h"
 #include "task_data.h"
 #include "snapshot.h"
 #include "vdso/limits.h"
 
-static DEFINE_PER_CPU(struct task_struct *, last_task);
+static DEFINE_PER_CPU(const struct mm_struct *, last_mm);
 static DEFINE_PER_CPU(struct task_data *, last_task_data);
 
-static struct task_data *get_task_data_with_cache(struct task_struct *task)
+static struct task_data *get_task_data_with_cache(const struct mm_struct *mm)
 {
-	struct task_struct **cached_task = &get_cpu_var(last_task);
+	const struct mm_struct **cached_mm = &get_cpu_var(last_mm);
 	struct task_data **cached_data = &get_cpu_var(last_task_data);
 
 	struct task_data *data = NULL;
 
-	if (*cached_task == task) {
+	if (*cached_mm == mm) {
 		data = *cached_data;
 	} else {
-		data = get_task_data(task);
+		data = get_task_data_by_mm(mm);
 
-		*cached_task = task;
+		*cached_mm = mm;
 		*cached_data = data;
 	}
 
-	put_cpu_var(last_task);
+	put_cpu_var(last_mm);
 	put_cpu_var(last_task_data);
 
 	return data;
 }
 
-static void invalidate_task_data_cache(const struct task_struct *task)
+void invalidate_task_data_cache(const struct mm_struct *mm)
 {
-	struct task_struct **cached_task;
+	const struct mm_struct **cached_mm;
 	int i;
 
 	for_each_possible_cpu (i) {
-		cached_task = &per_cpu(last_task, i);
-		if (*cached_task == task) {
-			*cached_task = NULL;
+		cached_mm = &per_cpu(last_mm, i);
+		if (*cached_mm == mm) {
+			*cached_mm = NULL;
 			per_cpu(last_task_data, i) = NULL;
 		}
 	}
@@ -131,6 +137,24 @@ void include_vmrange(unsigned long start, unsigned long end)
 	list_add(&data->allowlist, &n->node);
 }
 
+void shadow_vmrange(unsigned long start, unsigned long end)
+{
+	struct task_data *data = ensure_task_data(current);
+	struct vmrange *n;
+
+	n = kmalloc(sizeof(struct vmrange), GFP_KERNEL);
+	if (!n) {
+		FATAL("vmrange_node allocation failed");
+		return;
+	}
+
+	n->start = start;
+	n->end = end;
+	INIT_LIST_HEAD(&n->node);
+
+	list_add(&n->node, &data->shadowlist);
+}
+
 static struct vmrange *intersect_blocklist(struct task_data *data,
 					   unsigned long start,
 					   unsigned long end)
@@ -159,13 +183,37 @@ static struct vmrange *intersect_allowlist(struct task_data *data,
 	return NULL;
 }
 
-static struct snapshot_vma *add_snapshot_vma(struct task_data *data,
-					     struct vm_area_struct *vma)
+static struct vmrange *intersect_shadowlist(struct task_data *data,
+					    unsigned long start,
+					    unsigned long end)
 {
-	struct snapshot_vma *ss_vma;
+	struct vmrange *n = NULL;
 
-	DBG_PRINT("adding snapshot_vma, start: 0x%016lx end: 0x%016lx\n",
-		  vma->vm_start, vma->vm_end);
+	list_for_each_entry (n, &data->shadowlist, node) {
+		if (end > n->start && start < n->end)
+			return n;
+	}
+
+	return NULL;
+}
+
+static bool is_shadow_vma(struct task_data *data, struct vm_area_struct *vma)
+{
+	if (!vma_is_anonymous(vma) || (vma->vm_flags & VM_SHARED))
+		return false;
+
+	if (intersect_shadowlist(data, vma->vm_start, vma->vm_end))
+		return true;
+
+	// Sanitizer runtimes reserve their shadow as huge NORESERVE mappings.
+	return (data->config & AFL_SNAPSHOT_SHADOW) &&
+	       (vma->vm_flags & VM_NORESERVE) &&
+	       vma->vm_end - vma->vm_start >= SNAPSHOT_SHADOW_MIN_SIZE;
+}
+
+static struct snapshot_vma *alloc_snapshot_vma(struct vm_area_struct *vma)
+{
+	struct snapshot_vma *ss_vma;
 
 	ss_vma = kmalloc(sizeof(struct snapshot_vma), GFP_KERNEL);
 	if (!ss_vma) {
@@ -175,20 +223,41 @@ static struct snapshot_vma *add_snapshot_vma(struct task_data *data,
 
 	ss_vma->vm_start = vma->vm_start;
 	ss_vma->vm_end = vma->vm_end;
+	ss_vma->track_start = vma->vm_start;
 	ss_vma->is_anonymous_private =
 		vma_is_anonymous(vma) & !(vma->vm_flags & VM_SHARED);
 	if (ss_vma->is_anonymous_private) {
 		DBG_PRINT("anonymous private mapping: 0x%016lx", vma->vm_start);
 	}
 
-	ss_vma->prot |= vma->vm_flags | VM_READ ? PROT_READ : 0;
-	ss_vma->prot |= vma->vm_flags | VM_WRITE ? PROT_WRITE : 0;
-	ss_vma->prot |= vma->vm_flags | VM_EXEC ? PROT_EXEC : 0;
+	ss_vma->prot = 0;
+	if (vma->vm_flags & VM_READ)
+		ss_vma->prot |= PROT_READ;
+	if (vma->vm_flags & VM_WRITE)
+		ss_vma->prot |= PROT_WRITE;
+	if (vma->vm_flags & VM_EXEC)
+		ss_vma->prot |= PROT_EXEC;
+
+	ss_vma->is_shadow = false;
 
 	INIT_LIST_HEAD(&ss_vma->all_vmas_node);
 	INIT_LIST_HEAD(&ss_vma->snapshotted_vmas_node);
+	INIT_LIST_HEAD(&ss_vma->shadow_vmas_node);
+
+	return ss_vma;
+}
+
+static struct snapshot_vma *add_snapshot_vma(struct task_data *data,
+					     struct vm_area_struct *vma)
+{
+	struct snapshot_vma *ss_vma;
+
+	DBG_PRINT("adding snapshot_vma, start: 0x%016lx end: 0x%016lx\n",
+		  vma->vm_start, vma->vm_end);
 
-	list_add_tail(&ss_vma->all_vmas_node, &data->ss.all_vmas);
+	ss_vma = alloc_snapshot_vma(vma);
+	if (ss_vma)
+		list_add_tail(&ss_vma->all_vmas_node, &data->ss.all_vmas);
 
 	return ss_vma;
 }
@@ -197,32 +266,36 @@ static struct snapshot_vma *add_snapshot_vma(struct task_data *data,
 void dump_memory_snapshot(struct task_data *data)
 {
 	struct snapshot_page *sp;
-	int i;
+	int i, cpu;
 
 	if (!data)
 		return;
 
 	DBG_PRINT("dumping dirty pages from task_data %p:", data);
 	hash_for_each (data->ss.ss_pages, i, sp, next) {
-		if (sp->dirty)
+		if (test_bit(SNAPSHOT_PAGE_DIRTY, &sp->flags))
 			DBG_PRINT("  %d: 0x%016lx\n", i, sp->page_base);
 	}
 
-	DBG_PRINT("dumping pages in dirty list:\n");
-	list_for_each_entry (sp, &data->ss.dirty_pages, dirty_list) {
-		DBG_PRINT("  0x%016lx\n", sp->page_base);
+	DBG_PRINT("dumping pages in dirty logs:\n");
+	for_each_possible_cpu (cpu) {
+		llist_for_each_entry (sp,
+				      per_cpu_ptr(data->ss.dirty_logs, cpu)->first,
+				      dirty_node)
+			DBG_PRINT("  %d: 0x%016lx\n", cpu, sp->page_base);
 	}
 }
 #endif
 
+// Called under rcu_read_lock(), like get_snapshot_page().
 static bool is_snapshotted_address(struct task_data *data,
 				   unsigned long page_base)
 {
 	struct snapshot_vma *ss_vma;
 
-	list_for_each_entry (ss_vma, &data->ss.snapshotted_vmas,
-			     snapshotted_vmas_node) {
-		if (ss_vma->vm_start <= page_base &&
+	list_for_each_entry_rcu (ss_vma, &data->ss.snapshotted_vmas,
+				 snapshotted_vmas_node) {
+		if (ss_vma->track_start <= page_base &&
 		    page_base < ss_vma->vm_end) {
 			return true;
 		}
@@ -235,15 +308,25 @@ static bool is_snapshotted_address(struct task_data *data,
 	return false;
 }
 
+/*
+ * The entries and their content are freed after a grace period. The hooks run
+ * in other threads than the one cleaning the snapshot, they hold
+ * rcu_read_lock() for as long as they use the entry. The owner of the snapshot
+ * is the only one freeing entries and needs no read section.
+ */
 static struct snapshot_page *get_snapshot_page(struct task_data *data,
 					       unsigned long page_base)
 {
 	struct snapshot_page *sp;
 
-	hash_for_each_possible (data->ss.ss_pages, sp, next, page_base) {
-		if (sp->page_base == page_base)
+	rcu_read_lock();
+	hash_for_each_possible_rcu (data->ss.ss_pages, sp, next, page_base) {
+		if (sp->page_base == page_base) {
+			rcu_read_unlock();
 			return sp;
+		}
 	}
+	rcu_read_unlock();
 
 	return NULL;
 }
@@ -253,30 +336,247 @@ static struct snapshot_page *add_snapshot_page(struct task_data *data,
 					       bool attempt_reuse)
 {
 	struct snapshot_page *sp = NULL;
+	struct snapshot_page *old;
 
 	if (attempt_reuse)
 		sp = get_snapshot_page(data, page_base);
-	if (sp == NULL) {
-		sp = kmalloc(sizeof(struct snapshot_page), GFP_ATOMIC);
-		if (!sp) {
-			FATAL("could not allocate snapshot_page");
-			return NULL;
+	if (sp) {
+		// The page is saved again, a shared copy must not be written.
+		if (sp->pristine) {
+			release_page_data(sp);
+			atomic_long_sub(PAGE_SIZE, &data->ss.saved_bytes);
 		}
+		sp->page_prot = 0;
+		sp->flags = 0;
+		return sp;
+	}
 
-		sp->page_base = page_base;
-		sp->page_data = NULL;
-		hash_add(data->ss.ss_pages, &sp->next, sp->page_base);
-		INIT_LIST_HEAD(&sp->dirty_list);
+	sp = kmalloc(sizeof(struct snapshot_page), GFP_ATOMIC);
+	if (!sp) {
+		FATAL("could not allocate snapshot_page");
+		return NULL;
 	}
 
+	sp->page_base = page_base;
 	sp->page_prot = 0;
-	sp->has_been_copied = false;
-	sp->dirty = false;
-	sp->in_dirty_list = false;
+	sp->page_data = NULL;
+	sp->pristine = NULL;
+	sp->flags = 0;
+
+	// Threads faulting on the same page at the same time add it only once.
+	spin_lock(&data->ss.ss_pages_lock);
+	old = get_snapshot_page(data, page_base);
+	if (!old)
+		hash_add_rcu(data->ss.ss_pages, &sp->next, sp->page_base);
+	spin_unlock(&data->ss.ss_pages_lock);
+
+	if (old) {
+		kfree(sp);
+		return old;
+	}
+
+	atomic_long_add(sizeof(struct snapshot_page), &data->ss.saved_bytes);
+
+	return sp;
+}
+
+// Each page is logged once per iteration, on the CPU that dirtied it first.
+// Pages without a PTE at snapshot time can be seen by several hooks.
+static bool log_dirty_page(struct task_data *data, struct snapshot_page *sp)
+{
+	if (test_and_set_bit(SNAPSHOT_PAGE_IN_DIRTY_LOG, &sp->flags))
+		return false;
+
+	llist_add(&sp->dirty_node, raw_cpu_ptr(data->ss.dirty_logs));
+	return true;
+}
+
+// Take the per-CPU dirty logs and chain them into a single list.
+static struct llist_node *collect_dirty_pages(struct task_data *data)
+{
+	struct llist_node *head = NULL;
+	struct llist_node *first, *last;
+	int cpu;
+
+	for_each_possible_cpu (cpu) {
+		first = llist_del_all(per_cpu_ptr(data->ss.dirty_logs, cpu));
+		if (!first)
+			continue;
+
+		for (last = first; last->next; last = last->next)
+			;
+		last->next = head;
+		head = first;
+	}
+
+	return head;
+}
+
+static void drop_dirty_logs(struct task_data *data)
+{
+	int cpu;
+
+	for_each_possible_cpu (cpu)
+		init_llist_head(per_cpu_ptr(data->ss.dirty_logs, cpu));
+}
+
+static bool is_shadow_address(struct task_data *data, unsigned long page_base)
+{
+	struct snapshot_vma *ss_vma;
+
+	list_for_each_entry (ss_vma, &data->ss.shadow_vmas, shadow_vmas_node) {
+		if (ss_vma->vm_start <= page_base && page_base < ss_vma->vm_end)
+			return true;
+	}
+
+	return false;
+}
+
+// Shadow pages are tracked in a sparse bitmap, one leaf page of bits for
+// every SNAPSHOT_SHADOW_LEAF_PAGES pages that have been touched.
+static bool mark_shadow_page(struct task_data *data, unsigned long page_base)
+{
+	unsigned long pfn = page_base >> PAGE_SHIFT;
+	unsigned long index = pfn / SNAPSHOT_SHADOW_LEAF_PAGES;
+	unsigned long *leaf, *old;
+
+	leaf = xa_load(&data->ss.shadow_touched, index);
+	if (!leaf) {
+		leaf = kzalloc(PAGE_SIZE, GFP_ATOMIC);
+		if (!leaf) {
+			FATAL("could not allocate shadow bitmap leaf");
+			return false;
+		}
+
+		old = xa_cmpxchg(&data->ss.shadow_touched, index, NULL, leaf,
+				 GFP_ATOMIC);
+		if (xa_is_err(old)) {
+			FATAL("could not store shadow bitmap leaf");
+			kfree(leaf);
+			return false;
+		}
+
+		if (old) {
+			kfree(leaf);
+			leaf = old;
+		}
+	}
+
+	set_bit(pfn % SNAPSHOT_SHADOW_LEAF_PAGES, leaf);
+	return true;
+}
+
+// The mappings may have changed since the pages were touched, only the parts
+// of the run that still lie in a shadow mapping are zapped.
+static void zap_shadow_range(struct task_data *data, unsigned long start,
+			     unsigned long end)
+{
+	struct vm_area_struct *vma = find_vma(current->mm, start);
+	unsigned long from, to;
+
+	for (; vma && vma->vm_start < end; vma = vma->vm_next) {
+		from = max(start, vma->vm_start);
+		to = min(end, vma->vm_end);
+
+		if (is_shadow_vma(data, vma) && is_shadow_address(data, from))
+			k_zap_page_range(vma, from, to - from);
+	}
+}
+
+// Zap every run of touched shadow pages, the next access maps the zero page
+// again. The caller holds the mmap lock.
+static void reset_shadow_pages(struct task_data *data)
+{
+	unsigned long index, first, last, start;
+	unsigned long *leaf;
+
+	xa_for_each (&data->ss.shadow_touched, index, leaf) {
+		first = find_first_bit(leaf, SNAPSHOT_SHADOW_LEAF_PAGES);
+		while (first < SNAPSHOT_SHADOW_LEAF_PAGES) {
+			last = find_next_zero_bit(leaf,
+						  SNAPSHOT_SHADOW_LEAF_PAGES,
+						  first);
+			start = (index * SNAPSHOT_SHADOW_LEAF_PAGES + first)
+				<< PAGE_SHIFT;
+
+			DBG_PRINT("zapping shadow 0x%016lx - 0x%016lx\n", start,
+				  start + ((last - first) << PAGE_SHIFT));
+			zap_shadow_range(data, start,
+					 start + ((last - first) << PAGE_SHIFT));
+
+			first = find_next_bit(leaf, SNAPSHOT_SHADOW_LEAF_PAGES,
+					      last);
+		}
+
+		bitmap_zero(leaf, SNAPSHOT_SHADOW_LEAF_PAGES);
+	}
+}
+
+static void clean_shadow_pages(struct task_data *data)
+{
+	unsigned long index;
+	unsigned long *leaf;
+
+	xa_for_each (&data->ss.shadow_touched, index, leaf)
+		kfree(leaf);
+
+	xa_destroy(&data->ss.shadow_touched);
+}
+
+// Shared pages are added the first time they are written, the pages that
+// were not mapped at snapshot time still hold their content in the page cache.
+static struct snapshot_page *get_shared_snapshot_page(struct task_data *data,
+						      unsigned long page_base)
+{
+	struct snapshot_page *sp;
+
+	sp = get_snapshot_page(data, page_base);
+	if (sp)
+		return sp;
+
+	if (!is_snapshotted_address(data, page_base) ||
+	    intersect_blocklist(data, page_base, page_base + PAGE_SIZE))
+		return NULL;
+
+	DBG_PRINT("adding shared page to snapshot: 0x%08lx\n", page_base);
+	sp = add_snapshot_page(data, page_base, false);
+	if (!sp)
+		return NULL;
+
+	set_bit(SNAPSHOT_PAGE_HAD_PTE, &sp->flags);
+	set_snapshot_page_shared(sp);
 
 	return sp;
 }
 
+static int make_shared_snapshot_page(struct task_data *data,
+				     struct mm_struct *mm, unsigned long addr,
+				     pte_t *pte)
+{
+	struct snapshot_page *sp;
+
+	if (!pte_present(*pte))
+		return 0;
+
+	sp = add_snapshot_page(data, addr, true);
+	if (!sp)
+		return -ENOMEM;
+
+	set_bit(SNAPSHOT_PAGE_HAD_PTE, &sp->flags);
+	set_snapshot_page_shared(sp);
+
+	if (pte_write(*pte)) {
+		/* Shared rw page, the first write is caught by do_wp_page */
+		DBG_PRINT("shared writable addr: 0x%08lx\n", addr);
+		ptep_set_wrprotect(mm, addr, pte);
+		k_flush_tlb_mm_range(mm, addr & PAGE_MASK,
+				     (addr & PAGE_MASK) + PAGE_SIZE, PAGE_SHIFT,
+				     false);
+	}
+
+	return 0;
+}
+
 static int make_snapshot_page(struct task_data *data, struct mm_struct *mm,
 			      unsigned long addr, pte_t *pte)
 {
@@ -294,11 +594,11 @@ static int make_snapshot_page(struct task_data *data, struct mm_struct *mm,
 
 	if (pte_none(*pte)) {
 		/* empty pte */
-		sp->has_had_pte = false;
+		clear_bit(SNAPSHOT_PAGE_HAD_PTE, &sp->flags);
 		set_snapshot_page_none_pte(sp);
 
 	} else {
-		sp->has_had_pte = true;
+		set_bit(SNAPSHOT_PAGE_HAD_PTE, &sp->flags);
 		if (pte_write(*pte)) {
 			/* Private rw page */
 			DBG_PRINT("private writable addr: 0x%08lx\n", addr);
@@ -321,10 +621,36 @@ static int make_snapshot_page(struct task_data *data, struct mm_struct *mm,
 	return 0;
 }
 
+static int make_shadow_snapshot_page(struct task_data *data,
+				     struct mm_struct *mm, unsigned long addr,
+				     pte_t *pte)
+{
+	void *mapped_page_addr;
+	bool is_zero;
+
+	if (!pte_present(*pte))
+		return 0;
+
+	if (is_zero_pfn(pte_pfn(*pte))) {
+		is_zero = true;
+	} else {
+		mapped_page_addr = kmap_local_page(pte_page(*pte));
+		is_zero = !memchr_inv(mapped_page_addr, 0, PAGE_SIZE);
+		kunmap_local(mapped_page_addr);
+	}
+
+	// Zero pages are dropped once the walk is over, they need no copy.
+	if (is_zero)
+		return mark_shadow_page(data, addr) ? 0 : -ENOMEM;
+
+	return make_snapshot_page(data, mm, addr, pte);
+}
+
 struct snapshot_walk_data {
 	struct task_data *task_data;
 	unsigned long next_allowed_address;
 	unsigned long next_blocked_address;
+	bool shadow;
 };
 
 static int snapshot_walk_check_range(unsigned long addr, unsigned long next,
@@ -424,6 +750,14 @@ static int snapshot_pte_entry(pte_t *pte, unsigned long addr,
 	if (snapshot_walk_check_range(addr, next, walk) == ACTION_CONTINUE)
 		return 0;
 
+	if (walk->vma->vm_flags & VM_SHARED)
+		return make_shared_snapshot_page(walk_data->task_data, walk->mm,
+						 addr, pte);
+
+	if (walk_data->shadow)
+		return make_shadow_snapshot_page(walk_data->task_data,
+						 walk->mm, addr, pte);
+
 	return make_snapshot_page(walk_data->task_data, walk->mm, addr, pte);
 }
 
@@ -435,18 +769,67 @@ static const struct mm_walk_ops snapshot_walk_ops = {
 	.pte_entry = snapshot_pte_entry,
 };
 
-// TODO: This seems broken?
-// If I have a page that is right below the page of the stack, then it will count as a stack page.
-inline bool is_stack(struct vm_area_struct *vma)
+// The stack is the main stack when it holds the stack pointer at snapshot
+// time. Thread, coroutine and ucontext stacks are ordinary mappings that can
+// hold live data below the stack pointer, they are snapshotted whole.
+static inline bool is_stack(struct vm_area_struct *vma, unsigned long sp)
+{
+	unsigned long start_stack = vma->vm_mm->start_stack;
+
+	if (!(vma->vm_flags & VM_GROWSDOWN) &&
+	    !(vma->vm_start <= start_stack && start_stack < vma->vm_end))
+		return false;
+
+	return vma->vm_start <= sp && sp < vma->vm_end;
+}
+
+// Everything below the red zone of the snapshot stack pointer is dead once
+// the snapshot is restored, so only the live frames above it are tracked.
+static int snapshot_stack(struct task_data *data, struct snapshot_vma *ss_vma,
+			  struct vm_area_struct *vma, unsigned long sp,
+			  struct snapshot_walk_data *walk_data)
 {
-	return vma->vm_start <= vma->vm_mm->start_stack &&
-	       vma->vm_end >= vma->vm_mm->start_stack;
+	ss_vma->track_start =
+		max(vma->vm_start, (sp - SNAPSHOT_STACK_REDZONE) & PAGE_MASK);
+	data->ss.stack_start = ss_vma->track_start;
+
+	DBG_PRINT("Stack tracked from 0x%08lx, sp: 0x%08lx\n",
+		  ss_vma->track_start, sp);
+
+	return walk_page_range(vma->vm_mm, ss_vma->track_start, vma->vm_end,
+			       &snapshot_walk_ops, walk_data);
+}
+
+static bool should_snapshot_vma(struct task_data *data,
+				struct vm_area_struct *vma, unsigned long sp)
+{
+	if (intersect_allowlist(data, vma->vm_start, vma->vm_end))
+		return true;
+
+	// By default, only writable pages are snapshotted.
+	if (!(vma->vm_flags & VM_WRITE))
+		return false;
+
+	// By default, shared memory pages are skipped.
+	if ((vma->vm_flags & VM_SHARED) && !(data->config & AFL_SNAPSHOT_SHARED))
+		return false;
+
+	// Skip all non whitelisted mappings if BLOCK is specified.
+	if (data->config & AFL_SNAPSHOT_BLOCK)
+		return false;
+
+	// Skip the stack if NOSTACK is specified.
+	if ((data->config & AFL_SNAPSHOT_NOSTACK) && is_stack(vma, sp))
+		return false;
+
+	return true;
 }
 
 int take_memory_snapshot(struct task_data *data)
 {
 	struct vm_area_struct *pvma = NULL;
 	struct snapshot_vma *ss_vma = NULL;
+	unsigned long sp = user_stack_pointer(&data->ss.regs);
 	int res = 0;
 
 	struct snapshot_walk_data walk_data = {
@@ -463,7 +846,9 @@ int take_memory_snapshot(struct task_data *data)
 		DBG_PRINT("Blocklist: 0x%08lx - 0x%08lx\n", n->start, n->end);
 #endif
 
-	invalidate_task_data_cache(data->tsk);
+	invalidate_task_data_cache(data->mm);
+
+	data->ss.stack_start = 0;
 
 	mmap_read_lock(current->mm);
 	for (pvma = current->mm->mmap; pvma; pvma = pvma->vm_next) {
@@ -473,34 +858,36 @@ int take_memory_snapshot(struct task_data *data)
 			goto unlock;
 		}
 
-		if (!intersect_allowlist(data, pvma->vm_start, pvma->vm_end)) {
-			// By default, only writable pages are snapshotted.
-			if (!(pvma->vm_flags & VM_WRITE))
-				continue;
-
-			// By default, shared memory pages are skipped.
-			if (pvma->vm_flags & VM_SHARED)
-				continue;
-
-			// Skip all non whitelisted mappings if BLOCK is specified.
-			if (data->config & AFL_SNAPSHOT_BLOCK)
-				continue;
-
-			// Skip the stack if NOSTACK is specified.
-			if ((data->config & AFL_SNAPSHOT_NOSTACK) &&
-			    is_stack(pvma))
-				continue;
-		}
+		if (!should_snapshot_vma(data, pvma, sp))
+			continue;
 
 		DBG_PRINT("Make snapshot start: 0x%08lx end: 0x%08lx\n",
 			  pvma->vm_start, pvma->vm_end);
 		list_add_tail(&ss_vma->snapshotted_vmas_node,
 			      &data->ss.snapshotted_vmas);
-		res = walk_page_vma(pvma, &snapshot_walk_ops, &walk_data);
+
+		walk_data.shadow = is_shadow_vma(data, pvma);
+		if (walk_data.shadow) {
+			DBG_PRINT("Shadow mapping start: 0x%08lx end: 0x%08lx\n",
+				  pvma->vm_start, pvma->vm_end);
+			ss_vma->is_shadow = true;
+			list_add_tail(&ss_vma->shadow_vmas_node,
+				      &data->ss.shadow_vmas);
+		}
+
+		if (is_stack(pvma, sp))
+			res = snapshot_stack(data, ss_vma, pvma, sp,
+					     &walk_data);
+		else
+			res = walk_page_vma(pvma, &snapshot_walk_ops,
+					    &walk_data);
 		if (res)
 			goto unlock;
 	}
 
+	// Drop the shadow pages that were found to be zero during the walk.
+	reset_shadow_pages(data);
+
 unlock:
 	mmap_read_unlock(current->mm);
 
@@ -556,12 +943,21 @@ success:
 	return 0;
 }
 
+// The layout restored, the one of the top level if there is any.
+struct list_head *snapshot_layout(struct task_data *data)
+{
+	struct snapshot_level *level = top_snapshot_level(&data->ss);
+
+	return level ? &level->vmas : &data->ss.all_vmas;
+}
+
 static int restore_vmas(struct task_data *data)
 {
-	struct vm_area_struct *vma_iter = data->tsk->mm->mmap;
+	struct list_head *layout = snapshot_layout(data);
+	struct vm_area_struct *vma_iter = current->mm->mmap;
 	struct vm_area_struct *next_vma_iter = NULL;
-	struct snapshot_vma *ss_vma_iter = list_first_entry(
-		&data->ss.all_vmas, struct snapshot_vma, all_vmas_node);
+	struct snapshot_vma *ss_vma_iter =
+		list_first_entry(layout, struct snapshot_vma, all_vmas_node);
 
 	unsigned long cursor = 0;
 	unsigned long next_cursor = 0;
@@ -576,8 +972,8 @@ static int restore_vmas(struct task_data *data)
 
 	DBG_PRINT("unmapping new vmas:\n");
 
-	while (vma_iter || !list_entry_is_head(ss_vma_iter, &data->ss.all_vmas,
-					       all_vmas_node)) {
+	while (vma_iter ||
+	       !list_entry_is_head(ss_vma_iter, layout, all_vmas_node)) {
 		// Calculate next valid positions for vma lists.
 		if (vma_iter) {
 			// `vm_munmap` may free the `vm_area_struct`, so save `vm_next` here.
@@ -589,8 +985,7 @@ static int restore_vmas(struct task_data *data)
 			next_vma_pos = ULONG_MAX;
 		}
 
-		if (!list_entry_is_head(ss_vma_iter, &data->ss.all_vmas,
-					all_vmas_node)) {
+		if (!list_entry_is_head(ss_vma_iter, layout, all_vmas_node)) {
 			next_ss_vma_pos = in_ss_vmas ? ss_vma_iter->vm_end :
 							     ss_vma_iter->vm_start;
 		} else {
@@ -649,16 +1044,146 @@ static int restore_vmas(struct task_data *data)
 	return 0;
 }
 
-static void do_recover_page(struct snapshot_page *sp)
+static int restore_range_prot(struct task_data *data, unsigned long start,
+			      unsigned long end, unsigned long *exec_start,
+			      unsigned long *exec_end)
+{
+	struct mm_struct *mm = current->mm;
+	struct vm_area_struct *vma, *prev;
+	struct snapshot_vma *ss_vma;
+	unsigned long lo, hi, vm_start, vm_end, newflags;
+	int res;
+
+	list_for_each_entry (ss_vma, snapshot_layout(data), all_vmas_node) {
+		if (ss_vma->vm_end <= start)
+			continue;
+		if (ss_vma->vm_start >= end)
+			break;
+
+		lo = max(start, ss_vma->vm_start);
+		hi = min(end, ss_vma->vm_end);
+
+		for (vma = find_vma(mm, lo); vma && vma->vm_start < hi;
+		     vma = prev->vm_next) {
+			vm_start = max(lo, vma->vm_start);
+			vm_end = min(hi, vma->vm_end);
+			prev = vm_start > vma->vm_start ? vma : vma->vm_prev;
+
+			newflags = (vma->vm_flags &
+				    ~(VM_READ | VM_WRITE | VM_EXEC)) |
+				   calc_vm_prot_bits(ss_vma->prot, 0);
+
+			// Pages whose executable permission flips need their
+			// icache flushed, do it once for all ranges at the end.
+			if ((vma->vm_flags ^ newflags) & VM_EXEC) {
+				*exec_start = min(*exec_start, vm_start);
+				*exec_end = max(*exec_end, vm_end);
+			}
+
+			DBG_PRINT("restoring prot 0x%lx on 0x%016lx - 0x%016lx\n",
+				  ss_vma->prot, vm_start, vm_end);
+			res = mprotect_fixup(vma, &prev, vm_start, vm_end,
+					     newflags);
+			if (res) {
+				FATAL("mprotect_fixup failed, start: 0x%016lx, end: 0x%016lx, res: %d\n",
+				      vm_start, vm_end, res);
+				return res;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// The ranges are consumed unless keep is set.
+static int restore_vma_prots(struct task_data *data, bool keep)
+{
+	struct mm_struct *mm = current->mm;
+	struct snapshot_prot_range *range, *n;
+	unsigned long exec_start = ULONG_MAX;
+	unsigned long exec_end = 0;
+	int res = 0;
+
+	if (list_empty(&data->ss.prot_changes))
+		return 0;
+
+	DBG_PRINT("restoring changed protections:\n");
+
+	mmap_write_lock(mm);
+	list_for_each_entry_safe (range, n, &data->ss.prot_changes, node) {
+		if (!res)
+			res = restore_range_prot(data, range->start, range->end,
+						 &exec_start, &exec_end);
+		if (keep)
+			continue;
+		list_del(&range->node);
+		kfree(range);
+	}
+	mmap_write_unlock(mm);
+
+	// mprotect_fixup() already flushed the TLB for every changed range.
+	if (exec_start < exec_end)
+		flush_icache_user_range(exec_start, exec_end);
+
+	return res;
+}
+
+// Content of the page when the top level was pushed, NULL if it did not
+// change since the base snapshot.
+static void *get_level_page_data(struct task_data *data,
+				 struct snapshot_page *sp)
 {
+	struct snapshot_level *level;
+	void *content;
+
+	// The closest level saved the latest content.
+	list_for_each_entry (level, &data->ss.levels, node) {
+		content = xa_load(&level->pages, sp->page_base >> PAGE_SHIFT);
+		if (content)
+			return content;
+	}
+
+	return NULL;
+}
+
+static void do_recover_page(struct task_data *data, struct snapshot_page *sp)
+{
+	void *content = get_level_page_data(data, sp);
+
+	if (!content)
+		content = sp->page_data;
+
 	DBG_PRINT(
 		"found reserved page: 0x%08lx page_base: 0x%08lx page_prot: 0x%08lx\n",
-		(unsigned long)sp->page_data, (unsigned long)sp->page_base,
+		(unsigned long)content, (unsigned long)sp->page_base,
 		sp->page_prot);
-	if (copy_to_user((void __user *)sp->page_base, sp->page_data,
-			 PAGE_SIZE) != 0)
+	if (copy_to_user((void __user *)sp->page_base, content, PAGE_SIZE) != 0)
 		DBG_PRINT("incomplete copy_to_user\n");
-	sp->dirty = false;
+	clear_bit(SNAPSHOT_PAGE_DIRTY, &sp->flags);
+}
+
+// Write protect the page again, its next write is caught by do_wp_page.
+static void protect_snapshot_page(struct mm_struct *mm,
+				  struct snapshot_page *sp)
+{
+	pte_t *pte;
+
+	pte = walk_page_table(sp->page_base);
+	if (!pte)
+		return;
+
+	/* Private rw page */
+	DBG_PRINT("private writable addr: 0x%08lx\n", sp->page_base);
+	ptep_set_wrprotect(mm, sp->page_base, pte);
+	if (!is_snapshot_page_shared(sp) && !is_snapshot_page_none_pte(sp))
+		set_snapshot_page_private(sp);
+
+	/* flush tlb to make the pte change effective */
+	k_flush_tlb_mm_range(mm, sp->page_base, sp->page_base + PAGE_SIZE,
+			     PAGE_SHIFT, false);
+	DBG_PRINT("writable now: %d\n", pte_write(*pte));
+
+	pte_unmap(pte);
 }
 
 static void do_recover_none_pte(struct snapshot_page *sp)
@@ -672,13 +1197,41 @@ static void do_recover_none_pte(struct snapshot_page *sp)
 	k_zap_page_range(mm->mmap, sp->page_base, PAGE_SIZE);
 }
 
+// Zap the stack below the snapshot frames, it faults back in as zero pages.
+// Registers are restored first, so without AFL_SNAPSHOT_REGS the frames of
+// the current stack pointer are kept too.
+static void reset_stack_scratch(struct task_data *data)
+{
+	struct mm_struct *mm = current->mm;
+	struct vm_area_struct *vma;
+	unsigned long sp = user_stack_pointer(task_pt_regs(current));
+	unsigned long end;
+
+	if (!data->ss.stack_start)
+		return;
+
+	end = min(data->ss.stack_start,
+		  (sp - SNAPSHOT_STACK_REDZONE) & PAGE_MASK);
+
+	mmap_read_lock(mm);
+	vma = find_vma(mm, data->ss.stack_start);
+	if (vma && vma->vm_start < end) {
+		DBG_PRINT("zapping stack 0x%016lx - 0x%016lx\n", vma->vm_start,
+			  end);
+		k_zap_page_range(vma, vma->vm_start, end - vma->vm_start);
+	}
+	mmap_read_unlock(mm);
+}
+
 int recover_memory_snapshot(struct task_data *data)
 {
 	struct snapshot_page *sp;
 	struct snapshot_page *n;
+	struct llist_node *dirty_pages;
 
 	struct mm_struct *mm = data->tsk->mm;
-	pte_t *pte;
+	void *content;
+	u64 nr_dirty = 0;
 
 	int res = 0;
 
@@ -688,122 +1241,810 @@ int recover_memory_snapshot(struct task_data *data)
 			return res;
 	}
 
-	list_for_each_entry_safe (sp, n, &data->ss.dirty_pages, dirty_list) {
-		DBG_PRINT("restoring page: 0x%016lx\n", sp->page_base);
-
-		if (sp->dirty && sp->has_been_copied) {
-			// it has been captured by page fault
+	// Protections have to be back before the pages are copied, otherwise
+	// copy_to_user() fails on pages that were made read-only.
+	res = restore_vma_prots(data, false);
+	if (res)
+		return res;
 
-			do_recover_page(sp); // copy old content
-			sp->has_had_pte = true;
+	if (!list_empty(&data->ss.shadow_vmas)) {
+		mmap_read_lock(mm);
+		reset_shadow_pages(data);
+		mmap_read_unlock(mm);
+	}
 
-			pte = walk_page_table(sp->page_base);
-			if (!pte)
-				continue;
+	reset_stack_scratch(data);
 
-			/* Private rw page */
-			DBG_PRINT("private writable addr: 0x%08lx\n",
-				  sp->page_base);
-			ptep_set_wrprotect(mm, sp->page_base, pte);
-			set_snapshot_page_private(sp);
+	dirty_pages = collect_dirty_pages(data);
+	llist_for_each_entry_safe (sp, n, dirty_pages, dirty_node) {
+		DBG_PRINT("restoring page: 0x%016lx\n", sp->page_base);
+		nr_dirty++;
 
-			/* flush tlb to make the pte change effective */
-			k_flush_tlb_mm_range(mm, sp->page_base,
-					     sp->page_base + PAGE_SIZE,
-					     PAGE_SHIFT, false);
-			DBG_PRINT("writable now: %d\n", pte_write(*pte));
+		if (test_bit(SNAPSHOT_PAGE_DIRTY, &sp->flags) &&
+		    test_bit(SNAPSHOT_PAGE_COPIED, &sp->flags)) {
+			// it has been captured by page fault
 
-			pte_unmap(pte);
+			do_recover_page(data, sp); // copy old content
+			set_bit(SNAPSHOT_PAGE_HAD_PTE, &sp->flags);
+			protect_snapshot_page(mm, sp);
+			share_page_data(sp);
 
 		} else if (is_snapshot_page_private(sp)) {
 			// private page that has not been captured
 			// still write protected
 
-		} else if (is_snapshot_page_none_pte(sp) && sp->has_had_pte) {
+		} else if (is_snapshot_page_none_pte(sp) &&
+			   (content = get_level_page_data(data, sp))) {
+			// Populated under a level, it gets that content back.
+			if (copy_to_user((void __user *)sp->page_base, content,
+					 PAGE_SIZE) != 0)
+				DBG_PRINT("incomplete copy_to_user\n");
+			set_bit(SNAPSHOT_PAGE_HAD_PTE, &sp->flags);
+			protect_snapshot_page(mm, sp);
+
+		} else if (is_snapshot_page_none_pte(sp) &&
+			   test_bit(SNAPSHOT_PAGE_HAD_PTE, &sp->flags)) {
 			do_recover_none_pte(sp);
 
 			set_snapshot_page_none_pte(sp);
-			sp->has_had_pte = false;
+			clear_bit(SNAPSHOT_PAGE_HAD_PTE, &sp->flags);
 		}
 
-		if (!sp->in_dirty_list) {
-			WARNF("in_dirty_list not set: 0x%016lx\n",
-			      sp->page_base);
-		}
-		sp->in_dirty_list = false;
-		list_del(&sp->dirty_list);
+		// The next entry was read already, the page can be logged again.
+		if (!test_and_clear_bit(SNAPSHOT_PAGE_IN_DIRTY_LOG, &sp->flags))
+			WARNF("in_dirty_log not set: 0x%016lx\n", sp->page_base);
 	}
 
+	data->ss.stats.dirty_pages = nr_dirty;
+
 	return 0;
 }
 
-static void clean_snapshot_vmas(struct task_data *data)
+/*
+ * A process forked from the snapshotting one shares its pages copy-on-write.
+ * Its memory is brought back to the snapshot from the records of the parent,
+ * which are only read while the parent waits for the child.
+ */
+int fork_memory_snapshot(struct task_data *parent)
 {
-	struct snapshot_vma *ss_vma, *next;
+	struct snapshot_page *sp;
+	void *content;
+	int res, cpu;
 
-	DBG_PRINT("freeing snapshot vmas:\n");
+	if (parent->config & AFL_SNAPSHOT_MMAP) {
+		res = restore_vmas(parent);
+		if (res)
+			return res;
+	}
+
+	res = restore_vma_prots(parent, true);
+	if (res)
+		return res;
+
+	reset_stack_scratch(parent);
+
+	for_each_possible_cpu (cpu) {
+		llist_for_each_entry (sp,
+				      per_cpu_ptr(parent->ss.dirty_logs, cpu)->first,
+				      dirty_node) {
+			content = get_level_page_data(parent, sp);
+			if (!content && test_bit(SNAPSHOT_PAGE_DIRTY, &sp->flags) &&
+			    test_bit(SNAPSHOT_PAGE_COPIED, &sp->flags))
+				content = sp->page_data;
+
+			if (content) {
+				DBG_PRINT("restoring forked page: 0x%016lx\n",
+					  sp->page_base);
+				if (copy_to_user((void __user *)sp->page_base,
+						 content, PAGE_SIZE) != 0)
+					DBG_PRINT("incomplete copy_to_user\n");
+			} else if (is_snapshot_page_none_pte(sp) &&
+				   test_bit(SNAPSHOT_PAGE_HAD_PTE, &sp->flags)) {
+				do_recover_none_pte(sp);
+			}
+		}
+	}
+
+	return 0;
+}
+
+// A page of a private file mapping that has no copy of its own still reads
+// as the file, only anonymous mappings read as zero.
+static bool read_file_page(unsigned long page_base, void *buf)
+{
+	struct mm_struct *mm = current->mm;
+	struct vm_area_struct *vma;
+	struct file *file = NULL;
+	loff_t pos = 0;
+	ssize_t res;
+
+	mmap_read_lock(mm);
+	vma = find_vma(mm, page_base);
+	if (vma && vma->vm_start <= page_base && vma->vm_file) {
+		file = get_file(vma->vm_file);
+		pos = ((loff_t)vma->vm_pgoff << PAGE_SHIFT) +
+		      (page_base - vma->vm_start);
+	}
+	mmap_read_unlock(mm);
 
-	list_for_each_entry_safe (ss_vma, next, &data->ss.all_vmas,
-				  all_vmas_node) {
+	if (!file)
+		return false;
+
+	// The part past the end of the file reads as zero.
+	memset(buf, 0, PAGE_SIZE);
+	res = kernel_read(file, buf, PAGE_SIZE, &pos);
+	fput(file);
+
+	return res > 0;
+}
+
+// Read the content the page had at snapshot time, false if it was zero.
+bool read_snapshot_page(struct task_data *data, unsigned long page_base,
+			void *buf)
+{
+	struct mm_struct *mm = current->mm;
+	struct snapshot_page *sp;
+	void *content = NULL;
+	bool present;
+	pte_t *pte;
+
+	sp = get_snapshot_page(data, page_base);
+	if (sp && test_bit(SNAPSHOT_PAGE_IN_DIRTY_LOG, &sp->flags)) {
+		content = get_level_page_data(data, sp);
+		if (!content && test_bit(SNAPSHOT_PAGE_DIRTY, &sp->flags) &&
+		    test_bit(SNAPSHOT_PAGE_COPIED, &sp->flags))
+			content = sp->page_data;
+		if (content) {
+			memcpy(buf, content, PAGE_SIZE);
+			return true;
+		}
+
+		// Populated during the iteration.
+		if (is_snapshot_page_none_pte(sp))
+			return read_file_page(page_base, buf);
+	}
+
+	// Pages that were never touched are not faulted in.
+	mmap_read_lock(mm);
+	pte = walk_page_table(page_base);
+	present = pte && !pte_none(*pte);
+	if (pte)
+		pte_unmap(pte);
+	mmap_read_unlock(mm);
+
+	if (!present)
+		return read_file_page(page_base, buf);
+
+	return !copy_from_user(buf, (void __user *)page_base, PAGE_SIZE);
+}
+
+static void free_snapshot_vmas(struct list_head *all_vmas)
+{
+	struct snapshot_vma *ss_vma, *next;
+
+	DBG_PRINT("freeing snapshot vmas:\n");
+
+	list_for_each_entry_safe (ss_vma, next, all_vmas, all_vmas_node) {
 		DBG_PRINT("  start: 0x%08lx end: 0x%08lx\n", ss_vma->vm_start,
 			  ss_vma->vm_end);
 		list_del(&ss_vma->all_vmas_node);
-		list_del(&ss_vma->snapshotted_vmas_node);
 		kfree(ss_vma);
 	}
 }
 
-void clean_memory_snapshot(struct task_data *data)
+static void free_snapshot_pages(struct hlist_head *ss_pages,
+				unsigned int buckets)
 {
 	struct snapshot_page *sp;
 	struct hlist_node *tmp;
+	unsigned int i;
+
+	for (i = 0; i < buckets; i++) {
+		hlist_for_each_entry_safe (sp, tmp, &ss_pages[i], next) {
+			hlist_del(&sp->next);
+			release_page_data(sp);
+			kfree(sp);
+		}
+	}
+}
+
+/*
+ * Freeing a large snapshot takes long enough to delay the respawn of the
+ * target, so the pages and VMA records are detached from the task and freed
+ * from a workqueue. Above teardown_limit_mb of pending memory the caller
+ * frees synchronously, which keeps a crash loop from piling up memory.
+ */
+static unsigned long teardown_limit_mb = 1024;
+module_param(teardown_limit_mb, ulong, 0644);
+MODULE_PARM_DESC(teardown_limit_mb,
+		 "Memory in MB that may wait for deferred snapshot teardown");
+
+static struct workqueue_struct *teardown_wq;
+static atomic_long_t teardown_pending_bytes = ATOMIC_LONG_INIT(0);
+
+struct snapshot_teardown {
+	struct rcu_work rwork;
+	unsigned long bytes;
+	struct list_head all_vmas;
+	DECLARE_HASHTABLE(ss_pages, SNAPSHOT_HASHTABLE_SZ);
+};
+
+static void snapshot_teardown_work(struct work_struct *work)
+{
+	struct snapshot_teardown *td =
+		container_of(to_rcu_work(work), struct snapshot_teardown, rwork);
+
+	DBG_PRINT("deferred teardown of %lu bytes\n", td->bytes);
+
+	free_snapshot_vmas(&td->all_vmas);
+	free_snapshot_pages(td->ss_pages, HASH_SIZE(td->ss_pages));
+
+	atomic_long_sub(td->bytes, &teardown_pending_bytes);
+	kfree(td);
+}
+
+static bool queue_snapshot_teardown(struct task_data *data)
+{
+	struct snapshot_teardown *td;
+	unsigned long bytes = atomic_long_read(&data->ss.saved_bytes);
+	unsigned long limit = teardown_limit_mb << 20;
 	int i;
 
-	invalidate_task_data_cache(data->tsk);
+	if (!teardown_wq)
+		return false;
 
-	clean_snapshot_vmas(data);
+	if ((unsigned long)atomic_long_add_return(bytes,
+						  &teardown_pending_bytes) > limit)
+		goto err_limit;
 
-	hash_for_each_safe (data->ss.ss_pages, i, tmp, sp, next) {
-		kfree(sp->page_data);
-		hash_del(&sp->next);
-		kfree(sp);
+	td = kmalloc(sizeof(struct snapshot_teardown), GFP_KERNEL);
+	if (!td)
+		goto err_limit;
+
+	td->bytes = bytes;
+	list_replace_init(&data->ss.all_vmas, &td->all_vmas);
+	for (i = 0; i < HASH_SIZE(td->ss_pages); i++)
+		hlist_move_list(&data->ss.ss_pages[i], &td->ss_pages[i]);
+
+	// Runs after a grace period, the hooks of the other threads may still
+	// hold entries.
+	INIT_RCU_WORK(&td->rwork, snapshot_teardown_work);
+	queue_rcu_work(teardown_wq, &td->rwork);
+
+	return true;
+
+err_limit:
+	atomic_long_sub(bytes, &teardown_pending_bytes);
+	return false;
+}
+
+int snapshot_teardown_init(void)
+{
+	teardown_wq = alloc_workqueue("afl_snapshot_teardown", WQ_UNBOUND, 0);
+	if (!teardown_wq)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void snapshot_teardown_exit(void)
+{
+	// Waits for the pending teardowns before the module text goes away,
+	// the ones still waiting for their grace period are queued first.
+	if (teardown_wq) {
+		rcu_barrier();
+		destroy_workqueue(teardown_wq);
 	}
+	teardown_wq = NULL;
 }
 
-struct snapshot_page *record_dirty_page(struct task_data *data,
-					struct mm_struct *mm,
-					unsigned long page_addr, pte_t pte)
+static void clean_prot_changes(struct list_head *prot_changes)
 {
-	struct snapshot_page *ss_page = NULL;
+	struct snapshot_prot_range *range, *n;
 
-	DBG_PRINT("%s: searching snapshot_page for 0x%016lx in task_data: %p\n",
-		  __func__, page_addr, data);
-	ss_page = get_snapshot_page(data, page_addr);
-	if (!ss_page)
+	list_for_each_entry_safe (range, n, prot_changes, node) {
+		list_del(&range->node);
+		kfree(range);
+	}
+}
+
+void clean_memory_snapshot(struct task_data *data)
+{
+	bool had_shadow = !list_empty(&data->ss.shadow_vmas);
+
+	invalidate_task_data_cache(data->mm);
+
+	clean_prot_changes(&data->ss.prot_changes);
+
+	// These lists only link records owned by all_vmas and ss_pages.
+	INIT_LIST_HEAD(&data->ss.snapshotted_vmas);
+	INIT_LIST_HEAD(&data->ss.shadow_vmas);
+	drop_dirty_logs(data);
+
+	// A hook that found a shadow range may still be setting its bit.
+	if (had_shadow)
+		synchronize_rcu();
+	clean_shadow_pages(data);
+
+	if (!queue_snapshot_teardown(data)) {
+		// The hooks of the other threads may still hold entries.
+		synchronize_rcu();
+		free_snapshot_vmas(&data->ss.all_vmas);
+		free_snapshot_pages(data->ss.ss_pages,
+				    HASH_SIZE(data->ss.ss_pages));
+	}
+
+	atomic_long_set(&data->ss.saved_bytes, 0);
+}
+
+/*
+ * A level saves the pages dirtied since the level below with their current
+ * content and write protects them again, so the dirty log only holds what
+ * changed above the top level. The ranges that no level below tracks, like
+ * the mappings created since and the stack below the old stack pointer, are
+ * tracked from the level on and dropped again when it is popped.
+ */
+
+static bool is_level_address(struct snapshot_level *level,
+			     unsigned long page_base)
+{
+	struct snapshot_vma *ss_vma;
+
+	list_for_each_entry (ss_vma, &level->tracked_vmas, all_vmas_node) {
+		if (ss_vma->vm_start <= page_base && page_base < ss_vma->vm_end)
+			return true;
+	}
+
+	return false;
+}
+
+static int save_level_page(struct snapshot_level *level,
+			   struct snapshot_page *sp)
+{
+	void *content, *old;
+
+	content = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!content) {
+		FATAL("could not allocate level page");
+		return -ENOMEM;
+	}
+
+	// A page unmapped since has nothing to save.
+	if (copy_from_user(content, (void __user *)sp->page_base, PAGE_SIZE)) {
+		kfree(content);
+		return 0;
+	}
+
+	old = xa_store(&level->pages, sp->page_base >> PAGE_SHIFT, content,
+		       GFP_KERNEL);
+	if (xa_is_err(old)) {
+		FATAL("could not store level page");
+		kfree(content);
+		return xa_err(old);
+	}
+
+	return 0;
+}
+
+// Keep snapshotted_vmas sorted, is_snapshotted_address() relies on it.
+static void insert_snapshotted_vma(struct task_data *data,
+				   struct snapshot_vma *new)
+{
+	struct list_head *prev = &data->ss.snapshotted_vmas;
+	struct snapshot_vma *ss_vma;
+
+	list_for_each_entry (ss_vma, &data->ss.snapshotted_vmas,
+			     snapshotted_vmas_node) {
+		if (ss_vma->vm_start > new->vm_start)
+			break;
+		prev = &ss_vma->snapshotted_vmas_node;
+	}
+
+	// The fault hooks walk the list without a lock.
+	list_add_rcu(&new->snapshotted_vmas_node, prev);
+}
+
+static int add_level_range(struct vm_area_struct *vma, unsigned long start,
+			   unsigned long end, struct list_head *ranges)
+{
+	struct snapshot_vma *ss_vma;
+
+	DBG_PRINT("tracking level range 0x%016lx - 0x%016lx\n", start, end);
+
+	ss_vma = alloc_snapshot_vma(vma);
+	if (!ss_vma)
+		return -ENOMEM;
+
+	ss_vma->vm_start = start;
+	ss_vma->track_start = start;
+	ss_vma->vm_end = end;
+	list_add_tail(&ss_vma->all_vmas_node, ranges);
+
+	return 0;
+}
+
+// The parts of vma from start on that no snapshotted range covers.
+static int find_untracked_ranges(struct task_data *data,
+				 struct vm_area_struct *vma,
+				 unsigned long start, struct list_head *ranges)
+{
+	struct snapshot_vma *ss_vma;
+	unsigned long cursor = start;
+	int res;
+
+	list_for_each_entry (ss_vma, &data->ss.snapshotted_vmas,
+			     snapshotted_vmas_node) {
+		if (ss_vma->vm_end <= cursor)
+			continue;
+		if (ss_vma->track_start >= vma->vm_end)
+			break;
+
+		if (ss_vma->track_start > cursor) {
+			res = add_level_range(vma, cursor, ss_vma->track_start,
+					      ranges);
+			if (res)
+				return res;
+		}
+
+		cursor = ss_vma->vm_end;
+		if (cursor >= vma->vm_end)
+			return 0;
+	}
+
+	return add_level_range(vma, cursor, vma->vm_end, ranges);
+}
+
+// Called with the mmap lock held.
+static int track_level_ranges(struct task_data *data,
+			      struct snapshot_level *level)
+{
+	struct mm_struct *mm = current->mm;
+	unsigned long sp = user_stack_pointer(&level->regs);
+	unsigned long stack_start = data->ss.stack_start;
+	struct vm_area_struct *vma;
+	struct snapshot_vma *ss_vma, *n;
+	unsigned long start;
+	LIST_HEAD(ranges);
+	int res = 0;
+
+	struct snapshot_walk_data walk_data = {
+		.task_data = data,
+	};
+
+	for (vma = mm->mmap; vma && !res; vma = vma->vm_next) {
+		if (!should_snapshot_vma(data, vma, sp))
+			continue;
+
+		start = vma->vm_start;
+		if (is_stack(vma, sp)) {
+			start = max(start,
+				    (sp - SNAPSHOT_STACK_REDZONE) & PAGE_MASK);
+			// The frames pushed since the level below are kept.
+			if (vma->vm_start <= stack_start &&
+			    stack_start < vma->vm_end && start < stack_start)
+				data->ss.stack_start = start;
+		}
+
+		res = find_untracked_ranges(data, vma, start, &ranges);
+	}
+
+	list_for_each_entry_safe (ss_vma, n, &ranges, all_vmas_node) {
+		list_move_tail(&ss_vma->all_vmas_node, &level->tracked_vmas);
+		insert_snapshotted_vma(data, ss_vma);
+
+		if (!res)
+			res = walk_page_range(mm, ss_vma->vm_start,
+					      ss_vma->vm_end, &snapshot_walk_ops,
+					      &walk_data);
+	}
+
+	return res;
+}
+
+int push_memory_level(struct task_data *data, struct snapshot_level *level)
+{
+	struct mm_struct *mm = current->mm;
+	struct vm_area_struct *vma;
+	struct snapshot_vma *ss_vma;
+	struct snapshot_page *sp, *n;
+	struct llist_node *dirty_pages;
+	int res = 0;
+
+	// Save everything before touching the snapshot, so a failed push
+	// leaves the iteration as it was.
+	dirty_pages = collect_dirty_pages(data);
+	llist_for_each_entry (sp, dirty_pages, dirty_node) {
+		res = save_level_page(level, sp);
+		if (res)
+			goto err_relog;
+	}
+
+	mmap_read_lock(mm);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		ss_vma = alloc_snapshot_vma(vma);
+		if (!ss_vma) {
+			mmap_read_unlock(mm);
+			res = -ENOMEM;
+			goto err_relog;
+		}
+
+		list_add_tail(&ss_vma->all_vmas_node, &level->vmas);
+	}
+
+	llist_for_each_entry_safe (sp, n, dirty_pages, dirty_node) {
+		protect_snapshot_page(mm, sp);
+		clear_bit(SNAPSHOT_PAGE_DIRTY, &sp->flags);
+		clear_bit(SNAPSHOT_PAGE_IN_DIRTY_LOG, &sp->flags);
+	}
+
+	list_splice_init(&data->ss.prot_changes, &level->prot_changes);
+	level->stack_start = data->ss.stack_start;
+
+	// The level is usable even if some of its pages could not be added.
+	if (track_level_ranges(data, level))
+		FATAL("could not track all the ranges of level %u",
+		      level->depth);
+	mmap_read_unlock(mm);
+
+	return 0;
+
+err_relog:
+	llist_for_each_entry_safe (sp, n, dirty_pages, dirty_node)
+		llist_add(&sp->dirty_node, raw_cpu_ptr(data->ss.dirty_logs));
+
+	return res;
+}
+
+void pop_memory_level(struct task_data *data, struct snapshot_level *level)
+{
+	struct snapshot_vma *ss_vma;
+	struct snapshot_page *sp, *n;
+	struct llist_node *dirty_pages;
+	struct hlist_node *tmp;
+	LLIST_HEAD(dropped);
+	unsigned long index;
+	void *content;
+	int i;
+
+	// The pages saved by the level differ from the level below.
+	xa_for_each (&level->pages, index, content) {
+		sp = get_snapshot_page(data, index << PAGE_SHIFT);
+		if (!sp || is_level_address(level, sp->page_base))
+			continue;
+
+		if (!is_snapshot_page_none_pte(sp))
+			set_bit(SNAPSHOT_PAGE_DIRTY, &sp->flags);
+		log_dirty_page(data, sp);
+	}
+
+	list_splice_init(&level->prot_changes, &data->ss.prot_changes);
+	data->ss.stack_start = level->stack_start;
+
+	if (!list_empty(&level->tracked_vmas)) {
+		list_for_each_entry (ss_vma, &level->tracked_vmas,
+				     all_vmas_node)
+			list_del_rcu(&ss_vma->snapshotted_vmas_node);
+
+		// The pages of the ranges leave the logs and the hash table.
+		dirty_pages = collect_dirty_pages(data);
+		llist_for_each_entry_safe (sp, n, dirty_pages, dirty_node) {
+			if (!is_level_address(level, sp->page_base))
+				llist_add(&sp->dirty_node,
+					  raw_cpu_ptr(data->ss.dirty_logs));
+		}
+
+		spin_lock(&data->ss.ss_pages_lock);
+		hash_for_each_safe (data->ss.ss_pages, i, tmp, sp, next) {
+			if (is_level_address(level, sp->page_base)) {
+				hash_del_rcu(&sp->next);
+				llist_add(&sp->dirty_node, &dropped);
+			}
+		}
+		spin_unlock(&data->ss.ss_pages_lock);
+
+		synchronize_rcu();
+
+		llist_for_each_entry_safe (sp, n, dropped.first, dirty_node) {
+			if (sp->page_data)
+				atomic_long_sub(PAGE_SIZE,
+						&data->ss.saved_bytes);
+			atomic_long_sub(sizeof(struct snapshot_page),
+					&data->ss.saved_bytes);
+			release_page_data(sp);
+			kfree(sp);
+		}
+	}
+
+	free_memory_level(level);
+}
+
+void free_memory_level(struct snapshot_level *level)
+{
+	unsigned long index;
+	void *content;
+
+	xa_for_each (&level->pages, index, content)
+		kfree(content);
+	xa_destroy(&level->pages);
+
+	free_snapshot_vmas(&level->vmas);
+	free_snapshot_vmas(&level->tracked_vmas);
+	clean_prot_changes(&level->prot_changes);
+}
+
+/*
+ * Rebasing makes the current memory the snapshot. Only the pages dirtied
+ * since the last restore differ from it, their stale copy is dropped and they
+ * are made snapshot pages again from their current PTE. The layout is
+ * recorded anew and only the ranges that were not tracked so far are walked.
+ */
+
+static int rebase_snapshot_page(struct task_data *data, struct mm_struct *mm,
+				struct snapshot_page *sp)
+{
+	pte_t *pte;
+	int res = 0;
+
+	// The next write copies the page again.
+	if (sp->page_data) {
+		release_page_data(sp);
+		atomic_long_sub(PAGE_SIZE, &data->ss.saved_bytes);
+	}
+
+	pte = walk_page_table(sp->page_base);
+	if (!pte) {
+		// Unmapped during the iteration.
+		sp->page_prot = 0;
+		sp->flags = 0;
+		set_snapshot_page_none_pte(sp);
+		return 0;
+	}
+
+	if (is_snapshot_page_shared(sp))
+		res = make_shared_snapshot_page(data, mm, sp->page_base, pte);
+	else
+		res = make_snapshot_page(data, mm, sp->page_base, pte);
+	pte_unmap(pte);
+
+	clear_bit(SNAPSHOT_PAGE_COPIED, &sp->flags);
+	clear_bit(SNAPSHOT_PAGE_DIRTY, &sp->flags);
+	clear_bit(SNAPSHOT_PAGE_IN_DIRTY_LOG, &sp->flags);
+
+	return res;
+}
+
+int rebase_memory_snapshot(struct task_data *data)
+{
+	struct mm_struct *mm = current->mm;
+	unsigned long sp = user_stack_pointer(&data->ss.regs);
+	unsigned long stack_start = data->ss.stack_start;
+	struct snapshot_page *ss_page, *n_page;
+	struct snapshot_vma *ss_vma, *n_vma;
+	struct llist_node *dirty_pages;
+	struct vm_area_struct *vma;
+	LIST_HEAD(layout);
+	LIST_HEAD(tracked);
+	LIST_HEAD(ranges);
+	LIST_HEAD(old_vmas);
+	unsigned long start;
+	int res = 0;
+
+	struct snapshot_walk_data walk_data = {
+		.task_data = data,
+	};
+
+	mmap_read_lock(mm);
+
+	// Allocate the new layout first, a failure leaves the snapshot as is.
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		ss_vma = alloc_snapshot_vma(vma);
+		if (!ss_vma) {
+			res = -ENOMEM;
+			goto err_free;
+		}
+
+		list_add_tail(&ss_vma->all_vmas_node, &layout);
+		if (!should_snapshot_vma(data, vma, sp))
+			continue;
+
+		start = vma->vm_start;
+		if (is_stack(vma, sp)) {
+			start = max(start,
+				    (sp - SNAPSHOT_STACK_REDZONE) & PAGE_MASK);
+			// The pages tracked below the new stack pointer stay.
+			if (vma->vm_start <= stack_start &&
+			    stack_start < vma->vm_end)
+				start = min(start, stack_start);
+			data->ss.stack_start = start;
+		}
+
+		ss_vma->track_start = start;
+		list_add_tail(&ss_vma->snapshotted_vmas_node, &tracked);
+
+		res = find_untracked_ranges(data, vma, start, &ranges);
+		if (res)
+			goto err_free;
+	}
+
+	dirty_pages = collect_dirty_pages(data);
+	llist_for_each_entry_safe (ss_page, n_page, dirty_pages, dirty_node) {
+		DBG_PRINT("rebasing page: 0x%016lx\n", ss_page->page_base);
+		if (rebase_snapshot_page(data, mm, ss_page))
+			res = -ENOMEM;
+	}
+
+	list_splice_init(&data->ss.all_vmas, &old_vmas);
+	list_splice(&layout, &data->ss.all_vmas);
+
+	// The fault hooks of the other threads walk snapshotted_vmas without a
+	// lock. The new ranges go in before the old ones leave, a fault in
+	// between is tracked by one or the other.
+	list_for_each_entry_safe (ss_vma, n_vma, &tracked,
+				  snapshotted_vmas_node) {
+		list_del(&ss_vma->snapshotted_vmas_node);
+		insert_snapshotted_vma(data, ss_vma);
+	}
+
+	list_for_each_entry (ss_vma, &old_vmas, all_vmas_node) {
+		if (!list_empty(&ss_vma->snapshotted_vmas_node))
+			list_del_rcu(&ss_vma->snapshotted_vmas_node);
+	}
+
+	list_for_each_entry (ss_vma, &ranges, all_vmas_node) {
+		DBG_PRINT("walking new range 0x%016lx - 0x%016lx\n",
+			  ss_vma->vm_start, ss_vma->vm_end);
+		if (walk_page_range(mm, ss_vma->vm_start, ss_vma->vm_end,
+				    &snapshot_walk_ops, &walk_data))
+			res = -ENOMEM;
+	}
+
+	mmap_read_unlock(mm);
+
+	// The current protections are the snapshot ones now.
+	clean_prot_changes(&data->ss.prot_changes);
+	synchronize_rcu();
+	free_snapshot_vmas(&old_vmas);
+	free_snapshot_vmas(&ranges);
+
+	return res;
+
+err_free:
+	mmap_read_unlock(mm);
+
+	data->ss.stack_start = stack_start;
+	free_snapshot_vmas(&layout);
+	free_snapshot_vmas(&ranges);
+
+	return res;
+}
+
+static struct snapshot_page *mark_dirty_page(struct task_data *data,
+					     struct snapshot_page *ss_page,
+					     struct page *original_page)
+{
+	// Pages without a PTE at snapshot time are zapped on restore, they
+	// are only write protected when a level saved their content.
+	if (is_snapshot_page_none_pte(ss_page)) {
+		if (!list_empty(&data->ss.levels))
+			log_dirty_page(data, ss_page);
 		return NULL;
+	}
 
-	if (ss_page->dirty || is_snapshot_page_none_pte(ss_page))
+	// Only the thread that sets the dirty bit logs and copies the page.
+	if (test_and_set_bit(SNAPSHOT_PAGE_DIRTY, &ss_page->flags))
 		return NULL;
-	ss_page->dirty = true;
 
-	DBG_PRINT("adding page to dirty list: 0x%016lx\n", page_addr);
-	if (ss_page->in_dirty_list) {
-		WARNF("page (0x%016lx) already in dirty list (dirty: %d, copied: %d)\n",
-		      ss_page->page_base, ss_page->dirty,
-		      ss_page->has_been_copied);
-	} else {
-		ss_page->in_dirty_list = true;
-		list_add_tail(&ss_page->dirty_list, &data->ss.dirty_pages);
-	}
+	DBG_PRINT("adding page to dirty log: 0x%016lx\n", ss_page->page_base);
+	if (log_dirty_page(data, ss_page))
+		charge_dirty_page(data);
 
 	/* copy the page if necessary.
 	 * the page becomes COW page again. we do not need to take care of it.
 	 */
-	if (!ss_page->has_been_copied) {
-		struct page *original_page = NULL;
+	if (!test_bit(SNAPSHOT_PAGE_COPIED, &ss_page->flags)) {
 		void *mapped_page_addr = NULL;
 
-		DBG_PRINT("copying page 0x%016lx\n", page_addr);
+		DBG_PRINT("copying page 0x%016lx\n", ss_page->page_base);
 
 		/* reserved old page data */
 		if (!ss_page->page_data) {
@@ -812,51 +2053,81 @@ struct snapshot_page *record_dirty_page(struct task_data *data,
 				FATAL("could not allocate memory for page_data");
 				return NULL;
 			}
+			atomic_long_add(PAGE_SIZE, &data->ss.saved_bytes);
 		}
 
-		original_page = pfn_to_page(pte_pfn(pte));
 		mapped_page_addr = kmap_local_page(original_page);
 		memcpy(ss_page->page_data, mapped_page_addr, PAGE_SIZE);
 		kunmap_local(mapped_page_addr);
 
-		ss_page->has_been_copied = true;
+		// Restore reads page_data once the bit is seen.
+		smp_mb__before_atomic();
+		set_bit(SNAPSHOT_PAGE_COPIED, &ss_page->flags);
 	}
 
 	return ss_page;
 }
 
+// Called under rcu_read_lock(), the entry is only valid inside it.
+struct snapshot_page *record_dirty_page(struct task_data *data,
+					struct mm_struct *mm,
+					unsigned long page_addr, pte_t pte)
+{
+	struct snapshot_page *ss_page = NULL;
+
+	DBG_PRINT("%s: searching snapshot_page for 0x%016lx in task_data: %p\n",
+		  __func__, page_addr, data);
+	ss_page = get_snapshot_page(data, page_addr);
+	if (!ss_page)
+		return NULL;
+
+	return mark_dirty_page(data, ss_page, pfn_to_page(pte_pfn(pte)));
+}
+
 static vm_fault_t do_wp_page_stub(struct vm_fault *vmf)
 {
 	return 0;
 }
 
-void do_wp_page_hook(unsigned long ip, unsigned long parent_ip,
-		     struct ftrace_ops *op, ftrace_regs_ptr regs)
+// True when the fault is handled and do_wp_page() must be skipped.
+static bool handle_wp_fault(struct task_data *data, struct vm_fault *fault)
 {
-	struct pt_regs *pregs = ftrace_get_regs(regs);
-	struct vm_fault *fault =
-		(struct vm_fault *)regs_get_kernel_argument(pregs, 0);
 	struct mm_struct *mm = fault->vma->vm_mm;
 	unsigned long page_base_addr = fault->address & PAGE_MASK;
 
-	struct task_data *data = NULL;
 	struct snapshot_page *ss_page = NULL;
+	struct page *page;
 
 	pte_t entry;
 
-	data = get_task_data_with_cache(rcu_access_pointer(mm->owner));
-	if (!data || !have_snapshot(data))
-		return;
+	if (fault->vma->vm_flags & VM_SHARED) {
+		if (fault->vma->vm_flags & (VM_PFNMAP | VM_MIXEDMAP))
+			return false;
+
+		ss_page = get_shared_snapshot_page(data, page_base_addr);
+		if (ss_page)
+			mark_dirty_page(data, ss_page,
+					pte_page(fault->orig_pte));
+
+		// do_wp_page() still has to do the dirty accounting and call
+		// page_mkwrite for the shared page.
+		return false;
+	}
 
 	ss_page = record_dirty_page(data, mm, page_base_addr, fault->orig_pte);
 	if (!ss_page)
-		return;
+		return false;
 
 	/* if this was originally a COW page, let the original page fault handler
 	 * handle it.
 	 */
 	if (!is_snapshot_page_private(ss_page))
-		return;
+		return false;
+
+	// Since a fork the page is shared with the child, it has to be copied.
+	page = vm_normal_page(fault->vma, fault->address, fault->orig_pte);
+	if (!page || page_mapcount(page) != 1)
+		return false;
 
 	DBG_PRINT(
 		"handling page fault! process: %s addr: 0x%08lx ptep: 0x%08lx pte: 0x%08lx\n",
@@ -872,8 +2143,29 @@ void do_wp_page_hook(unsigned long ip, unsigned long parent_ip,
 
 	pte_unmap_unlock(fault->pte, fault->ptl);
 
+	return true;
+}
+
+void do_wp_page_hook(unsigned long ip, unsigned long parent_ip,
+		     struct ftrace_ops *op, ftrace_regs_ptr regs)
+{
+	struct pt_regs *pregs = ftrace_get_regs(regs);
+	struct vm_fault *fault =
+		(struct vm_fault *)regs_get_kernel_argument(pregs, 0);
+	struct task_data *data = NULL;
+	bool handled;
+
+	data = get_task_data_with_cache(fault->vma->vm_mm);
+	if (!data || !have_snapshot(data))
+		return;
+
+	rcu_read_lock();
+	handled = handle_wp_fault(data, fault);
+	rcu_read_unlock();
+
 	// skip original function
-	pregs->ip = (unsigned long)&do_wp_page_stub;
+	if (handled)
+		pregs->ip = (unsigned long)&do_wp_page_stub;
 }
 
 // actually hooking page_add_new_anon_rmap, but we really only care about calls
@@ -896,23 +2188,35 @@ void page_add_new_anon_rmap_hook(unsigned long ip, unsigned long parent_ip,
 	address = regs_get_kernel_argument(pregs, 2);
 	page_base_addr = address & PAGE_MASK;
 
-	// XXX: mm->owner is probably the group leader, not necessarily the
-	// thread that triggered the page fault.
-	data = get_task_data_with_cache(rcu_access_pointer(mm->owner));
+	data = get_task_data_with_cache(mm);
 	if (!data || !have_snapshot(data))
 		return;
 
 	DBG_PRINT("%s: searching snapshot_page for 0x%016lx in task_data: %p\n",
 		  __func__, page_base_addr, data);
+	rcu_read_lock();
 	ss_page = get_snapshot_page(data, page_base_addr);
 	if (!ss_page) {
-		if (!is_snapshotted_address(data, page_base_addr))
-			return;
+		// Shadow pages only need a bit, restore zaps them.
+		if (is_shadow_address(data, page_base_addr)) {
+			mark_shadow_page(data, page_base_addr);
+			goto out;
+		}
+
+		// Mapped or grown during the iteration, the restore drops it
+		// but the memory counts against the budget all the same.
+		if (!is_snapshotted_address(data, page_base_addr)) {
+			if (!(data->config & AFL_SNAPSHOT_SWAP))
+				charge_dirty_page(data);
+			goto out;
+		}
 
 		// Allocate entries for pages that did not have a PTE on demand.
 		DBG_PRINT("adding page without PTE to snapshot: 0x%08lx\n",
 			  page_base_addr);
 		ss_page = add_snapshot_page(data, page_base_addr, false);
+		if (!ss_page)
+			goto out;
 		set_snapshot_page_none_pte(ss_page);
 	}
 
@@ -920,25 +2224,22 @@ void page_add_new_anon_rmap_hook(unsigned long ip, unsigned long parent_ip,
 	// dump_stack();
 
 	// HAVE PTE NOW
-	ss_page->has_had_pte = true;
-	if (is_snapshot_page_none_pte(ss_page)) {
-		if (ss_page->in_dirty_list) {
-			WARNF("0x%016lx: Adding page to dirty list, but it's already there??? (dirty: %d, copied: %d)\n",
-			      ss_page->page_base, ss_page->dirty,
-			      ss_page->has_been_copied);
-		} else {
-			ss_page->in_dirty_list = true;
-			list_add_tail(&ss_page->dirty_list,
-				      &data->ss.dirty_pages);
-		}
-	}
+	set_bit(SNAPSHOT_PAGE_HAD_PTE, &ss_page->flags);
+	if (is_snapshot_page_none_pte(ss_page) && log_dirty_page(data, ss_page))
+		charge_dirty_page(data);
+
+out:
+	rcu_read_unlock();
 }
 
 static int munmap_pte_entry(pte_t *pte, unsigned long addr, unsigned long next,
 			    struct mm_walk *walk)
 {
 	struct task_data *data = (struct task_data *)walk->private;
+
+	rcu_read_lock();
 	record_dirty_page(data, walk->mm, addr, *pte);
+	rcu_read_unlock();
 	return 0;
 }
 
@@ -958,7 +2259,7 @@ void __do_munmap_hook(unsigned long ip, unsigned long parent_ip,
 
 	struct task_data *data = NULL;
 
-	data = get_task_data_with_cache(rcu_access_pointer(mm->owner));
+	data = get_task_data_with_cache(mm);
 	if (!data || !have_snapshot(data))
 		return;
 
@@ -972,69 +2273,91 @@ void __do_munmap_hook(unsigned long ip, unsigned long parent_ip,
 	}
 }
 
-// void finish_fault_hook(unsigned long ip, unsigned long parent_ip,
-//                    struct ftrace_ops *op, ftrace_regs_ptr regs)
-// {
-//   struct pt_regs* pregs = ftrace_get_regs(regs);
-//   struct vm_fault *vmf = (struct vm_fault*)pregs->di;
-//   struct vm_area_struct *vma;
-//   struct mm_struct *     mm;
-//   struct task_data *     data;
-//   struct snapshot_page * ss_page;
-//   unsigned long          address;
-
-//   vma = vmf->vma;
-//   address = vmf->address;
-
-//   struct task_struct* ltask = get_cpu_var(last_task);
-//   if (ltask == mm->owner) { // XXX: mm is not initialized!
+static void record_prot_change(struct task_data *data, unsigned long start,
+			       unsigned long end)
+{
+	struct snapshot_prot_range *range;
+
+	// Coalesce with an overlapping or adjacent range, JIT targets flip the
+	// same pages over and over.
+	list_for_each_entry (range, &data->ss.prot_changes, node) {
+		if (start <= range->end && end >= range->start) {
+			range->start = min(range->start, start);
+			range->end = max(range->end, end);
+			return;
+		}
+	}
 
-//     // fast path
-//     data = get_cpu_var(last_data);
-//     put_cpu_var(last_task);
-//     put_cpu_var(last_data);
-//   } else {
+	range = kmalloc(sizeof(struct snapshot_prot_range), GFP_ATOMIC);
+	if (!range) {
+		FATAL("could not allocate snapshot_prot_range");
+		return;
+	}
 
-//     // query the radix tree
-//     data = get_task_data(mm->owner);
-//     get_cpu_var(last_task) = mm->owner;
-//     get_cpu_var(last_data) = data;
-//     put_cpu_var(last_task);
-//     put_cpu_var(last_task);
-//     put_cpu_var(last_data);
+	range->start = start;
+	range->end = end;
+	list_add_tail(&range->node, &data->ss.prot_changes);
+}
 
-//   }
+void mprotect_fixup_hook(unsigned long ip, unsigned long parent_ip,
+			 struct ftrace_ops *op, ftrace_regs_ptr regs)
+{
+	struct pt_regs *pregs = ftrace_get_regs(regs);
+	struct vm_area_struct *vma =
+		(struct vm_area_struct *)regs_get_kernel_argument(pregs, 0);
+	unsigned long start = regs_get_kernel_argument(pregs, 2);
+	unsigned long end = regs_get_kernel_argument(pregs, 3);
+	unsigned long newflags = regs_get_kernel_argument(pregs, 4);
 
-//   if (data && have_snapshot(data)) {
+	struct task_data *data = NULL;
 
-//     ss_page = get_snapshot_page(data, address & PAGE_MASK);
+	// Protections put back by restore_vma_prots() are not changes.
+	if (within_module(parent_ip, THIS_MODULE))
+		return;
 
-//   } else {
+	if (!((vma->vm_flags ^ newflags) & (VM_READ | VM_WRITE | VM_EXEC)))
+		return;
 
-//     return;
+	data = get_task_data_with_cache(vma->vm_mm);
+	if (!data || !have_snapshot(data))
+		return;
 
-//   }
+	DBG_PRINT("%s: protection change from 0x%08lx to 0x%08lx\n", __func__,
+		  start, end);
 
-//   if (!ss_page) {
+	// mprotect_fixup is always called while holding the mmap write lock,
+	// which serializes the updates of the list.
+	record_prot_change(data, start, end);
+}
 
-//     /* not a snapshot'ed page */
-//     return;
+// Catches the first write to a shared page that had no PTE, do_shared_fault
+// maps it writable right away so do_wp_page never sees it.
+void finish_fault_hook(unsigned long ip, unsigned long parent_ip,
+		       struct ftrace_ops *op, ftrace_regs_ptr regs)
+{
+	struct pt_regs *pregs = ftrace_get_regs(regs);
+	struct vm_fault *vmf =
+		(struct vm_fault *)regs_get_kernel_argument(pregs, 0);
+	struct vm_area_struct *vma = vmf->vma;
+	unsigned long page_base_addr = vmf->address & PAGE_MASK;
 
-//   }
+	struct task_data *data = NULL;
+	struct snapshot_page *ss_page = NULL;
 
-//   DBG_PRINT("finish_fault 0x%08lx", address);
-//   dump_stack();
+	if (!(vmf->flags & FAULT_FLAG_WRITE) || !(vma->vm_flags & VM_SHARED) ||
+	    !vmf->page)
+		return;
 
-//   // HAVE PTE NOW
-//   ss_page->has_had_pte = true;
-//   if (is_snapshot_page_none_pte(ss_page)) {
-//     if (ss_page->in_dirty_list) {
-//       WARNF("0x%016lx: Adding page to dirty list, but it's already there???", ss_page->page_base);
-//     } else {
-//       ss_page->in_dirty_list = true;
-//       list_add_tail(&ss_page->dirty_list, &data->ss.dirty_pages);
-//     }
-//   }
+	data = get_task_data_with_cache(vma->vm_mm);
+	if (!data || !have_snapshot(data))
+		return;
 
-//   return;
-// }
+	rcu_read_lock();
+	ss_page = get_shared_snapshot_page(data, page_base_addr);
+	if (ss_page) {
+		DBG_PRINT("finish_fault on shared page 0x%08lx\n",
+			  page_base_addr);
+		mark_dirty_page(data, ss_page, vmf->page);
+	}
+	rcu_read_unlock();
+}
@@ -39,6 +39,10 @@ dup_fd_t dup_fd_ptr;
 put_files_struct_t put_files_struct_ptr;
 walk_page_vma_t walk_page_vma_ptr;
 walk_page_range_t walk_page_range_ptr;
+mprotect_fixup_t mprotect_fixup_ptr;
+replace_fd_t replace_fd_ptr;
+task_work_add_t task_work_add_ptr;
+set_current_blocked_t set_current_blocked_ptr;
 
 static long mod_dev_ioctl(struct file *filep, unsigned int cmd,
 			  unsigned long arg)
@@ -73,6 +77,19 @@ static long mod_dev_ioctl(struct file *filep, unsigned int cmd,
 
     }
 
+    case AFL_SNAPSHOT_SHADOW_VMRANGE: {
+
+      DBG_PRINT("Calling afl_snapshot_shadow_vmrange");
+
+      if (copy_from_user(&args, (void __user *)arg,
+                         sizeof(struct afl_snapshot_vmrange_args)))
+        return -EINVAL;
+
+      shadow_vmrange(args.start, args.end);
+      return 0;
+
+    }
+
     case AFL_SNAPSHOT_IOCTL_TAKE: {
 
       DBG_PRINT("Calling afl_snapshot_take");
@@ -98,6 +115,95 @@ static long mod_dev_ioctl(struct file *filep, unsigned int cmd,
 
     }
 
+    case AFL_SNAPSHOT_IOCTL_REBASE: {
+
+      DBG_PRINT("Calling afl_snapshot_rebase");
+
+      return rebase_snapshot();
+
+    }
+
+    case AFL_SNAPSHOT_IOCTL_FORK: {
+
+      DBG_PRINT("Calling afl_snapshot_fork");
+
+      return fork_snapshot(arg);
+
+    }
+
+    case AFL_SNAPSHOT_IOCTL_PUSH: {
+
+      DBG_PRINT("Calling afl_snapshot_push");
+
+      return push_snapshot();
+
+    }
+
+    case AFL_SNAPSHOT_IOCTL_POP: {
+
+      DBG_PRINT("Calling afl_snapshot_pop");
+
+      return pop_snapshot();
+
+    }
+
+    case AFL_SNAPSHOT_IOCTL_RESTORE_LEVEL: {
+
+      DBG_PRINT("Calling afl_snapshot_restore_level");
+
+      return recover_snapshot_level(arg);
+
+    }
+
+    case AFL_SNAPSHOT_IOCTL_SAVE: {
+
+      DBG_PRINT("Calling afl_snapshot_save");
+
+      return save_snapshot(arg, filep);
+
+    }
+
+    case AFL_SNAPSHOT_IOCTL_LOAD: {
+
+      DBG_PRINT("Calling afl_snapshot_load");
+
+      return load_snapshot(arg, filep);
+
+    }
+
+    case AFL_SNAPSHOT_IOCTL_STATS: {
+
+      DBG_PRINT("Calling afl_snapshot_stats");
+
+      return get_snapshot_stats((struct afl_snapshot_stats __user *)arg);
+
+    }
+
+    case AFL_SNAPSHOT_IOCTL_LIMITS: {
+
+      DBG_PRINT("Calling afl_snapshot_limits");
+
+      return set_snapshot_limits((struct afl_snapshot_limits __user *)arg);
+
+    }
+
+    case AFL_SNAPSHOT_IOCTL_CRASH_REPORT: {
+
+      DBG_PRINT("Calling afl_snapshot_crash_report");
+
+      return get_crash_report(
+          (struct afl_snapshot_crash_report __user *)arg);
+
+    }
+
+    case AFL_SNAPSHOT_IOCTL_START: {
+
+      DBG_PRINT("Calling afl_snapshot_start");
+
+      return start_iteration_timer();
+
+    }
+
     case AFL_SNAPSHOT_IOCTL_CLEAN: {
 
       DBG_PRINT("Calling afl_snapshot_clean");
@@ -166,6 +272,9 @@ static struct ftrace_hook ftrace_hooks[] = {
 	SYSCALL_HOOK("sys_exit_group", sys_exit_group_hook,
 		     &sys_exit_group_orig),
 	HOOK("do_exit", do_exit_hook, &do_exit_orig),
+	HOOK("rw_verify_area", rw_verify_area_hook, &rw_verify_area_orig),
+	HOOK("do_truncate", do_truncate_hook, &do_truncate_orig),
+	HOOK("vfs_truncate", vfs_truncate_hook, &vfs_truncate_orig),
 };
 
 static int resolve_non_exported_symbols(void)
@@ -180,21 +289,62 @@ static int resolve_non_exported_symbols(void)
 		(walk_page_vma_t)kallsyms_lookup_name("walk_page_vma");
 	walk_page_range_ptr =
 		(walk_page_range_t)kallsyms_lookup_name("walk_page_range");
+	mprotect_fixup_ptr =
+		(mprotect_fixup_t)kallsyms_lookup_name("mprotect_fixup");
+	replace_fd_ptr = (replace_fd_t)kallsyms_lookup_name("replace_fd");
+	task_work_add_ptr =
+		(task_work_add_t)kallsyms_lookup_name("task_work_add");
+	set_current_blocked_ptr = (set_current_blocked_t)kallsyms_lookup_name(
+		"set_current_blocked");
+	walk_process_tree_ptr = (walk_process_tree_t)kallsyms_lookup_name(
+		"walk_process_tree");
+	kernel_wait4_ptr =
+		(kernel_wait4_t)kallsyms_lookup_name("kernel_wait4");
+	do_epoll_ctl_ptr =
+		(do_epoll_ctl_t)kallsyms_lookup_name("do_epoll_ctl");
+	do_timerfd_gettime_ptr = (do_timerfd_gettime_t)kallsyms_lookup_name(
+		"do_timerfd_gettime");
+	do_timerfd_settime_ptr = (do_timerfd_settime_t)kallsyms_lookup_name(
+		"do_timerfd_settime");
+	flush_sigqueue_ptr =
+		(flush_sigqueue_t)kallsyms_lookup_name("flush_sigqueue");
+	do_send_sig_info_ptr = (do_send_sig_info_t)kallsyms_lookup_name(
+		"do_send_sig_info");
+	do_getitimer_ptr =
+		(do_getitimer_t)kallsyms_lookup_name("do_getitimer");
+	do_setitimer_ptr =
+		(do_setitimer_t)kallsyms_lookup_name("do_setitimer");
+	dup_mm_ptr = (dup_mm_t)kallsyms_lookup_name("dup_mm");
+	switch_mm_irqs_off_ptr = (switch_mm_irqs_off_t)kallsyms_lookup_name(
+		"switch_mm_irqs_off");
+	sync_mm_rss_ptr = (sync_mm_rss_t)kallsyms_lookup_name("sync_mm_rss");
+	dequeue_signal_ptr =
+		(dequeue_signal_t)kallsyms_lookup_name("dequeue_signal");
 
 	if (!k_flush_tlb_mm_range || !k_zap_page_range || !dup_fd_ptr ||
 	    !put_files_struct_ptr || !walk_page_vma_ptr ||
-	    !walk_page_range_ptr) {
+	    !walk_page_range_ptr || !mprotect_fixup_ptr || !replace_fd_ptr ||
+	    !task_work_add_ptr || !set_current_blocked_ptr ||
+	    !walk_process_tree_ptr || !kernel_wait4_ptr) {
 		return -ENOENT;
 	}
 
+	if (!do_timerfd_gettime_ptr || !do_timerfd_settime_ptr)
+		WARNF("timerfd helpers not found, timers will not be restored");
+	if (!flush_sigqueue_ptr || !do_send_sig_info_ptr)
+		WARNF("signal queue helpers not found, pending signals will not be restored");
+	if (!do_getitimer_ptr || !do_setitimer_ptr)
+		WARNF("itimer helpers not found, itimers will not be restored");
+	if (!dup_mm_ptr || !switch_mm_irqs_off_ptr)
+		WARNF("mm helpers not found, AFL_SNAPSHOT_SWAP will fall back to page restore");
+	if (!dequeue_signal_ptr)
+		WARNF("dequeue_signal not found, crashes will not be intercepted");
+
 	SAYF("Resolved all non-exported symbols");
 
 	return 0;
 }
 
-// void finish_fault_hook(unsigned long ip, unsigned long parent_ip,
-//		       struct ftrace_ops *op, ftrace_regs_ptr regs);
-
 static int __init mod_init(void)
 {
 	int res;
@@ -231,16 +381,66 @@ static int __init mod_init(void)
 		goto err_hooks;
 	}
 
-	// if (!try_hook("finish_fault", &finish_fault_hook)) {
-	//   FATAL("Unable to hook handle_pte_fault");
-	//   res = -ENOENT;
-	//   goto err_hooks;
-	// }
+	if (try_hook("mprotect_fixup", &mprotect_fixup_hook)) {
+		FATAL("Unable to hook mprotect_fixup");
+		res = -ENOENT;
+		goto err_hooks;
+	}
+
+	if (try_hook("finish_fault", &finish_fault_hook)) {
+		FATAL("Unable to hook finish_fault");
+		res = -ENOENT;
+		goto err_hooks;
+	}
+
+	if (try_hook("fd_install", &fd_install_hook)) {
+		FATAL("Unable to hook fd_install");
+		res = -ENOENT;
+		goto err_hooks;
+	}
+
+	// close_fd() is 5.11 and later, __close_range() 5.9 and later.
+	if (try_hook("close_fd", &close_fd_hook) ||
+	    try_hook("__close_range", &close_range_hook)) {
+		WARNF("close_fd/__close_range not hooked, every fd will be restored");
+		fd_close_untracked = true;
+	}
+
+	if (try_hook("do_epoll_ctl", &do_epoll_ctl_hook))
+		WARNF("do_epoll_ctl not hooked, epoll interest lists will not be restored");
+	else
+		epoll_ctl_hooked = true;
+
+	if (try_hook("do_sigaction", &signal_state_hook) ||
+	    try_hook(SYSCALL_NAME("sys_setitimer"), &signal_state_hook) ||
+	    try_hook(SYSCALL_NAME("sys_alarm"), &signal_state_hook) ||
+	    try_hook("__set_current_blocked", &set_current_blocked_hook)) {
+		WARNF("signal state hooks missing, the signal state will be written back on every restore");
+		signal_state_untracked = true;
+	}
+
+	if (try_hook(SYSCALL_NAME("sys_dup2"), &sys_dup_hook) ||
+	    try_hook(SYSCALL_NAME("sys_dup3"), &sys_dup_hook)) {
+		FATAL("Unable to hook dup2/dup3");
+		res = -ENOENT;
+		goto err_hooks;
+	}
+
+	if (try_hook("get_signal", &get_signal_hook))
+		WARNF("get_signal not hooked, crashes will not be intercepted");
+	else
+		get_signal_hooked = true;
 
 	res = resolve_non_exported_symbols();
 	if (res)
 		goto err_hooks;
 
+	res = snapshot_teardown_init();
+	if (res) {
+		FATAL("Unable to allocate the teardown workqueue");
+		goto err_hooks;
+	}
+
 	return 0;
 
 err_hooks:
@@ -258,6 +458,7 @@ static void __exit mod_exit(void)
 	unhook_all();
 	fh_remove_hooks(ftrace_hooks, ARRAY_SIZE(ftrace_hooks));
 	misc_deregister(&misc_dev);
+	snapshot_teardown_exit();
 }
 
 module_init(mod_init);
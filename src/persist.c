@@ -0,0 +1,863 @@
+#include "debug.h"
+#include "linux/fdtable.h"
+#include "linux/file.h"
+#include "linux/fs.h"
+#include "linux/mman.h"
+#include "linux/sched/signal.h"
+#include "linux/slab.h"
+#include "linux/uaccess.h"
+#include "task_data.h"
+#include "snapshot.h"
+
+/*
+ * A snapshot is saved to a file laid out to be mapped. A header with the
+ * registers and the program break comes first, then the mappings, the
+ * regular files that were open and the XSAVE area, then the content of the
+ * private mappings, page aligned and sparse where the pages were never
+ * touched. A fresh process of the same binary, started with address space
+ * randomisation disabled, loads it: the code is checked to be at the same
+ * addresses, the content is mapped privately from the file so a page is only
+ * read when the target touches it, the files are reopened and a new snapshot
+ * is taken at once, so the process resumes at the original take site. The
+ * stack has to keep growing, it is mapped anonymous and read in at once.
+ *
+ * The device is open to every user, so nothing in a file is trusted: the
+ * records are bounded by their sections, the mappings by the user address
+ * space and the file, and the registers are checked to be those of a user
+ * task before anything is mapped.
+ */
+
+#define SNAPSHOT_FILE_MAGIC 0x534c4641 // "AFLS"
+#define SNAPSHOT_FILE_VERSION 2
+
+// Mappings every process has of its own, never saved nor checked.
+#define SNAPSHOT_FILE_SKIPPED_VMA \
+	(VM_IO | VM_PFNMAP | VM_MIXEDMAP | VM_DONTEXPAND)
+
+// The flags sigreturn lets user space set, the others are kept.
+#define SNAPSHOT_FILE_USER_FLAGS                                            \
+	(X86_EFLAGS_CF | X86_EFLAGS_PF | X86_EFLAGS_AF | X86_EFLAGS_ZF |    \
+	 X86_EFLAGS_SF | X86_EFLAGS_TF | X86_EFLAGS_DF | X86_EFLAGS_OF |    \
+	 X86_EFLAGS_RF | X86_EFLAGS_AC)
+
+enum snapshot_file_vma_type {
+	SNAPSHOT_FILE_VMA_DATA,   // content saved in the file
+	SNAPSHOT_FILE_VMA_CODE,   // file mapping the loading process must have
+	SNAPSHOT_FILE_VMA_SHARED, // kept if the loading process has it
+	SNAPSHOT_FILE_VMA_STACK,  // content saved, mapped growing down
+};
+
+enum snapshot_file_fd_type {
+	SNAPSHOT_FILE_FD_PATH,   // regular file reopened by path
+	SNAPSHOT_FILE_FD_DEVICE, // the snapshot device itself
+};
+
+struct snapshot_file_header {
+	u32 magic;
+	u32 version;
+	u32 config;
+	u32 regs_size;
+	u32 xstate_size;
+	u32 nr_vmas;
+	u32 nr_fds;
+	u32 fds_size;
+	u64 start_brk;
+	u64 brk;
+	u64 fsbase;
+	u64 gsbase;
+	u64 data_offset;
+	struct pt_regs regs;
+};
+
+struct snapshot_file_vma {
+	u64 start;
+	u64 end;
+	u64 offset; // of the content, DATA mappings only
+	u32 prot;
+	u32 type;
+};
+
+struct snapshot_file_fd {
+	s32 fd;
+	u32 type;
+	u32 flags;
+	u32 path_len; // with the NUL, the path follows padded to 8 bytes
+	s64 pos;
+};
+
+static int write_file(struct file *file, const void *buf, size_t len,
+		      loff_t *pos)
+{
+	ssize_t res = kernel_write(file, buf, len, pos);
+
+	if (res < 0)
+		return res;
+
+	return res == len ? 0 : -EIO;
+}
+
+static int read_file(struct file *file, void *buf, size_t len, loff_t *pos)
+{
+	ssize_t res = kernel_read(file, buf, len, pos);
+
+	if (res < 0)
+		return res;
+
+	return res == len ? 0 : -EINVAL;
+}
+
+static struct snapshot_file_vma *collect_vmas(struct task_data *data,
+					      u32 *nr_vmas)
+{
+	struct list_head *layout = snapshot_layout(data);
+	struct mm_struct *mm = current->mm;
+	struct snapshot_vma *ss_vma;
+	struct vm_area_struct *vma;
+	struct snapshot_file_vma *vmas, *fv;
+	bool shared, stack;
+	u32 nr = 0;
+
+	list_for_each_entry (ss_vma, layout, all_vmas_node)
+		nr++;
+
+	vmas = kvcalloc(nr, sizeof(struct snapshot_file_vma), GFP_KERNEL);
+	if (!vmas) {
+		FATAL("could not allocate the mapping records");
+		return NULL;
+	}
+
+	fv = vmas;
+
+	mmap_read_lock(mm);
+
+	list_for_each_entry (ss_vma, layout, all_vmas_node) {
+		vma = find_vma(mm, ss_vma->vm_start);
+		if (vma && vma->vm_start <= ss_vma->vm_start) {
+			if (vma->vm_flags & SNAPSHOT_FILE_SKIPPED_VMA)
+				continue;
+			shared = vma->vm_flags & VM_SHARED;
+			stack = vma->vm_flags & VM_GROWSDOWN;
+		} else {
+			// Unmapped during the iteration.
+			shared = false;
+			stack = false;
+		}
+
+		fv->start = ss_vma->vm_start;
+		fv->end = ss_vma->vm_end;
+		fv->prot = ss_vma->prot;
+
+		if (shared)
+			fv->type = SNAPSHOT_FILE_VMA_SHARED;
+		else if (stack && (ss_vma->prot & PROT_WRITE))
+			fv->type = SNAPSHOT_FILE_VMA_STACK;
+		else if (ss_vma->is_anonymous_private ||
+			 (ss_vma->prot & PROT_WRITE))
+			fv->type = SNAPSHOT_FILE_VMA_DATA;
+		else
+			fv->type = SNAPSHOT_FILE_VMA_CODE;
+
+		fv++;
+	}
+
+	mmap_read_unlock(mm);
+
+	*nr_vmas = fv - vmas;
+	return vmas;
+}
+
+static int grab_file(const void *p, struct file *file, unsigned int fd)
+{
+	*(struct file **)p = get_file(file);
+	return fd + 1;
+}
+
+static loff_t saved_file_pos(struct open_files_snapshot *files_snap,
+			     struct file *file, unsigned int fd)
+{
+	if (files_snap->files && fd < files_snap->max_fds &&
+	    files_snap->offsets[fd] >= 0)
+		return files_snap->offsets[fd];
+
+	return file->f_pos;
+}
+
+// The descriptors open at take time when the snapshot has them, those open
+// now otherwise.
+static void *collect_fds(struct task_data *data, struct file *dev,
+			 int skip_fd, u32 *nr_fds, u32 *fds_size)
+{
+	struct open_files_snapshot *files_snap = &data->ss.ss_files;
+	struct files_struct *files = files_snap->files ?: current->files;
+	struct snapshot_file_fd *rec;
+	struct file *file;
+	char *path_buf, *path, *fds = NULL, *grown;
+	unsigned int fd;
+	size_t size = 0, len;
+	u32 nr = 0;
+	int next;
+
+	path_buf = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!path_buf)
+		return ERR_PTR(-ENOMEM);
+
+	// Each pass grabs the first open descriptor from fd on.
+	for (fd = 0; (next = iterate_fd(files, fd, grab_file, &file)) > 0;
+	     fd = next) {
+		fd = next - 1;
+		if (fd == skip_fd && !files_snap->files) {
+			fput(file);
+			continue;
+		}
+
+		path = NULL;
+		if (file->f_op != dev->f_op) {
+			// Pipes, sockets and the like cannot be reopened.
+			if (S_ISREG(file_inode(file)->i_mode))
+				path = d_path(&file->f_path, path_buf,
+					      PATH_MAX);
+			if (!path || IS_ERR(path)) {
+				DBG_PRINT("fd %u is not saved\n", fd);
+				fput(file);
+				continue;
+			}
+		}
+
+		len = path ? strlen(path) + 1 : 0;
+		grown = krealloc(fds, size + sizeof(*rec) + ALIGN(len, 8),
+				 GFP_KERNEL | __GFP_ZERO);
+		if (!grown) {
+			fput(file);
+			kfree(fds);
+			kfree(path_buf);
+			return ERR_PTR(-ENOMEM);
+		}
+
+		fds = grown;
+		rec = (struct snapshot_file_fd *)(fds + size);
+		rec->fd = fd;
+		rec->type = path ? SNAPSHOT_FILE_FD_PATH :
+				   SNAPSHOT_FILE_FD_DEVICE;
+		rec->flags = file->f_flags &
+			     (O_ACCMODE | O_APPEND | O_NONBLOCK | O_LARGEFILE);
+		rec->path_len = len;
+		rec->pos = saved_file_pos(files_snap, file, fd);
+		if (path)
+			memcpy(rec + 1, path, len);
+
+		rcu_read_lock();
+		if (close_on_exec(fd, files_fdtable(files)))
+			rec->flags |= O_CLOEXEC;
+		rcu_read_unlock();
+
+		size += sizeof(*rec) + ALIGN(len, 8);
+		nr++;
+		fput(file);
+	}
+
+	kfree(path_buf);
+
+	*nr_fds = nr;
+	*fds_size = size;
+	return fds;
+}
+
+static bool has_content(struct snapshot_file_vma *fv)
+{
+	return fv->type == SNAPSHOT_FILE_VMA_DATA ||
+	       fv->type == SNAPSHOT_FILE_VMA_STACK;
+}
+
+static int write_vma_data(struct task_data *data, struct file *file,
+			  struct snapshot_file_vma *fv, void *buf)
+{
+	unsigned long addr;
+	loff_t pos, end = fv->offset + (fv->end - fv->start);
+	bool last_written = false;
+	int res;
+
+	for (addr = fv->start; addr < fv->end; addr += PAGE_SIZE) {
+		last_written = read_snapshot_page(data, addr, buf);
+		if (!last_written)
+			continue;
+
+		pos = fv->offset + (addr - fv->start);
+		res = write_file(file, buf, PAGE_SIZE, &pos);
+		if (res)
+			return res;
+	}
+
+	// The untouched pages are holes, the file still has to cover them.
+	if (!last_written) {
+		memset(buf, 0, PAGE_SIZE);
+		pos = end - PAGE_SIZE;
+		return write_file(file, buf, PAGE_SIZE, &pos);
+	}
+
+	return 0;
+}
+
+int save_snapshot(int fd, struct file *dev)
+{
+	struct task_data *data = get_task_data(current);
+	struct snapshot_level *level;
+	struct snapshot_ext_regs *ext;
+	struct snapshot_file_header *hdr = NULL;
+	struct snapshot_file_vma *vmas = NULL;
+	struct file *file;
+	void *fds = NULL, *buf = NULL;
+	loff_t pos = 0;
+	u64 data_offset;
+	u32 i;
+	int res;
+
+	if (!data || !have_snapshot(data) ||
+	    !(data->config & AFL_SNAPSHOT_REGS)) {
+		pr_err("no snapshot with registers to save");
+		return -EINVAL;
+	}
+
+	if (!list_empty(&data->ss.shadow_vmas) ||
+	    (data->config & AFL_SNAPSHOT_SWAP)) {
+		pr_err("cannot save a snapshot with shadow mappings or swap");
+		return -EOPNOTSUPP;
+	}
+
+	file = fget(fd);
+	if (!file)
+		return -EBADF;
+
+	hdr = kzalloc(sizeof(struct snapshot_file_header), GFP_KERNEL);
+	buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!hdr || !buf) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	vmas = collect_vmas(data, &hdr->nr_vmas);
+	if (!vmas) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	fds = collect_fds(data, dev, fd, &hdr->nr_fds, &hdr->fds_size);
+	if (IS_ERR(fds)) {
+		res = PTR_ERR(fds);
+		fds = NULL;
+		goto out;
+	}
+
+	level = top_snapshot_level(&data->ss);
+	ext = level ? &level->ext_regs : &data->ss.ext_regs;
+
+	hdr->magic = SNAPSHOT_FILE_MAGIC;
+	hdr->version = SNAPSHOT_FILE_VERSION;
+	hdr->config = data->config;
+	hdr->regs_size = sizeof(struct pt_regs);
+	hdr->xstate_size = ext->xstate ? get_xstate_size() : 0;
+	hdr->start_brk = current->mm->start_brk;
+	hdr->brk = level ? level->oldbrk : data->ss.oldbrk;
+	hdr->fsbase = ext->fsbase;
+	hdr->gsbase = ext->gsbase;
+	hdr->regs = level ? level->regs : data->ss.regs;
+
+	data_offset = PAGE_ALIGN(sizeof(struct snapshot_file_header) +
+				 hdr->nr_vmas * sizeof(struct snapshot_file_vma) +
+				 hdr->fds_size + hdr->xstate_size);
+	hdr->data_offset = data_offset;
+
+	for (i = 0; i < hdr->nr_vmas; i++) {
+		if (!has_content(&vmas[i]))
+			continue;
+
+		vmas[i].offset = data_offset;
+		data_offset += vmas[i].end - vmas[i].start;
+	}
+
+	// The FILEDATA hooks must not see our writes.
+	data->ss.restoring_files = true;
+
+	res = write_file(file, hdr, sizeof(struct snapshot_file_header), &pos);
+	if (!res)
+		res = write_file(file, vmas,
+				 hdr->nr_vmas * sizeof(struct snapshot_file_vma),
+				 &pos);
+	if (!res && hdr->fds_size)
+		res = write_file(file, fds, hdr->fds_size, &pos);
+	if (!res && hdr->xstate_size)
+		res = write_file(file, ext->xstate, hdr->xstate_size, &pos);
+
+	for (i = 0; i < hdr->nr_vmas && !res; i++) {
+		if (has_content(&vmas[i]))
+			res = write_vma_data(data, file, &vmas[i], buf);
+	}
+
+	data->ss.restoring_files = false;
+
+	if (res)
+		pr_err("error while saving the snapshot: %d", res);
+
+out:
+	kfree(hdr);
+	kfree(buf);
+	kvfree(vmas);
+	kfree(fds);
+	fput(file);
+	return res;
+}
+
+static int check_header(struct snapshot_file_header *hdr)
+{
+	u64 records = sizeof(struct snapshot_file_header) +
+		      (u64)hdr->nr_vmas * sizeof(struct snapshot_file_vma) +
+		      hdr->fds_size + hdr->xstate_size;
+	u64 max_fds_size = (u64)hdr->nr_fds *
+			   (sizeof(struct snapshot_file_fd) + PATH_MAX);
+
+	if (!hdr->nr_vmas || hdr->nr_vmas > DEFAULT_MAX_MAP_COUNT ||
+	    hdr->nr_fds > rlimit(RLIMIT_NOFILE) ||
+	    hdr->fds_size > max_fds_size ||
+	    !PAGE_ALIGNED(hdr->data_offset) || hdr->data_offset < records)
+		return -EINVAL;
+
+	if (hdr->start_brk > hdr->brk || hdr->brk > TASK_SIZE ||
+	    hdr->fsbase >= TASK_SIZE_MAX || hdr->gsbase >= TASK_SIZE_MAX)
+		return -EINVAL;
+
+	// Anything else would return to user space with kernel segments.
+	if ((hdr->regs.cs != __USER_CS && hdr->regs.cs != __USER32_CS) ||
+	    hdr->regs.ss != __USER_DS)
+		return -EINVAL;
+
+	return 0;
+}
+
+// Sorted, page aligned, in the user address space and, for the content,
+// within the file.
+static int check_vmas(struct snapshot_file_vma *vmas, u32 nr_vmas,
+		      u64 data_offset, u64 file_size)
+{
+	struct snapshot_file_vma *fv;
+	u64 prev_end = 0;
+
+	for (fv = vmas; fv < vmas + nr_vmas; fv++) {
+		if (fv->start < prev_end || fv->start >= fv->end ||
+		    !PAGE_ALIGNED(fv->start) || !PAGE_ALIGNED(fv->end) ||
+		    fv->end > TASK_SIZE)
+			return -EINVAL;
+
+		if (fv->type > SNAPSHOT_FILE_VMA_STACK ||
+		    (fv->prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)))
+			return -EINVAL;
+
+		if (fv->type == SNAPSHOT_FILE_VMA_STACK &&
+		    !(fv->prot & PROT_WRITE))
+			return -EINVAL;
+
+		if (has_content(fv) &&
+		    (!PAGE_ALIGNED(fv->offset) || fv->offset < data_offset ||
+		     fv->offset > file_size ||
+		     fv->end - fv->start > file_size - fv->offset))
+			return -EINVAL;
+
+		prev_end = fv->end;
+	}
+
+	return 0;
+}
+
+static int check_fds(void *fds, u32 nr_fds, u32 fds_size)
+{
+	struct snapshot_file_fd *rec;
+	size_t left = fds_size, len;
+	char *path;
+	u32 i;
+
+	for (i = 0; i < nr_fds; i++) {
+		if (left < sizeof(struct snapshot_file_fd))
+			return -EINVAL;
+
+		rec = fds + (fds_size - left);
+		left -= sizeof(struct snapshot_file_fd);
+
+		len = ALIGN((size_t)rec->path_len, 8);
+		if (rec->path_len > PATH_MAX || len > left || rec->fd < 0 ||
+		    rec->fd >= rlimit(RLIMIT_NOFILE))
+			return -EINVAL;
+
+		if (rec->type == SNAPSHOT_FILE_FD_PATH) {
+			path = (char *)(rec + 1);
+			if (!rec->path_len || path[rec->path_len - 1])
+				return -EINVAL;
+		} else if (rec->type != SNAPSHOT_FILE_FD_DEVICE) {
+			return -EINVAL;
+		}
+
+		left -= len;
+	}
+
+	return left ? -EINVAL : 0;
+}
+
+static int check_layout(struct snapshot_file_vma *vmas, u32 nr_vmas)
+{
+	struct mm_struct *mm = current->mm;
+	struct vm_area_struct *vma;
+	struct snapshot_file_vma *fv;
+	int res = 0;
+
+	mmap_read_lock(mm);
+
+	for (fv = vmas; fv < vmas + nr_vmas && !res; fv++) {
+		if (has_content(fv))
+			continue;
+
+		vma = find_vma(mm, fv->start);
+		if (vma && vma->vm_start <= fv->start && vma->vm_end >= fv->end)
+			continue;
+
+		if (fv->type == SNAPSHOT_FILE_VMA_SHARED) {
+			WARNF("shared mapping 0x%016llx-0x%016llx is missing",
+			      fv->start, fv->end);
+			continue;
+		}
+
+		pr_err("mapping 0x%016llx-0x%016llx differs, is address space randomisation disabled?",
+		       fv->start, fv->end);
+		res = -EINVAL;
+	}
+
+	mmap_read_unlock(mm);
+
+	return res;
+}
+
+static int add_unsaved_range(struct list_head *ranges, unsigned long start,
+			     unsigned long end)
+{
+	struct snapshot_prot_range *range;
+
+	range = kmalloc(sizeof(struct snapshot_prot_range), GFP_KERNEL);
+	if (!range)
+		return -ENOMEM;
+
+	range->start = start;
+	range->end = end;
+	list_add_tail(&range->node, ranges);
+
+	return 0;
+}
+
+// The records are sorted by address, like the snapshot layout.
+static int unmap_unsaved(struct snapshot_file_vma *vmas, u32 nr_vmas)
+{
+	struct mm_struct *mm = current->mm;
+	struct vm_area_struct *vma;
+	struct snapshot_prot_range *range, *next;
+	struct snapshot_file_vma *fv = vmas;
+	unsigned long cursor;
+	LIST_HEAD(ranges);
+	int res = 0;
+
+	mmap_read_lock(mm);
+
+	for (vma = mm->mmap; vma && !res; vma = vma->vm_next) {
+		if (vma->vm_flags & SNAPSHOT_FILE_SKIPPED_VMA)
+			continue;
+
+		cursor = vma->vm_start;
+		while (fv < vmas + nr_vmas && fv->end <= cursor)
+			fv++;
+
+		for (; fv < vmas + nr_vmas && fv->start < vma->vm_end && !res;
+		     fv++) {
+			if (fv->start > cursor)
+				res = add_unsaved_range(&ranges, cursor,
+							fv->start);
+			cursor = max_t(unsigned long, cursor, fv->end);
+			if (fv->end > vma->vm_end)
+				break;
+		}
+
+		if (!res && cursor < vma->vm_end)
+			res = add_unsaved_range(&ranges, cursor, vma->vm_end);
+	}
+
+	mmap_read_unlock(mm);
+
+	list_for_each_entry_safe (range, next, &ranges, node) {
+		if (!res) {
+			DBG_PRINT("unmapping (0x%016lx, 0x%016lx)\n",
+				  range->start, range->end);
+			res = vm_munmap(range->start, range->end - range->start);
+		}
+
+		list_del(&range->node);
+		kfree(range);
+	}
+
+	return res;
+}
+
+// A file mapping cannot grow, the stack is anonymous and read in at once.
+static int map_stack(struct file *file, struct snapshot_file_vma *fv,
+		     void *buf)
+{
+	unsigned long addr;
+	loff_t pos;
+	int res;
+
+	addr = vm_mmap(NULL, fv->start, fv->end - fv->start, fv->prot,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_GROWSDOWN,
+		       0);
+	if (IS_ERR_VALUE(addr) || addr != fv->start) {
+		FATAL("vm_mmap failed, start: 0x%016llx, end: 0x%016llx, res: 0x%016lx\n",
+		      fv->start, fv->end, addr);
+		return IS_ERR_VALUE(addr) ? addr : -EINVAL;
+	}
+
+	for (addr = fv->start; addr < fv->end; addr += PAGE_SIZE) {
+		pos = fv->offset + (addr - fv->start);
+		res = read_file(file, buf, PAGE_SIZE, &pos);
+		if (res)
+			return res;
+
+		// Holes stay on the zero page.
+		if (!memchr_inv(buf, 0, PAGE_SIZE))
+			continue;
+
+		if (copy_to_user((void __user *)addr, buf, PAGE_SIZE))
+			return -EFAULT;
+	}
+
+	return 0;
+}
+
+static int map_saved(struct file *file, struct snapshot_file_vma *vmas,
+		     u32 nr_vmas, void *buf)
+{
+	struct snapshot_file_vma *fv;
+	unsigned long addr;
+	int res;
+
+	for (fv = vmas; fv < vmas + nr_vmas; fv++) {
+		if (fv->type == SNAPSHOT_FILE_VMA_STACK) {
+			res = map_stack(file, fv, buf);
+			if (res)
+				return res;
+			continue;
+		}
+
+		if (fv->type != SNAPSHOT_FILE_VMA_DATA)
+			continue;
+
+		// Read lazily from the file, written pages become anonymous.
+		addr = vm_mmap(file, fv->start, fv->end - fv->start, fv->prot,
+			       MAP_PRIVATE | MAP_FIXED, fv->offset);
+		if (IS_ERR_VALUE(addr) || addr != fv->start) {
+			FATAL("vm_mmap failed, start: 0x%016llx, end: 0x%016llx, res: 0x%016lx\n",
+			      fv->start, fv->end, addr);
+			return IS_ERR_VALUE(addr) ? addr : -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static void reopen_fds(void *fds, u32 nr_fds, int skip_fd, struct file *dev)
+{
+	struct snapshot_file_fd *rec = fds;
+	struct file *file;
+	char *path;
+	int res;
+	u32 i;
+
+	for (i = 0; i < nr_fds; i++) {
+		path = (char *)(rec + 1);
+
+		if (rec->fd == skip_fd) {
+			WARNF("fd %d is taken by the snapshot file", rec->fd);
+			goto next;
+		}
+
+		if (rec->type == SNAPSHOT_FILE_FD_DEVICE) {
+			file = get_file(dev);
+		} else {
+			file = filp_open(path, rec->flags & ~O_CLOEXEC, 0);
+			if (IS_ERR(file)) {
+				WARNF("could not reopen %s: %ld", path,
+				      PTR_ERR(file));
+				goto next;
+			}
+
+			if (vfs_llseek(file, rec->pos, SEEK_SET) < 0)
+				WARNF("could not seek %s", path);
+		}
+
+		res = replace_fd(rec->fd, file, rec->flags & O_CLOEXEC);
+		if (res < 0)
+			WARNF("could not install fd %d: %d", rec->fd, res);
+		fput(file);
+
+	next:
+		rec = (void *)(rec + 1) + ALIGN(rec->path_len, 8);
+	}
+}
+
+static int restore_saved_regs(struct snapshot_file_header *hdr,
+			      void *xstate)
+{
+	struct snapshot_ext_regs ext = {
+		.fsbase = hdr->fsbase,
+		.gsbase = hdr->gsbase,
+	};
+	struct pt_regs *regs = task_pt_regs(current);
+	unsigned long flags = regs->flags;
+	int res;
+
+	*regs = hdr->regs;
+	regs->flags = (flags & ~SNAPSHOT_FILE_USER_FLAGS) |
+		      (hdr->regs.flags & SNAPSHOT_FILE_USER_FLAGS);
+
+	if (xstate) {
+		res = alloc_ext_regs(&ext);
+		if (res)
+			return res;
+		memcpy(ext.xstate, xstate, hdr->xstate_size);
+	}
+
+	restore_ext_regs(&ext);
+	free_ext_regs(&ext);
+
+	return 0;
+}
+
+int load_snapshot(int fd, struct file *dev)
+{
+	struct task_data *data = get_task_data(current);
+	struct mm_struct *mm = current->mm;
+	struct snapshot_file_header *hdr = NULL;
+	struct snapshot_file_vma *vmas = NULL;
+	void *fds = NULL, *xstate = NULL, *buf = NULL;
+	struct file *file;
+	loff_t pos = 0;
+	int res;
+
+	if (data && have_snapshot(data)) {
+		pr_err("cannot load a snapshot over an existing one");
+		return -EBUSY;
+	}
+
+	file = fget(fd);
+	if (!file)
+		return -EBADF;
+
+	hdr = kmalloc(sizeof(struct snapshot_file_header), GFP_KERNEL);
+	if (!hdr) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	res = read_file(file, hdr, sizeof(struct snapshot_file_header), &pos);
+	if (res)
+		goto out;
+
+	if (hdr->magic != SNAPSHOT_FILE_MAGIC ||
+	    hdr->version != SNAPSHOT_FILE_VERSION ||
+	    hdr->regs_size != sizeof(struct pt_regs)) {
+		pr_err("not a snapshot file of this module");
+		res = -EINVAL;
+		goto out;
+	}
+
+	res = check_header(hdr);
+	if (res) {
+		pr_err("corrupted snapshot file header");
+		goto out;
+	}
+
+	vmas = kvmalloc_array(hdr->nr_vmas, sizeof(struct snapshot_file_vma),
+			      GFP_KERNEL);
+	fds = kvmalloc(hdr->fds_size, GFP_KERNEL);
+	if (!vmas || (hdr->fds_size && !fds)) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	res = read_file(file, vmas,
+			hdr->nr_vmas * sizeof(struct snapshot_file_vma), &pos);
+	if (!res && hdr->fds_size)
+		res = read_file(file, fds, hdr->fds_size, &pos);
+	if (res)
+		goto out;
+
+	res = check_vmas(vmas, hdr->nr_vmas, hdr->data_offset,
+			 i_size_read(file_inode(file)));
+	if (!res)
+		res = check_fds(fds, hdr->nr_fds, hdr->fds_size);
+	if (res) {
+		pr_err("corrupted snapshot file records");
+		goto out;
+	}
+
+	// The FPU state is only meaningful on a CPU with the same features.
+	if (hdr->xstate_size == get_xstate_size()) {
+		xstate = kmalloc(hdr->xstate_size, GFP_KERNEL);
+		if (!xstate) {
+			res = -ENOMEM;
+			goto out;
+		}
+
+		res = read_file(file, xstate, hdr->xstate_size, &pos);
+		if (res)
+			goto out;
+
+		if (!check_xstate(xstate)) {
+			pr_err("corrupted snapshot file xstate");
+			res = -EINVAL;
+			goto out;
+		}
+	} else if (hdr->xstate_size) {
+		WARNF("xstate size differs, the FPU state is not loaded");
+	}
+
+	res = check_layout(vmas, hdr->nr_vmas);
+	if (res)
+		goto out;
+
+	buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!buf) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	// No way back from here, the address space is replaced.
+	res = unmap_unsaved(vmas, hdr->nr_vmas);
+	if (!res)
+		res = map_saved(file, vmas, hdr->nr_vmas, buf);
+	if (!res)
+		res = restore_saved_regs(hdr, xstate);
+	if (res) {
+		FATAL("could not load the snapshot: %d", res);
+		send_sig(SIGKILL, current, 1);
+		goto out;
+	}
+
+	mmap_write_lock(mm);
+	mm->start_brk = hdr->start_brk;
+	mm->brk = hdr->brk;
+	mmap_write_unlock(mm);
+
+	reopen_fds(fds, hdr->nr_fds, fd, dev);
+
+	res = take_snapshot(hdr->config);
+
+out:
+	kfree(hdr);
+	kvfree(vmas);
+	kvfree(fds);
+	kfree(xstate);
+	kfree(buf);
+	fput(file);
+	return res;
+}
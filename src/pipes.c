@@ -0,0 +1,355 @@
+#include "debug.h"
+#include "linux/fdtable.h"
+#include "linux/file.h"
+#include "linux/fs.h"
+#include "linux/net.h"
+#include "linux/pipe_fs_i.h"
+#include "linux/skbuff.h"
+#include "linux/slab.h"
+#include "net/af_unix.h"
+#include "net/sock.h"
+#include "task_data.h"
+#include "snapshot.h"
+
+/*
+ * Pipes and unix stream sockets cannot be seeked back, so the data that was
+ * queued in them at snapshot time is copied aside without consuming it. On
+ * restore whatever is queued is dropped and the saved data is queued again,
+ * which lets stdin driven targets read the same input after every restore.
+ * Only with AFL_SNAPSHOT_STREAMS, a harness feeding each input through a pipe
+ * must not get the input of the snapshot time back.
+ */
+
+static bool is_saved_stream(struct task_data *data, struct file *file)
+{
+	struct snapshot_stream *st;
+
+	list_for_each_entry (st, &data->ss.streams, node) {
+		if (file_inode(st->file) == file_inode(file))
+			return true;
+	}
+
+	return false;
+}
+
+static struct snapshot_stream *add_snapshot_stream(struct task_data *data,
+						   struct file *file,
+						   size_t len)
+{
+	struct snapshot_stream *st;
+
+	st = kmalloc(sizeof(struct snapshot_stream), GFP_KERNEL);
+	if (!st) {
+		FATAL("snapshot_stream allocation failed");
+		return NULL;
+	}
+
+	st->data = NULL;
+	if (len) {
+		st->data = kvmalloc(len, GFP_KERNEL);
+		if (!st->data) {
+			FATAL("could not allocate memory for stream data");
+			kfree(st);
+			return NULL;
+		}
+	}
+
+	st->file = get_file(file);
+	st->len = 0;
+	list_add_tail(&st->node, &data->ss.streams);
+
+	return st;
+}
+
+static size_t pipe_queued_bytes(struct pipe_inode_info *pipe)
+{
+	unsigned int mask = pipe->ring_size - 1;
+	unsigned int tail;
+	size_t len = 0;
+
+	for (tail = pipe->tail; tail != pipe->head; tail++)
+		len += pipe->bufs[tail & mask].len;
+
+	return len;
+}
+
+static int save_pipe(struct task_data *data, struct file *file)
+{
+	struct pipe_inode_info *pipe = file->private_data;
+	struct snapshot_stream *st;
+	struct pipe_buffer *buf;
+	unsigned int mask, tail;
+	void *addr;
+
+	pipe_lock(pipe);
+
+	st = add_snapshot_stream(data, file, pipe_queued_bytes(pipe));
+	if (!st) {
+		pipe_unlock(pipe);
+		return -ENOMEM;
+	}
+
+	mask = pipe->ring_size - 1;
+	for (tail = pipe->tail; tail != pipe->head; tail++) {
+		buf = &pipe->bufs[tail & mask];
+		if (pipe_buf_confirm(pipe, buf))
+			break;
+
+		addr = kmap_local_page(buf->page);
+		memcpy(st->data + st->len, addr + buf->offset, buf->len);
+		kunmap_local(addr);
+		st->len += buf->len;
+	}
+
+	pipe_unlock(pipe);
+
+	DBG_PRINT("saved %zu bytes of pipe data\n", st->len);
+
+	return 0;
+}
+
+static int save_unix_stream(struct task_data *data, struct file *file,
+			    struct sock *sk)
+{
+	struct snapshot_stream *st;
+	struct sk_buff *skb;
+	size_t len = 0;
+	size_t chunk;
+
+	// Readers hold iolock, nothing is consumed while we copy.
+	mutex_lock(&unix_sk(sk)->iolock);
+
+	spin_lock(&sk->sk_receive_queue.lock);
+	skb_queue_walk (&sk->sk_receive_queue, skb)
+		len += skb->len - UNIXCB(skb).consumed;
+	spin_unlock(&sk->sk_receive_queue.lock);
+
+	st = add_snapshot_stream(data, file, len);
+	if (!st) {
+		mutex_unlock(&unix_sk(sk)->iolock);
+		return -ENOMEM;
+	}
+
+	// Senders may queue more meanwhile, only what was counted is copied.
+	spin_lock(&sk->sk_receive_queue.lock);
+	skb_queue_walk (&sk->sk_receive_queue, skb) {
+		chunk = min_t(size_t, skb->len - UNIXCB(skb).consumed,
+			      len - st->len);
+		if (!chunk)
+			break;
+
+		if (skb_copy_bits(skb, UNIXCB(skb).consumed,
+				  st->data + st->len, chunk))
+			break;
+		st->len += chunk;
+	}
+	spin_unlock(&sk->sk_receive_queue.lock);
+
+	mutex_unlock(&unix_sk(sk)->iolock);
+
+	DBG_PRINT("saved %zu bytes of unix socket data\n", st->len);
+
+	return 0;
+}
+
+static struct sock *get_unix_stream_sock(struct file *file)
+{
+	struct socket *sock = SOCKET_I(file_inode(file));
+
+	if (!sock->sk)
+		return NULL;
+
+	if (sock->sk->sk_family != AF_UNIX || sock->type != SOCK_STREAM)
+		return NULL;
+
+	return sock->sk;
+}
+
+static int save_stream(struct task_data *data, struct file *file)
+{
+	struct inode *inode = file_inode(file);
+	struct sock *sk;
+
+	if (is_saved_stream(data, file))
+		return 0;
+
+	if (S_ISFIFO(inode->i_mode))
+		return save_pipe(data, file);
+
+	if (S_ISSOCK(inode->i_mode)) {
+		sk = get_unix_stream_sock(file);
+		if (sk)
+			return save_unix_stream(data, file, sk);
+	}
+
+	return 0;
+}
+
+int take_pipes_snapshot(struct task_data *data)
+{
+	struct files_struct *files = current->files;
+	struct file *file;
+	unsigned int max_fds;
+	unsigned int fd;
+	int error = 0;
+
+	if (!(data->config & AFL_SNAPSHOT_STREAMS))
+		return 0;
+
+	rcu_read_lock();
+	max_fds = files_fdtable(files)->max_fds;
+	rcu_read_unlock();
+
+	for (fd = 0; fd < max_fds; fd++) {
+		file = fget(fd);
+		if (!file)
+			continue;
+
+		error = save_stream(data, file);
+		fput(file);
+		if (error)
+			break;
+	}
+
+	return error;
+}
+
+static void drain_pipe(struct pipe_inode_info *pipe)
+{
+	unsigned int mask;
+	struct pipe_buffer *buf;
+
+	pipe_lock(pipe);
+
+	mask = pipe->ring_size - 1;
+	while (!pipe_empty(pipe->head, pipe->tail)) {
+		buf = &pipe->bufs[pipe->tail & mask];
+		pipe_buf_release(pipe, buf);
+		pipe->tail++;
+	}
+
+	pipe_unlock(pipe);
+
+	wake_up_interruptible_all(&pipe->wr_wait);
+}
+
+static int restore_pipe(struct snapshot_stream *st)
+{
+	struct file *writer;
+	loff_t pos = 0;
+	ssize_t res = 0;
+	size_t done = 0;
+
+	drain_pipe(st->file->private_data);
+
+	if (!st->len)
+		return 0;
+
+	// Reopening the pipe gives a write end even when only the read end
+	// belongs to the target, as with a pipe on stdin.
+	writer = dentry_open(&st->file->f_path, O_WRONLY | O_NONBLOCK,
+			     current_cred());
+	if (IS_ERR(writer)) {
+		FATAL("could not open the pipe for writing: %ld",
+		      PTR_ERR(writer));
+		return PTR_ERR(writer);
+	}
+
+	// The write end does not block, a pipe shrunk with F_SETPIPE_SZ since
+	// the snapshot may take less than the whole data.
+	while (done < st->len) {
+		res = kernel_write(writer, st->data + done, st->len - done, &pos);
+		if (res <= 0)
+			break;
+		done += res;
+	}
+
+	fput(writer);
+
+	if (done < st->len) {
+		FATAL("could not refill the pipe, %zu of %zu bytes written: %zd",
+		      done, st->len, res);
+		return res < 0 ? res : -EAGAIN;
+	}
+
+	return 0;
+}
+
+static int restore_unix_stream(struct snapshot_stream *st, struct sock *sk)
+{
+	struct msghdr msg = { .msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL };
+	struct kvec vec;
+	struct sock *peer;
+	size_t done = 0;
+	int res = 0;
+
+	mutex_lock(&unix_sk(sk)->iolock);
+	skb_queue_purge(&sk->sk_receive_queue);
+	mutex_unlock(&unix_sk(sk)->iolock);
+
+	if (!st->len)
+		return 0;
+
+	// The data is sent again from the other end of the connection.
+	peer = unix_peer_get(sk);
+	if (!peer || !peer->sk_socket) {
+		WARNF("unix socket peer is gone, cannot restore its data");
+		if (peer)
+			sock_put(peer);
+		return -ENOTCONN;
+	}
+
+	while (done < st->len) {
+		vec.iov_base = st->data + done;
+		vec.iov_len = st->len - done;
+		res = kernel_sendmsg(peer->sk_socket, &msg, &vec, 1, vec.iov_len);
+		if (res <= 0)
+			break;
+		done += res;
+	}
+
+	sock_put(peer);
+
+	if (done < st->len) {
+		FATAL("could not refill the unix socket, %zu of %zu bytes sent: %d",
+		      done, st->len, res);
+		return res < 0 ? res : -EAGAIN;
+	}
+
+	return 0;
+}
+
+int recover_pipes_snapshot(struct task_data *data)
+{
+	struct snapshot_stream *st;
+	struct sock *sk;
+	int error = 0;
+	int res = 0;
+
+	list_for_each_entry (st, &data->ss.streams, node) {
+		if (S_ISFIFO(file_inode(st->file)->i_mode)) {
+			res = restore_pipe(st);
+		} else {
+			sk = get_unix_stream_sock(st->file);
+			if (sk)
+				res = restore_unix_stream(st, sk);
+		}
+
+		if (res)
+			error = res;
+	}
+
+	return error;
+}
+
+void clean_pipes_snapshot(struct task_data *data)
+{
+	struct snapshot_stream *st, *next;
+
+	list_for_each_entry_safe (st, next, &data->ss.streams, node) {
+		list_del(&st->node);
+		fput(st->file);
+		kvfree(st->data);
+		kfree(st);
+	}
+}
@@ -0,0 +1,101 @@
+#include "debug.h"
+#include "linux/hashtable.h"
+#include "linux/moduleparam.h"
+#include "linux/refcount.h"
+#include "linux/slab.h"
+#include "linux/spinlock.h"
+#include "linux/xxhash.h"
+#include "task_data.h"
+#include "snapshot.h"
+
+/*
+ * Instances of the same target snapshotted at the same point save the same
+ * pristine pages. Once the saved copy of a page is final it is looked up by
+ * content in a table shared by all the snapshots, and identical copies are
+ * replaced by a single read-only one that is reference counted. A snapshot
+ * that has to save the page again drops its reference and copies the page
+ * into a buffer of its own.
+ */
+
+#define PRISTINE_HASH_BITS 14
+
+struct pristine_page {
+	u64 hash;
+	refcount_t ref;
+	void *data;
+	struct hlist_node node;
+};
+
+static bool dedup_pages = true;
+module_param(dedup_pages, bool, 0644);
+MODULE_PARM_DESC(dedup_pages,
+		 "Share identical saved pages between snapshots");
+
+static DEFINE_HASHTABLE(pristine_pages, PRISTINE_HASH_BITS);
+static DEFINE_SPINLOCK(pristine_lock);
+
+void share_page_data(struct snapshot_page *sp)
+{
+	struct pristine_page *pp, *new;
+	u64 hash;
+
+	if (!dedup_pages || sp->pristine || !sp->page_data ||
+	    !test_bit(SNAPSHOT_PAGE_COPIED, &sp->flags))
+		return;
+
+	hash = xxh64(sp->page_data, PAGE_SIZE, 0);
+
+	new = kmalloc(sizeof(struct pristine_page), GFP_KERNEL);
+	if (!new)
+		return;
+
+	spin_lock(&pristine_lock);
+	hash_for_each_possible (pristine_pages, pp, node, hash) {
+		if (pp->hash != hash ||
+		    memcmp(pp->data, sp->page_data, PAGE_SIZE))
+			continue;
+
+		refcount_inc(&pp->ref);
+		spin_unlock(&pristine_lock);
+
+		DBG_PRINT("sharing saved page 0x%016lx\n", sp->page_base);
+		kfree(new);
+		kfree(sp->page_data);
+		sp->page_data = pp->data;
+		sp->pristine = pp;
+		return;
+	}
+
+	// The first copy becomes the shared one.
+	new->hash = hash;
+	refcount_set(&new->ref, 1);
+	new->data = sp->page_data;
+	hash_add(pristine_pages, &new->node, hash);
+	spin_unlock(&pristine_lock);
+
+	sp->pristine = new;
+}
+
+void release_page_data(struct snapshot_page *sp)
+{
+	struct pristine_page *pp = sp->pristine;
+
+	if (!pp) {
+		kfree(sp->page_data);
+	} else {
+		spin_lock(&pristine_lock);
+		if (refcount_dec_and_test(&pp->ref))
+			hash_del(&pp->node);
+		else
+			pp = NULL;
+		spin_unlock(&pristine_lock);
+
+		if (pp) {
+			kfree(pp->data);
+			kfree(pp);
+		}
+	}
+
+	sp->page_data = NULL;
+	sp->pristine = NULL;
+}
@@ -0,0 +1,220 @@
+#include "debug.h"
+#include "linux/slab.h"
+#include "asm/cpufeature.h"
+#include "asm/fpu/api.h"
+#include "asm/msr.h"
+#include "task_data.h"
+#include "snapshot.h"
+
+/*
+ * pt_regs only holds the general purpose registers. The FPU/SSE/AVX state
+ * and the fs/gs bases are saved aside and put back on restore, so vectorised
+ * code and TLS accesses start every iteration from the snapshot state.
+ *
+ * The user FPU state is loaded into the registers first, then saved and
+ * restored with XSAVE/XRSTOR directly. XSAVE only writes the components that
+ * are not in their init state, and XRSTOR puts the components missing from
+ * the saved area back to their init state.
+ */
+
+#define XSTATE_ALIGN 64
+
+// Bits of XCR0.
+#define XFEATURE_X87 (1ULL << 0)
+#define XFEATURE_SSE (1ULL << 1)
+#define XFEATURE_PKRU (1ULL << 9)
+
+// Size of the legacy FXSAVE area.
+#define FXSAVE_SIZE 512
+
+// Offsets of MXCSR in the legacy area and of the XSAVE header.
+#define FXSAVE_MXCSR 24
+#define XSAVE_HEADER 512
+#define XSAVE_HEADER_SIZE 64
+
+static unsigned int xstate_size;
+
+static inline u64 read_xcr(u32 index)
+{
+	u32 eax, edx;
+
+	asm volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(index));
+	return eax + ((u64)edx << 32);
+}
+
+static inline void xsave_regs(void *buf, u64 mask)
+{
+	asm volatile("xsave64 (%[buf])"
+		     :
+		     : [buf] "r"(buf), "a"((u32)mask), "d"((u32)(mask >> 32))
+		     : "memory");
+}
+
+static inline void xrstor_regs(void *buf, u64 mask)
+{
+	asm volatile("xrstor64 (%[buf])"
+		     :
+		     : [buf] "r"(buf), "a"((u32)mask), "d"((u32)(mask >> 32))
+		     : "memory");
+}
+
+static inline void fxsave_regs(void *buf)
+{
+	asm volatile("fxsave64 (%[buf])" : : [buf] "r"(buf) : "memory");
+}
+
+static inline void fxrstor_regs(void *buf)
+{
+	asm volatile("fxrstor64 (%[buf])" : : [buf] "r"(buf) : "memory");
+}
+
+// PKRU is switched by the kernel on its own, it is left alone. Called with
+// the fpregs locked.
+static u64 user_xfeatures(void)
+{
+	u64 mask = read_xcr(0) & ~XFEATURE_PKRU;
+#ifdef X86_FEATURE_XFD
+	u64 xfd;
+
+	// Components disarmed through XFD, like AMX tiles that the task has
+	// not asked for, fault on XRSTOR.
+	if (boot_cpu_has(X86_FEATURE_XFD)) {
+		rdmsrl(MSR_IA32_XFD, xfd);
+		mask &= ~xfd;
+	}
+#endif
+
+	return mask;
+}
+
+unsigned int get_xstate_size(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (xstate_size)
+		return xstate_size;
+
+	if (boot_cpu_has(X86_FEATURE_XSAVE)) {
+		// Size of the standard format for the features enabled in XCR0.
+		cpuid_count(0xd, 0, &eax, &ebx, &ecx, &edx);
+		xstate_size = ebx;
+	} else {
+		xstate_size = FXSAVE_SIZE;
+	}
+
+	return xstate_size;
+}
+
+// An area that did not come from XSAVE on this CPU, XRSTOR faults on
+// reserved MXCSR bits, on components not enabled in XCR0 and on a header
+// that is not in the standard format.
+bool check_xstate(const void *xstate)
+{
+	const u32 *mxcsr = xstate + FXSAVE_MXCSR;
+	const u64 *header = xstate + XSAVE_HEADER;
+	int i;
+
+	if (*mxcsr & 0xffff0000)
+		return false;
+
+	if (!boot_cpu_has(X86_FEATURE_XSAVE))
+		return true;
+
+	if (header[0] & ~read_xcr(0))
+		return false;
+
+	for (i = 1; i < 8; i++) {
+		if (header[i])
+			return false;
+	}
+
+	return true;
+}
+
+int alloc_ext_regs(struct snapshot_ext_regs *ext)
+{
+	if (ext->xstate)
+		return 0;
+
+	// XRSTOR expects the reserved bytes of the header to be zero.
+	ext->xstate_buf = kzalloc(get_xstate_size() + XSTATE_ALIGN, GFP_KERNEL);
+	if (!ext->xstate_buf) {
+		FATAL("could not allocate the xstate area");
+		return -ENOMEM;
+	}
+
+	ext->xstate = PTR_ALIGN(ext->xstate_buf, XSTATE_ALIGN);
+	return 0;
+}
+
+int save_ext_regs(struct snapshot_ext_regs *ext)
+{
+	u64 mask;
+	int res;
+
+	rdmsrl(MSR_FS_BASE, ext->fsbase);
+	rdmsrl(MSR_KERNEL_GS_BASE, ext->gsbase);
+
+	if (!boot_cpu_has(X86_FEATURE_FPU))
+		return 0;
+
+	res = alloc_ext_regs(ext);
+	if (res)
+		return res;
+
+	fpregs_lock();
+	if (test_thread_flag(TIF_NEED_FPU_LOAD))
+		switch_fpu_return();
+
+	if (boot_cpu_has(X86_FEATURE_XSAVE)) {
+		mask = user_xfeatures();
+		// Only save the components in use, MXCSR goes with SSE.
+		if (boot_cpu_has(X86_FEATURE_XGETBV1))
+			mask &= read_xcr(1) | XFEATURE_X87 | XFEATURE_SSE;
+
+		// XSAVE leaves the bits of the components outside the mask as
+		// they are, a component saved by an earlier take or rebase
+		// would be restored instead of its init state.
+		memset(ext->xstate + XSAVE_HEADER, 0, XSAVE_HEADER_SIZE);
+		xsave_regs(ext->xstate, mask);
+	} else {
+		fxsave_regs(ext->xstate);
+	}
+
+	fpregs_unlock();
+
+	return 0;
+}
+
+void restore_ext_regs(struct snapshot_ext_regs *ext)
+{
+	preempt_disable();
+	wrmsrl(MSR_FS_BASE, ext->fsbase);
+	current->thread.fsbase = ext->fsbase;
+	wrmsrl(MSR_KERNEL_GS_BASE, ext->gsbase);
+	current->thread.gsbase = ext->gsbase;
+	preempt_enable();
+
+	if (!ext->xstate)
+		return;
+
+	// The live registers are written, they are saved to the task's fpstate
+	// on the next context switch.
+	fpregs_lock();
+	if (test_thread_flag(TIF_NEED_FPU_LOAD))
+		switch_fpu_return();
+
+	if (boot_cpu_has(X86_FEATURE_XSAVE))
+		xrstor_regs(ext->xstate, user_xfeatures());
+	else
+		fxrstor_regs(ext->xstate);
+
+	fpregs_unlock();
+}
+
+void free_ext_regs(struct snapshot_ext_regs *ext)
+{
+	kfree(ext->xstate_buf);
+	ext->xstate_buf = NULL;
+	ext->xstate = NULL;
+}
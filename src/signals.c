@@ -0,0 +1,244 @@
+#include "debug.h"
+#include "linux/sched/signal.h"
+#include "linux/signal.h"
+#include "linux/slab.h"
+#include "linux/time.h"
+#include "linux/time64.h"
+#include "task_data.h"
+#include "snapshot.h"
+
+/*
+ * Signal dispositions, the blocked mask, the pending signals and the interval
+ * timers are saved at snapshot time. Targets seldom touch the dispositions,
+ * the mask or the timers, so on restore they are only written back when a
+ * hook saw them change. A timer armed at snapshot time keeps counting down
+ * on its own, it is rewound on every restore. The pending sets are compared
+ * directly, signals that arrived during the iteration are dropped and the
+ * saved ones queued again.
+ */
+
+#define NR_ITIMERS 3
+
+flush_sigqueue_t flush_sigqueue_ptr;
+do_send_sig_info_t do_send_sig_info_ptr;
+do_getitimer_t do_getitimer_ptr;
+do_setitimer_t do_setitimer_ptr;
+bool signal_state_untracked;
+
+static int save_sigqueue(struct snapshot_signals *sigs,
+			 struct sigpending *pending, bool shared)
+{
+	struct snapshot_sigqueue *ss_q;
+	struct sigqueue *q;
+
+	list_for_each_entry (q, &pending->list, list) {
+		ss_q = kmalloc(sizeof(struct snapshot_sigqueue), GFP_ATOMIC);
+		if (!ss_q) {
+			FATAL("snapshot_sigqueue allocation failed");
+			return -ENOMEM;
+		}
+
+		ss_q->info = q->info;
+		ss_q->shared = shared;
+		list_add_tail(&ss_q->node, &sigs->queue);
+	}
+
+	return 0;
+}
+
+static void save_itimers(struct snapshot_signals *sigs)
+{
+	int which;
+
+	if (!do_getitimer_ptr || !do_setitimer_ptr)
+		return;
+
+	for (which = 0; which < NR_ITIMERS; which++) {
+		if (do_getitimer_ptr(which, &sigs->itimers[which]))
+			WARNF("could not snapshot itimer %d", which);
+		else if (timespec64_to_ns(&sigs->itimers[which].it_value))
+			sigs->itimers_armed = true;
+	}
+}
+
+int take_signals_snapshot(struct task_data *data)
+{
+	struct snapshot_signals *sigs;
+	struct sighand_struct *sighand = current->sighand;
+	int res;
+
+	if (!(data->config & AFL_SNAPSHOT_SIGNALS))
+		return 0;
+
+	sigs = kzalloc(sizeof(struct snapshot_signals), GFP_KERNEL);
+	if (!sigs) {
+		FATAL("snapshot_signals allocation failed");
+		return -ENOMEM;
+	}
+
+	INIT_LIST_HEAD(&sigs->queue);
+	data->ss.signals = sigs;
+
+	spin_lock_irq(&sighand->siglock);
+
+	memcpy(sigs->action, sighand->action, sizeof(sigs->action));
+	sigs->blocked = current->blocked;
+	sigs->pending = current->pending.signal;
+	sigs->shared_pending = current->signal->shared_pending.signal;
+
+	res = save_sigqueue(sigs, &current->pending, false);
+	if (!res)
+		res = save_sigqueue(sigs, &current->signal->shared_pending,
+				    true);
+
+	spin_unlock_irq(&sighand->siglock);
+
+	save_itimers(sigs);
+
+	data->ss.signals_dirty = false;
+
+	return res;
+}
+
+static void restore_sigactions(struct snapshot_signals *sigs)
+{
+	struct sighand_struct *sighand = current->sighand;
+
+	spin_lock_irq(&sighand->siglock);
+	memcpy(sighand->action, sigs->action, sizeof(sigs->action));
+	spin_unlock_irq(&sighand->siglock);
+}
+
+static void restore_itimers(struct snapshot_signals *sigs)
+{
+	int which;
+
+	if (!do_getitimer_ptr || !do_setitimer_ptr)
+		return;
+
+	for (which = 0; which < NR_ITIMERS; which++) {
+		if (do_setitimer_ptr(which, &sigs->itimers[which], NULL))
+			WARNF("could not restore itimer %d", which);
+	}
+}
+
+static bool pending_changed(struct snapshot_signals *sigs)
+{
+	return !sigequalsets(&current->pending.signal, &sigs->pending) ||
+	       !sigequalsets(&current->signal->shared_pending.signal,
+			     &sigs->shared_pending);
+}
+
+static void restore_pending(struct snapshot_signals *sigs)
+{
+	struct sighand_struct *sighand = current->sighand;
+	struct snapshot_sigqueue *ss_q;
+	bool changed;
+
+	if (!flush_sigqueue_ptr || !do_send_sig_info_ptr)
+		return;
+
+	spin_lock_irq(&sighand->siglock);
+
+	// A pending SIGKILL or group exit is never dropped.
+	changed = pending_changed(sigs) && !fatal_signal_pending(current) &&
+		  !(current->signal->flags & SIGNAL_GROUP_EXIT);
+	if (changed) {
+		flush_sigqueue_ptr(&current->pending);
+		flush_sigqueue_ptr(&current->signal->shared_pending);
+	}
+
+	spin_unlock_irq(&sighand->siglock);
+
+	if (!changed)
+		return;
+
+	DBG_PRINT("restoring pending signals\n");
+
+	list_for_each_entry (ss_q, &sigs->queue, node) {
+		do_send_sig_info_ptr(ss_q->info.si_signo, &ss_q->info, current,
+				     ss_q->shared ? PIDTYPE_TGID : PIDTYPE_PID);
+	}
+}
+
+int recover_signals_snapshot(struct task_data *data)
+{
+	struct snapshot_signals *sigs = data->ss.signals;
+	bool dirty;
+
+	if (!sigs)
+		return 0;
+
+	// Without the hooks a change cannot be seen, the state is always
+	// written back.
+	dirty = data->ss.signals_dirty || signal_state_untracked;
+
+	// The dispositions go first, they decide whether a signal is queued.
+	if (dirty) {
+		DBG_PRINT("restoring signal dispositions and mask\n");
+
+		restore_sigactions(sigs);
+		set_current_blocked(&sigs->blocked);
+	}
+
+	if (dirty || sigs->itimers_armed)
+		restore_itimers(sigs);
+
+	restore_pending(sigs);
+
+	data->ss.signals_dirty = false;
+
+	return 0;
+}
+
+void clean_signals_snapshot(struct task_data *data)
+{
+	struct snapshot_signals *sigs = data->ss.signals;
+	struct snapshot_sigqueue *ss_q, *next;
+
+	if (!sigs)
+		return;
+
+	list_for_each_entry_safe (ss_q, next, &sigs->queue, node) {
+		list_del(&ss_q->node);
+		kfree(ss_q);
+	}
+
+	kfree(sigs);
+	data->ss.signals = NULL;
+}
+
+static struct task_data *get_signals_task_data(void)
+{
+	struct task_data *data = NULL;
+
+	if (!current->mm)
+		return NULL;
+
+	data = get_task_data_by_mm(current->mm);
+	if (!data || !have_snapshot(data) || !data->ss.signals)
+		return NULL;
+
+	return data;
+}
+
+// sigaction(), setitimer() and alarm().
+void signal_state_hook(unsigned long ip, unsigned long parent_ip,
+		       struct ftrace_ops *op, ftrace_regs_ptr regs)
+{
+	struct task_data *data = get_signals_task_data();
+
+	if (data)
+		data->ss.signals_dirty = true;
+}
+
+// Only the mask of the snapshotting thread is restored, the other threads
+// have their own.
+void set_current_blocked_hook(unsigned long ip, unsigned long parent_ip,
+			      struct ftrace_ops *op, ftrace_regs_ptr regs)
+{
+	struct task_data *data = get_signals_task_data();
+
+	if (data && data->tsk == current)
+		data->ss.signals_dirty = true;
+}
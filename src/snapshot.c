@@ -1,5 +1,6 @@
 #include "hook.h"
 #include "debug.h"
+#include "linux/timekeeping.h"
 #include "task_data.h"
 #include "snapshot.h"
 
@@ -28,7 +29,15 @@ static void initialize_snapshot(struct task_data *data, int config) {
 
   struct pt_regs *regs = task_pt_regs(current);
 
+  if ((config & AFL_SNAPSHOT_CRASH) && !can_intercept_crashes()) {
+
+    WARNF("crashes cannot be intercepted, AFL_SNAPSHOT_CRASH ignored");
+    config &= ~AFL_SNAPSHOT_CRASH;
+
+  }
+
   data->config = config;
+  memset(&data->ss.crash, 0, sizeof(data->ss.crash));
 
   set_had_snapshot(data);
 
@@ -36,6 +45,11 @@ static void initialize_snapshot(struct task_data *data, int config) {
 
   // copy current regs context
   data->ss.regs = *regs;
+  if ((config & AFL_SNAPSHOT_REGS) && save_ext_regs(&data->ss.ext_regs)) {
+
+    pr_err("error while snapshotting extended registers");
+
+  }
 
   // copy current brk
   data->ss.oldbrk = current->mm->brk;
@@ -49,10 +63,38 @@ int take_snapshot(int config) {
   if (!have_snapshot(data)) {  // first execution
 
     initialize_snapshot(data, config);
-    take_memory_snapshot(data);
+    // The other threads stay parked while the snapshot is taken.
+    if (take_threads_snapshot(data)) {
+      pr_err("error while snapshotting threads");
+    }
+    if ((config & AFL_SNAPSHOT_SWAP) && take_swap_snapshot(data)) {
+      pr_err("falling back to restoring the memory page by page");
+      data->config &= ~AFL_SNAPSHOT_SWAP;
+    }
+    if (!(data->config & AFL_SNAPSHOT_SWAP)) {
+      take_memory_snapshot(data);
+    }
     if (take_files_snapshot(data)) {
       pr_err("error while snapshotting files");
     }
+    if (take_pipes_snapshot(data)) {
+      pr_err("error while snapshotting pipes");
+    }
+    if (take_events_snapshot(data)) {
+      pr_err("error while snapshotting event objects");
+    }
+    if (take_sockets_snapshot(data)) {
+      pr_err("error while snapshotting sockets");
+    }
+    if (take_children_snapshot(data)) {
+      pr_err("error while snapshotting child processes");
+    }
+    if (take_signals_snapshot(data)) {
+      pr_err("error while snapshotting signals");
+    }
+
+    release_threads_snapshot(data);
+    reset_iteration_budget(data);
 
 #ifdef DEBUG
     dump_memory_snapshot(data);
@@ -66,33 +108,196 @@ int take_snapshot(int config) {
 
 }
 
+// Make the current state the snapshot, the memory pages left untouched since
+// the last restore are kept as they are.
+int rebase_snapshot(void) {
+
+  struct task_data *data = get_task_data(current);
+
+  if (!data || !have_snapshot(data)) {
+
+    pr_err("no snapshot to rebase");
+    return -EINVAL;
+
+  }
+
+  if (data->ss.depth || !list_empty(&data->ss.shadow_vmas) ||
+      (data->config & AFL_SNAPSHOT_SWAP)) {
+
+    pr_err("cannot rebase a snapshot with levels, shadow mappings or swap");
+    return -EOPNOTSUPP;
+
+  }
+
+  clean_threads_snapshot(data);
+  if (take_threads_snapshot(data)) {
+    pr_err("error while snapshotting threads");
+  }
+
+  data->ss.regs = *task_pt_regs(current);
+  if ((data->config & AFL_SNAPSHOT_REGS) &&
+      save_ext_regs(&data->ss.ext_regs)) {
+    pr_err("error while snapshotting extended registers");
+  }
+  data->ss.oldbrk = current->mm->brk;
+
+  if (rebase_memory_snapshot(data)) {
+    pr_err("error while rebasing memory");
+  }
+
+  // The other parts are cheap to take again.
+  clean_files_snapshot(data);
+  if (take_files_snapshot(data)) {
+    pr_err("error while snapshotting files");
+  }
+  clean_pipes_snapshot(data);
+  if (take_pipes_snapshot(data)) {
+    pr_err("error while snapshotting pipes");
+  }
+  clean_events_snapshot(data);
+  if (take_events_snapshot(data)) {
+    pr_err("error while snapshotting event objects");
+  }
+  clean_sockets_snapshot(data);
+  if (take_sockets_snapshot(data)) {
+    pr_err("error while snapshotting sockets");
+  }
+  clean_children_snapshot(data);
+  if (take_children_snapshot(data)) {
+    pr_err("error while snapshotting child processes");
+  }
+  clean_signals_snapshot(data);
+  if (take_signals_snapshot(data)) {
+    pr_err("error while snapshotting signals");
+  }
+  // The files written so far keep their current content.
+  clean_filedata_snapshot(data);
+
+  release_threads_snapshot(data);
+  reset_iteration_budget(data);
+
+  return 1;
+
+}
+
 static void recover_state(struct task_data *data)
 {
+	struct snapshot_level *level = top_snapshot_level(&data->ss);
+
 	if (data->config & AFL_SNAPSHOT_REGS) {
 		struct pt_regs *regs = task_pt_regs(current);
 
 		// restore regs context
-		*regs = data->ss.regs;
+		*regs = level ? level->regs : data->ss.regs;
+		restore_ext_regs(level ? &level->ext_regs : &data->ss.ext_regs);
 	}
 
 	// restore brk
-	if (restore_brk(data->ss.oldbrk)) {
+	if (restore_brk(level ? level->oldbrk : data->ss.oldbrk)) {
 		pr_err("could not restore program break");
 	}
 }
 
 static void restore_snapshot(struct task_data *data) {
 
+  u64 start;
+
 #ifdef DEBUG
   dump_memory_snapshot(data);
 #endif
 
   recover_threads_snapshot(data);
+  start = ktime_get_ns();
+  // The clone already has the program break of the snapshot.
+  if ((data->config & AFL_SNAPSHOT_SWAP) && recover_swap_snapshot(data)) {
+    pr_err("error while swapping the address space");
+  }
   recover_state(data);
-  recover_memory_snapshot(data);
+  if (!(data->config & AFL_SNAPSHOT_SWAP)) {
+    recover_memory_snapshot(data);
+  }
+  account_restore(data, ktime_get_ns() - start);
+  select_restore_strategy(data);
+  // New sockets are reset before the fd table restore closes them.
+  if (recover_sockets_snapshot(data)) {
+    pr_err("error while restoring sockets");
+  }
   if (recover_files_snapshot(data)) {
     pr_err("error while snapshotting files");
   }
+  if (recover_pipes_snapshot(data)) {
+    pr_err("error while restoring pipes");
+  }
+  if (recover_events_snapshot(data)) {
+    pr_err("error while restoring event objects");
+  }
+  if (recover_filedata_snapshot(data)) {
+    pr_err("error while restoring file contents");
+  }
+  // Before the signals, the SIGCHLDs of the killed children are dropped.
+  if (recover_children_snapshot(data)) {
+    pr_err("error while reaping child processes");
+  }
+  if (recover_signals_snapshot(data)) {
+    pr_err("error while restoring signals");
+  }
+  release_threads_snapshot(data);
+  reset_iteration_budget(data);
+}
+
+/*
+ * Called by a process just forked from the snapshotting one. Its memory,
+ * registers and program break are brought back to the snapshot of the parent
+ * and it takes its own snapshot with the same options, so a single slow
+ * initialisation serves many workers. The other state is inherited from the
+ * parent as it is at fork time. The parent waits on notify_fd, which is closed
+ * once its snapshot is not read anymore.
+ */
+int fork_snapshot(int notify_fd)
+{
+	struct task_data *parent_data = NULL;
+	struct task_struct *parent;
+	int config, res = 0;
+
+	rcu_read_lock();
+	parent = rcu_dereference(current->real_parent);
+	if (parent->mm)
+		parent_data = get_task_data_by_mm(parent->mm);
+	rcu_read_unlock();
+
+	if (get_task_data(current) || !parent_data ||
+	    !have_snapshot(parent_data)) {
+		pr_err("no snapshot to fork from");
+		res = -EINVAL;
+		goto out;
+	}
+
+	if (!list_empty(&parent_data->ss.shadow_vmas) ||
+	    (parent_data->config & AFL_SNAPSHOT_SWAP)) {
+		pr_err("cannot fork a snapshot with shadow mappings or swap");
+		res = -EOPNOTSUPP;
+		goto out;
+	}
+
+	recover_state(parent_data);
+	res = fork_memory_snapshot(parent_data);
+	if (res) {
+		pr_err("error while restoring the forked memory");
+		goto out;
+	}
+
+	if (record_snapshot_child(parent_data, current))
+		pr_err("error while recording the forked process");
+
+	// Not part of the new snapshot.
+	config = parent_data->config;
+	close_fd(notify_fd);
+
+	return take_snapshot(config);
+
+out:
+	close_fd(notify_fd);
+	return res;
 }
 
 int recover_snapshot(void)
@@ -108,6 +313,196 @@ int recover_snapshot(void)
 	return 0;
 }
 
+/*
+ * The module restores on its own when an iteration goes wrong. The restore
+ * runs from a task work of the snapshotting thread, on its way back to user
+ * mode where it holds no lock, and the snapshot point returns the status
+ * instead of 0. The work only holds the iteration it was queued for, the task
+ * data may be gone or the iteration over by the time it runs.
+ */
+struct forced_restore {
+	struct callback_head work;
+	u64 epoch;
+	int status;
+};
+
+static void forced_restore_work(struct callback_head *work)
+{
+	struct forced_restore *fr =
+		container_of(work, struct forced_restore, work);
+	struct task_data *data = get_task_data(current);
+	struct pt_regs *regs = task_pt_regs(current);
+
+	if (data && have_snapshot(data) &&
+	    data->ss.iteration_epoch == fr->epoch) {
+		DBG_PRINT("forced restore, status %d\n", fr->status);
+
+		restore_snapshot(data);
+		regs->ax = fr->status;
+		// Not a syscall to restart anymore.
+		regs->orig_ax = -1;
+	}
+
+	if (data)
+		atomic_set(&data->ss.forced_restore, 0);
+	kfree(fr);
+}
+
+// 0 when a restore is on its way, queued now or before.
+int force_restore_snapshot(struct task_data *data, int status)
+{
+	struct forced_restore *fr;
+
+	// The status is returned through the registers.
+	if (!(data->config & AFL_SNAPSHOT_REGS))
+		return -EINVAL;
+
+	if (atomic_cmpxchg(&data->ss.forced_restore, 0, 1))
+		return 0;
+
+	// Called from the fault paths.
+	fr = kmalloc(sizeof(struct forced_restore), GFP_ATOMIC);
+	if (!fr)
+		goto err;
+
+	fr->epoch = READ_ONCE(data->ss.iteration_epoch);
+	fr->status = status;
+	init_task_work(&fr->work, forced_restore_work);
+
+	if (task_work_add((struct task_struct *)data->tsk, &fr->work,
+			  TWA_SIGNAL)) {
+		kfree(fr);
+		goto err;
+	}
+
+	return 0;
+
+err:
+	atomic_set(&data->ss.forced_restore, 0);
+	return -ENOMEM;
+}
+
+/*
+ * Levels only hold the memory, the registers and the program break. The
+ * state saved by these options is kept once for the base snapshot, so
+ * pushing a level on top of them is refused.
+ */
+#define SNAPSHOT_LEVEL_UNSUPPORTED                                           \
+	(AFL_SNAPSHOT_FDS | AFL_SNAPSHOT_SHADOW | AFL_SNAPSHOT_FILEDATA |    \
+	 AFL_SNAPSHOT_THREADS | AFL_SNAPSHOT_SIGNALS |                       \
+	 AFL_SNAPSHOT_CHILDREN | AFL_SNAPSHOT_SWAP | AFL_SNAPSHOT_STREAMS)
+
+static void free_snapshot_level(struct snapshot_level *level)
+{
+	free_ext_regs(&level->ext_regs);
+	kfree(level);
+}
+
+int push_snapshot(void)
+{
+	struct task_data *data = get_task_data(current);
+	struct snapshot_level *level;
+	int res;
+
+	if (!data || !have_snapshot(data)) {
+		pr_err("no snapshot to push a level on");
+		return -EINVAL;
+	}
+
+	if ((data->config & SNAPSHOT_LEVEL_UNSUPPORTED) ||
+	    !list_empty(&data->ss.shadow_vmas)) {
+		pr_err("snapshot levels only support memory and registers");
+		return -EOPNOTSUPP;
+	}
+
+	level = kzalloc(sizeof(struct snapshot_level), GFP_KERNEL);
+	if (!level) {
+		FATAL("snapshot_level allocation failed");
+		return -ENOMEM;
+	}
+
+	level->depth = data->ss.depth + 1;
+	INIT_LIST_HEAD(&level->vmas);
+	INIT_LIST_HEAD(&level->tracked_vmas);
+	INIT_LIST_HEAD(&level->prot_changes);
+	xa_init(&level->pages);
+
+	level->regs = *task_pt_regs(current);
+	if ((data->config & AFL_SNAPSHOT_REGS) &&
+	    save_ext_regs(&level->ext_regs))
+		pr_err("error while snapshotting extended registers");
+	level->oldbrk = current->mm->brk;
+
+	res = push_memory_level(data, level);
+	if (res) {
+		free_memory_level(level);
+		free_snapshot_level(level);
+		return res;
+	}
+
+	list_add(&level->node, &data->ss.levels);
+	data->ss.depth = level->depth;
+
+	DBG_PRINT("pushed snapshot level %u\n", level->depth);
+
+	return 1;
+}
+
+static void pop_level(struct task_data *data)
+{
+	struct snapshot_level *level = top_snapshot_level(&data->ss);
+
+	list_del(&level->node);
+	data->ss.depth--;
+
+	DBG_PRINT("popping snapshot level %u\n", level->depth);
+
+	pop_memory_level(data, level);
+	free_snapshot_level(level);
+}
+
+int pop_snapshot(void)
+{
+	struct task_data *data = get_task_data(current);
+
+	if (!data || !data->ss.depth)
+		return -EINVAL;
+
+	pop_level(data);
+
+	return 0;
+}
+
+int recover_snapshot_level(unsigned int depth)
+{
+	struct task_data *data = get_task_data(current);
+
+	if (!data || !have_snapshot(data) || depth > data->ss.depth) {
+		pr_err("no snapshot level %u to restore", depth);
+		return -EINVAL;
+	}
+
+	while (data->ss.depth > depth)
+		pop_level(data);
+
+	restore_snapshot(data);
+
+	return 0;
+}
+
+static void clean_snapshot_levels(struct task_data *data)
+{
+	struct snapshot_level *level, *n;
+
+	list_for_each_entry_safe (level, n, &data->ss.levels, node) {
+		list_del(&level->node);
+		free_memory_level(level);
+		free_snapshot_level(level);
+	}
+
+	data->ss.depth = 0;
+}
+
 int exit_snapshot(void)
 {
 	struct task_data *data = get_task_data(current);
@@ -147,7 +542,18 @@ void clean_snapshot(void)
 	DBG_PRINT("cleaning snapshot\n");
 
 	clean_memory_snapshot(data);
+	clean_iteration_budget(data);
+	clean_snapshot_levels(data);
+	clean_swap_snapshot(data);
 	clean_files_snapshot(data);
+	clean_filedata_snapshot(data);
+	clean_pipes_snapshot(data);
+	clean_events_snapshot(data);
+	clean_sockets_snapshot(data);
+	clean_threads_snapshot(data);
+	clean_signals_snapshot(data);
+	clean_children_snapshot(data);
+	free_ext_regs(&data->ss.ext_regs);
 	clear_snapshot(data);
 
 	remove_task_data(data);
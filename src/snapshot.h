@@ -11,12 +11,22 @@
 #include <linux/list.h>
 #include <linux/page-flags-layout.h>
 #include <linux/rbtree.h>
+#include <linux/refcount.h>
 #include <linux/rwsem.h>
 #include <linux/spinlock.h>
 #include <linux/threads.h>
 #include <linux/types.h>
 #include <linux/uprobes.h>
+#include <linux/wait.h>
 #include <linux/workqueue.h>
+#include <linux/xarray.h>
+#include <linux/eventpoll.h>
+#include <linux/time64.h>
+#include <linux/sched/signal.h>
+#include <linux/llist.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/task_work.h>
 #include <linux/acct.h>
 #include <linux/aio.h>
 #include <linux/audit.h>
@@ -110,37 +120,57 @@ struct snapshot_vma {
 	unsigned long vm_end;
 
 	bool is_anonymous_private;
+	bool is_shadow;
 	unsigned long prot;
 
+	// Pages below this address are not tracked, only the stack sets it
+	// above vm_start.
+	unsigned long track_start;
+
 	struct list_head all_vmas_node;
 	struct list_head snapshotted_vmas_node;
+	struct list_head shadow_vmas_node;
 };
 
-struct snapshot_thread {
+struct snapshot_prot_range {
+	unsigned long start;
+	unsigned long end;
+
+	struct list_head node;
+};
+
+// Bits of snapshot_page.flags, threads faulting in parallel update them
+// with atomic bitops.
+enum snapshot_page_flag {
 
-  struct task_struct *tsk;
+  SNAPSHOT_PAGE_COPIED,        // page_data holds the content at snapshot time
+  SNAPSHOT_PAGE_HAD_PTE,
+  SNAPSHOT_PAGE_DIRTY,
+  SNAPSHOT_PAGE_IN_DIRTY_LOG,
 
 };
 
+struct pristine_page;
+struct snapshot_swap;
+
 struct snapshot_page {
 
-  unsigned long page_base;
-  unsigned long page_prot;
-  void *        page_data;
+  unsigned long         page_base;
+  unsigned long         page_prot;
+  void *                page_data;
+  struct pristine_page *pristine;  // set when page_data is shared
 
-  bool has_been_copied;
-  bool has_had_pte;
-  bool dirty;
-  bool in_dirty_list;
+  unsigned long flags;
 
   struct hlist_node next;
 
-  struct list_head dirty_list;
+  struct llist_node dirty_node;
 
 };
 
 #define SNAPSHOT_PRIVATE 0x00000001
 #define SNAPSHOT_COW 0x00000002
+#define SNAPSHOT_SHARED 0x00000004
 #define SNAPSHOT_NONE_PTE 0x00000010
 
 static inline bool is_snapshot_page_none_pte(struct snapshot_page *sp) {
@@ -161,6 +191,12 @@ static inline bool is_snapshot_page_private(struct snapshot_page *sp) {
 
 }
 
+static inline bool is_snapshot_page_shared(struct snapshot_page *sp) {
+
+  return sp->page_prot & SNAPSHOT_SHARED;
+
+}
+
 static inline void set_snapshot_page_none_pte(struct snapshot_page *sp) {
 
   sp->page_prot |= SNAPSHOT_NONE_PTE;
@@ -179,31 +215,264 @@ static inline void set_snapshot_page_cow(struct snapshot_page *sp) {
 
 }
 
+static inline void set_snapshot_page_shared(struct snapshot_page *sp) {
+
+  sp->page_prot |= SNAPSHOT_SHARED;
+
+}
+
 struct open_files_snapshot {
 	struct files_struct *files;
 	loff_t *offsets;
+
+	// Descriptors installed, closed or replaced since the last restore.
+	unsigned int max_fds;
+	unsigned long __rcu *touched;
+	bool touched_high; // some fd >= max_fds was installed
+};
+
+// Only the snapshotting thread replaces the bitmap, the hooks of the other
+// threads read it under rcu_read_lock().
+static inline unsigned long *
+get_touched_fds(struct open_files_snapshot *files_snap)
+{
+	return rcu_dereference_raw(files_snap->touched);
+}
+
+// Set when the close hooks are missing, every descriptor is then compared
+// with the snapshot on restore.
+extern bool fd_close_untracked;
+
+// A regular file written or truncated since the last restore.
+struct snapshot_file {
+	struct file *backing; // private handle used to read and write back
+	loff_t size;          // size before the first change
+	struct xarray pages;  // page index -> original content
+	struct list_head node;
+};
+
+// Data queued in a pipe or unix stream socket at snapshot time.
+struct snapshot_stream {
+	struct file *file;
+	void *data;
+	size_t len;
+	struct list_head node;
+};
+
+// User register state that pt_regs does not hold.
+struct snapshot_ext_regs {
+	unsigned long fsbase;
+	unsigned long gsbase;
+	void *xstate;      // XSAVE area, FXSAVE without XSAVE support
+	void *xstate_buf;  // allocation holding the aligned xstate
+};
+
+// A signal that was pending at snapshot time.
+struct snapshot_sigqueue {
+	kernel_siginfo_t info;
+	bool shared;  // pending for the whole process
+	struct list_head node;
+};
+
+struct snapshot_signals {
+	struct k_sigaction action[_NSIG];
+	sigset_t blocked;
+	sigset_t pending;
+	sigset_t shared_pending;
+	struct list_head queue;
+	struct itimerspec64 itimers[3];  // ITIMER_REAL, VIRTUAL and PROF
+	bool itimers_armed;
+};
+
+// A process descending from the target at snapshot time.
+struct snapshot_child {
+	struct pid *pid;
+	struct task_struct *task; // only held for the processes being killed
+	struct list_head node;
+};
+
+enum snapshot_thread_action {
+	SNAPSHOT_THREAD_SAVE,   // save the context when parked
+	SNAPSHOT_THREAD_REWIND, // rewind to the saved context when released
+	SNAPSHOT_THREAD_EXIT,   // created during the iteration, exit
+	SNAPSHOT_THREAD_GONE,   // exited on its own, cannot be parked
+};
+
+// Parked threads wait for the generation to move past the one they were
+// parked in. A completion would have to be reinitialised for the next park
+// while waiters of the previous one may not have woken up yet.
+struct snapshot_release {
+	wait_queue_head_t wq;
+	u64 gen;
+};
+
+// Another thread of the snapshotted process.
+struct snapshot_thread {
+	struct task_struct *tsk;
+	enum snapshot_thread_action action;
+
+	struct callback_head work;
+	struct completion parked;
+	struct snapshot_release *release;
+	u64 release_gen;
+	refcount_t refs; // the list and, for a new thread, the thread itself
+
+	struct pt_regs regs;
+	struct snapshot_ext_regs ext_regs;
+	sigset_t blocked;
+
+	struct list_head node;
+};
+
+// A nested snapshot pushed on top of the base snapshot or of another level.
+// Only the pages that changed since the level below are saved.
+struct snapshot_level {
+	unsigned int depth; // 1 for the first level above the base snapshot
+
+	struct pt_regs regs;
+	struct snapshot_ext_regs ext_regs;
+	unsigned long oldbrk;
+	unsigned long stack_start; // of the level below
+
+	struct list_head vmas;         // layout at push time
+	struct list_head tracked_vmas; // ranges tracked from this level on
+	struct list_head prot_changes; // made under the level below
+	struct xarray pages;           // page index -> content at push time
+
+	struct list_head node;
+};
+
+// A listening or datagram socket whose queue is dropped on restore.
+struct snapshot_socket {
+	struct file *file;
+	struct list_head node;
+};
+
+enum snapshot_event_type {
+	SNAPSHOT_NOT_EVENT,
+	SNAPSHOT_EVENTFD,
+	SNAPSHOT_TIMERFD,
+	SNAPSHOT_SIGNALFD,
+	SNAPSHOT_EPOLL,
+};
+
+// An epoll interest as listed in the fdinfo of the epoll file.
+struct snapshot_epoll_item {
+	int tfd;
+	unsigned long ino;
+	unsigned int events;
+	unsigned long long data;
+};
+
+// State of an eventfd, timerfd, signalfd or epoll at snapshot time.
+struct snapshot_event_file {
+	struct file *file;
+	unsigned int fd;
+	enum snapshot_event_type type;
+
+	u64 count;                 // eventfd
+	struct itimerspec64 timer; // timerfd, relative to the snapshot
+	sigset_t sigmask;          // signalfd
+
+	struct snapshot_epoll_item *items; // epoll
+	unsigned int nr_items;
+
+	struct list_head node;
 };
 
 #define SNAPSHOT_HASHTABLE_SZ 0x8
 
+// Anonymous NORESERVE mappings at least this big are treated as sanitizer
+// shadow when AFL_SNAPSHOT_SHADOW is set.
+#define SNAPSHOT_SHADOW_MIN_SIZE (1UL << 28)
+// Pages covered by one leaf of the touched shadow bitmap.
+#define SNAPSHOT_SHADOW_LEAF_PAGES (PAGE_SIZE * BITS_PER_BYTE)
+
+// Costs measured on every restore, AFL_SNAPSHOT_AUTO picks the memory
+// restore strategy from them.
+struct snapshot_stats {
+
+  u64          iterations;
+  u64          dirty_pages;
+  u64          restore_ns;
+  u64          prepare_ns;  // background clone preparation of the last swap
+  u64          cost_ns[2];  // moving average per strategy, 0 if unmeasured
+  unsigned int measured;    // iterations since the last switch
+  unsigned int switches;
+  bool         no_swap;     // the swap was refused for this target
+
+};
+
 struct snapshot {
 
   unsigned int  status;
   unsigned long oldbrk;
+  unsigned long stack_start;  // lowest tracked stack address, 0 if none
+  atomic_long_t saved_bytes;  // memory held by snapshot_page and page_data
 
   struct list_head all_vmas;
   struct list_head snapshotted_vmas;
+  struct list_head shadow_vmas;
+
+  struct pt_regs           regs;
+  struct snapshot_ext_regs ext_regs;
+
+  struct list_head levels;  // nested snapshots, the top one first
+  unsigned int     depth;   // number of levels, 0 for the base snapshot
+
+  struct snapshot_swap *swap;  // AFL_SNAPSHOT_SWAP only
+  struct snapshot_stats stats;
+
+  struct afl_snapshot_limits limits;
+  atomic_long_t iteration_pages;  // dirtied since the last restore
+  long          iteration_bytes;  // saved_bytes at the last restore
+  u64           iteration_epoch;  // bumped on every take and restore
+  atomic_t      forced_restore;   // a forced restore is queued
+  struct hrtimer iteration_timer;
 
-  struct pt_regs regs;
+  struct afl_snapshot_crash_report crash;  // the last crash intercepted
+
+  struct snapshot_signals *signals;
+  bool                     signals_dirty;
+
+  struct list_head children;
+
+  struct list_head        threads;
+  struct list_head        new_threads;  // created during the iteration
+  struct snapshot_release threads_release;
 
   struct open_files_snapshot ss_files;
+  struct list_head          streams;
+  struct list_head          event_files;
+  struct list_head          sockets;
+  bool                      epoll_dirty;
 
   DECLARE_HASHTABLE(ss_pages, SNAPSHOT_HASHTABLE_SZ);
+  spinlock_t ss_pages_lock;  // serializes the inserts, lookups use RCU
+
+  // Pages dirtied during the iteration, logged on the CPU that took the
+  // fault and merged on restore.
+  struct llist_head __percpu *dirty_logs;
+
+  struct list_head prot_changes;
 
-  struct list_head dirty_pages;
+  struct xarray shadow_touched;
+
+  struct list_head dirty_files;
+  struct mutex     dirty_files_lock;  // the threads write files concurrently
+  bool             restoring_files;
 
 };
 
+// The System V x86-64 ABI lets leaf functions use 128 bytes below sp.
+#define SNAPSHOT_STACK_REDZONE 128
+
+static inline struct snapshot_level *top_snapshot_level(struct snapshot *ss) {
+
+  return list_first_entry_or_null(&ss->levels, struct snapshot_level, node);
+
+}
+
 #define SNAPSHOT_NONE 0x00000000  // outside snapshot
 #define SNAPSHOT_MADE 0x00000001  // in snapshot
 #define SNAPSHOT_HAD 0x00000002   // once had snapshot
@@ -216,6 +485,11 @@ extern void (*k_flush_tlb_mm_range)(struct mm_struct *mm, unsigned long start,
 extern void (*k_zap_page_range)(struct vm_area_struct *vma, unsigned long start,
                                 unsigned long size);
 
+/* close_fd() replaced __close_fd() in 5.11.0 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 11, 0)
+#define close_fd(fd) __close_fd(current->files, fd)
+#endif
+
 /* The signature of dup_fd was changed in 5.9.0 */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
 typedef struct files_struct *(*dup_fd_t)(struct files_struct *oldf,
@@ -243,20 +517,180 @@ typedef int (*walk_page_range_t)(struct mm_struct *mm, unsigned long start,
 extern walk_page_range_t walk_page_range_ptr;
 #define walk_page_range walk_page_range_ptr
 
+typedef int (*replace_fd_t)(unsigned fd, struct file *file, unsigned flags);
+extern replace_fd_t replace_fd_ptr;
+#define replace_fd replace_fd_ptr
+
+// Optional, event objects whose helpers are missing are not restored.
+typedef int (*do_epoll_ctl_t)(int epfd, int op, int fd,
+			      struct epoll_event *epds, bool nonblock);
+extern do_epoll_ctl_t do_epoll_ctl_ptr;
+extern bool epoll_ctl_hooked;
+typedef int (*do_timerfd_gettime_t)(int ufd, struct itimerspec64 *t);
+extern do_timerfd_gettime_t do_timerfd_gettime_ptr;
+typedef int (*do_timerfd_settime_t)(int ufd, int flags,
+				    const struct itimerspec64 *new,
+				    struct itimerspec64 *old);
+extern do_timerfd_settime_t do_timerfd_settime_ptr;
+
+// Optional, the pending signals and itimers are not restored without them.
+typedef void (*flush_sigqueue_t)(struct sigpending *queue);
+extern flush_sigqueue_t flush_sigqueue_ptr;
+typedef int (*do_send_sig_info_t)(int sig, struct kernel_siginfo *info,
+				  struct task_struct *p, enum pid_type type);
+extern do_send_sig_info_t do_send_sig_info_ptr;
+typedef int (*do_getitimer_t)(int which, struct itimerspec64 *value);
+extern do_getitimer_t do_getitimer_ptr;
+typedef int (*do_setitimer_t)(int which, struct itimerspec64 *value,
+			      struct itimerspec64 *ovalue);
+extern do_setitimer_t do_setitimer_ptr;
+// Set when the hooks that see the dispositions, the mask or the timers change
+// are missing.
+extern bool signal_state_untracked;
+
+typedef int (*proc_visitor_t)(struct task_struct *p, void *data);
+typedef void (*walk_process_tree_t)(struct task_struct *top,
+				    proc_visitor_t visitor, void *data);
+extern walk_process_tree_t walk_process_tree_ptr;
+typedef long (*kernel_wait4_t)(pid_t upid, int __user *stat_addr,
+			       int options, struct rusage *ru);
+extern kernel_wait4_t kernel_wait4_ptr;
+
+typedef int (*task_work_add_t)(struct task_struct *task,
+			       struct callback_head *twork,
+			       enum task_work_notify_mode mode);
+extern task_work_add_t task_work_add_ptr;
+#define task_work_add task_work_add_ptr
+
+typedef void (*set_current_blocked_t)(sigset_t *newset);
+extern set_current_blocked_t set_current_blocked_ptr;
+#define set_current_blocked set_current_blocked_ptr
+
+typedef int (*mprotect_fixup_t)(struct vm_area_struct *vma,
+				struct vm_area_struct **pprev,
+				unsigned long start, unsigned long end,
+				unsigned long newflags);
+extern mprotect_fixup_t mprotect_fixup_ptr;
+#define mprotect_fixup mprotect_fixup_ptr
+
+void invalidate_task_data_cache(const struct mm_struct *mm);
 int take_memory_snapshot(struct task_data *data);
 int recover_memory_snapshot(struct task_data *data);
 int restore_brk(unsigned long old_brk);
 void clean_memory_snapshot(struct task_data *data);
+int push_memory_level(struct task_data *data, struct snapshot_level *level);
+void pop_memory_level(struct task_data *data, struct snapshot_level *level);
+void free_memory_level(struct snapshot_level *level);
+int rebase_memory_snapshot(struct task_data *data);
+int fork_memory_snapshot(struct task_data *parent);
+struct list_head *snapshot_layout(struct task_data *data);
+bool read_snapshot_page(struct task_data *data, unsigned long page_base,
+			void *buf);
+int  snapshot_teardown_init(void);
+void snapshot_teardown_exit(void);
 
 #ifdef DEBUG
 void dump_memory_snapshot(struct task_data *data);
 #endif
 
+void share_page_data(struct snapshot_page *sp);
+void release_page_data(struct snapshot_page *sp);
+
+typedef struct mm_struct *(*dup_mm_t)(struct task_struct *tsk,
+				     struct mm_struct *oldmm);
+extern dup_mm_t dup_mm_ptr;
+typedef void (*switch_mm_irqs_off_t)(struct mm_struct *prev,
+				     struct mm_struct *next,
+				     struct task_struct *tsk);
+extern switch_mm_irqs_off_t switch_mm_irqs_off_ptr;
+typedef void (*sync_mm_rss_t)(struct mm_struct *mm);
+extern sync_mm_rss_t sync_mm_rss_ptr;
+
+int take_swap_snapshot(struct task_data *data);
+int recover_swap_snapshot(struct task_data *data);
+void clean_swap_snapshot(struct task_data *data);
+
+int  set_snapshot_limits(struct afl_snapshot_limits __user *arg);
+void init_iteration_budget(struct task_data *data);
+void reset_iteration_budget(struct task_data *data);
+int  start_iteration_timer(void);
+void clean_iteration_budget(struct task_data *data);
+void charge_dirty_page(struct task_data *data);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+typedef int (*dequeue_signal_t)(struct task_struct *task, sigset_t *mask,
+				kernel_siginfo_t *info, enum pid_type *type);
+#else
+typedef int (*dequeue_signal_t)(struct task_struct *task, sigset_t *mask,
+				kernel_siginfo_t *info);
+#endif
+extern dequeue_signal_t dequeue_signal_ptr;
+
+extern bool get_signal_hooked;
+
+void get_signal_hook(unsigned long ip, unsigned long parent_ip,
+		     struct ftrace_ops *op, ftrace_regs_ptr regs);
+bool can_intercept_crashes(void);
+int  get_crash_report(struct afl_snapshot_crash_report __user *arg);
+
+void account_restore(struct task_data *data, u64 ns);
+void select_restore_strategy(struct task_data *data);
+int  get_snapshot_stats(struct afl_snapshot_stats __user *arg);
+
 int take_files_snapshot(struct task_data *data);
 int recover_files_snapshot(struct task_data *data);
 void clean_files_snapshot(struct task_data *data);
 
+int take_pipes_snapshot(struct task_data *data);
+int recover_pipes_snapshot(struct task_data *data);
+void clean_pipes_snapshot(struct task_data *data);
+
+int take_sockets_snapshot(struct task_data *data);
+int recover_sockets_snapshot(struct task_data *data);
+void clean_sockets_snapshot(struct task_data *data);
+
+int take_events_snapshot(struct task_data *data);
+int recover_events_snapshot(struct task_data *data);
+void clean_events_snapshot(struct task_data *data);
+void do_epoll_ctl_hook(unsigned long ip, unsigned long parent_ip,
+		       struct ftrace_ops *op, ftrace_regs_ptr regs);
+
+int recover_filedata_snapshot(struct task_data *data);
+void clean_filedata_snapshot(struct task_data *data);
+
+int take_children_snapshot(struct task_data *data);
+int recover_children_snapshot(struct task_data *data);
+void clean_children_snapshot(struct task_data *data);
+int record_snapshot_child(struct task_data *data, struct task_struct *p);
+
+int take_signals_snapshot(struct task_data *data);
+int recover_signals_snapshot(struct task_data *data);
+void clean_signals_snapshot(struct task_data *data);
+void signal_state_hook(unsigned long ip, unsigned long parent_ip,
+		       struct ftrace_ops *op, ftrace_regs_ptr regs);
+void set_current_blocked_hook(unsigned long ip, unsigned long parent_ip,
+			      struct ftrace_ops *op, ftrace_regs_ptr regs);
+
+unsigned int get_xstate_size(void);
+bool check_xstate(const void *xstate);
+int  alloc_ext_regs(struct snapshot_ext_regs *ext);
+int  save_ext_regs(struct snapshot_ext_regs *ext);
+void restore_ext_regs(struct snapshot_ext_regs *ext);
+void free_ext_regs(struct snapshot_ext_regs *ext);
+
+int  take_threads_snapshot(struct task_data *data);
 void recover_threads_snapshot(struct task_data *data);
+void release_threads_snapshot(struct task_data *data);
+void clean_threads_snapshot(struct task_data *data);
+
+void fd_install_hook(unsigned long ip, unsigned long parent_ip,
+		     struct ftrace_ops *op, ftrace_regs_ptr regs);
+void close_fd_hook(unsigned long ip, unsigned long parent_ip,
+		   struct ftrace_ops *op, ftrace_regs_ptr regs);
+void close_range_hook(unsigned long ip, unsigned long parent_ip,
+		      struct ftrace_ops *op, ftrace_regs_ptr regs);
+void sys_dup_hook(unsigned long ip, unsigned long parent_ip,
+		  struct ftrace_ops *op, ftrace_regs_ptr regs);
 
 void do_wp_page_hook(unsigned long ip, unsigned long parent_ip,
 		     struct ftrace_ops *op, ftrace_regs_ptr regs);
@@ -264,18 +698,56 @@ void page_add_new_anon_rmap_hook(unsigned long ip, unsigned long parent_ip,
 				 struct ftrace_ops *op, ftrace_regs_ptr regs);
 void __do_munmap_hook(unsigned long ip, unsigned long parent_ip,
 		      struct ftrace_ops *op, ftrace_regs_ptr regs);
+void finish_fault_hook(unsigned long ip, unsigned long parent_ip,
+		       struct ftrace_ops *op, ftrace_regs_ptr regs);
+void mprotect_fixup_hook(unsigned long ip, unsigned long parent_ip,
+			 struct ftrace_ops *op, ftrace_regs_ptr regs);
 
 typedef void (*do_exit_t)(long code);
 extern do_exit_t do_exit_orig;
 void do_exit_hook(long code);
 
+typedef int (*rw_verify_area_t)(int read_write, struct file *file,
+				const loff_t *ppos, size_t count);
+extern rw_verify_area_t rw_verify_area_orig;
+int rw_verify_area_hook(int read_write, struct file *file, const loff_t *ppos,
+			size_t count);
+
+/* The signature of do_truncate was changed in 5.12.0 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+typedef int (*do_truncate_t)(struct user_namespace *mnt_userns,
+			     struct dentry *dentry, loff_t length,
+			     unsigned int time_attrs, struct file *filp);
+int do_truncate_hook(struct user_namespace *mnt_userns, struct dentry *dentry,
+		     loff_t length, unsigned int time_attrs, struct file *filp);
+#else
+typedef int (*do_truncate_t)(struct dentry *dentry, loff_t length,
+			     unsigned int time_attrs, struct file *filp);
+int do_truncate_hook(struct dentry *dentry, loff_t length,
+		     unsigned int time_attrs, struct file *filp);
+#endif
+extern do_truncate_t do_truncate_orig;
+
+typedef long (*vfs_truncate_t)(const struct path *path, loff_t length);
+extern vfs_truncate_t vfs_truncate_orig;
+long vfs_truncate_hook(const struct path *path, loff_t length);
+
 int  take_snapshot(int config);
 int recover_snapshot(void);
+int  rebase_snapshot(void);
+int  fork_snapshot(int notify_fd);
+int  force_restore_snapshot(struct task_data *data, int status);
+int  save_snapshot(int fd, struct file *dev);
+int  load_snapshot(int fd, struct file *dev);
+int  push_snapshot(void);
+int  pop_snapshot(void);
+int  recover_snapshot_level(unsigned int depth);
 void clean_snapshot(void);
 int  exit_snapshot(void);
 
 void exclude_vmrange(unsigned long start, unsigned long end);
 void include_vmrange(unsigned long start, unsigned long end);
+void shadow_vmrange(unsigned long start, unsigned long end);
 
 #endif
 
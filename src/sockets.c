@@ -0,0 +1,198 @@
+#include "debug.h"
+#include "linux/fdtable.h"
+#include "linux/file.h"
+#include "linux/fs.h"
+#include "linux/in.h"
+#include "linux/net.h"
+#include "linux/slab.h"
+#include "linux/socket.h"
+#include "linux/tcp.h"
+#include "net/sock.h"
+#include "task_data.h"
+#include "snapshot.h"
+
+/*
+ * Network targets are fed through connections made over loopback in every
+ * iteration. The listening and datagram sockets present at snapshot time are
+ * recorded. On restore the connections left in their accept queues and the
+ * datagrams left unread are dropped, and the TCP sockets created during the
+ * iteration are reset instead of going through an orderly shutdown, so no
+ * half-closed connection is left behind.
+ */
+
+static bool is_inet_sock(struct sock *sk)
+{
+	return sk->sk_family == AF_INET || sk->sk_family == AF_INET6;
+}
+
+static struct socket *get_inet_socket(struct file *file)
+{
+	struct socket *sock;
+
+	if (!S_ISSOCK(file_inode(file)->i_mode))
+		return NULL;
+
+	sock = SOCKET_I(file_inode(file));
+	if (!sock->sk || !is_inet_sock(sock->sk))
+		return NULL;
+
+	return sock;
+}
+
+static int save_socket(struct task_data *data, struct file *file)
+{
+	struct socket *sock = get_inet_socket(file);
+	struct snapshot_socket *ss_sock;
+
+	if (!sock)
+		return 0;
+
+	// Only the queues of these sockets are reset on restore.
+	if (!(sock->type == SOCK_STREAM && sock->sk->sk_state == TCP_LISTEN) &&
+	    sock->type != SOCK_DGRAM)
+		return 0;
+
+	list_for_each_entry (ss_sock, &data->ss.sockets, node) {
+		if (ss_sock->file == file)
+			return 0;
+	}
+
+	ss_sock = kmalloc(sizeof(struct snapshot_socket), GFP_KERNEL);
+	if (!ss_sock) {
+		FATAL("snapshot_socket allocation failed");
+		return -ENOMEM;
+	}
+
+	DBG_PRINT("recording socket inode %lu\n", file_inode(file)->i_ino);
+
+	ss_sock->file = get_file(file);
+	list_add_tail(&ss_sock->node, &data->ss.sockets);
+
+	return 0;
+}
+
+int take_sockets_snapshot(struct task_data *data)
+{
+	struct files_struct *files = current->files;
+	struct file *file;
+	unsigned int max_fds;
+	unsigned int fd;
+	int error = 0;
+
+	if (!(data->config & AFL_SNAPSHOT_FDS))
+		return 0;
+
+	rcu_read_lock();
+	max_fds = files_fdtable(files)->max_fds;
+	rcu_read_unlock();
+
+	for (fd = 0; fd < max_fds && !error; fd++) {
+		file = fget(fd);
+		if (!file)
+			continue;
+
+		error = save_socket(data, file);
+		fput(file);
+	}
+
+	return error;
+}
+
+static void drain_accept_queue(struct socket *sock)
+{
+	struct socket *newsock;
+
+	while (!kernel_accept(sock, &newsock, O_NONBLOCK)) {
+		DBG_PRINT("dropping pending connection\n");
+		sock_no_linger(newsock->sk);
+		sock_release(newsock);
+	}
+}
+
+static void drain_receive_queue(struct socket *sock)
+{
+	struct msghdr msg = {};
+	struct kvec vec = {};
+
+	// With an empty buffer every datagram is truncated and dropped.
+	while (kernel_recvmsg(sock, &msg, &vec, 1, 0,
+			      MSG_DONTWAIT | MSG_TRUNC) >= 0)
+		DBG_PRINT("dropping pending datagram\n");
+}
+
+// Make the close of a TCP socket created during the iteration send a reset.
+static void reset_new_socket(struct open_files_snapshot *files_snap,
+			     unsigned int fd)
+{
+	struct fdtable *saved_fdt = rcu_dereference_raw(files_snap->files->fdt);
+	struct socket *sock;
+	struct file *file;
+
+	file = fget(fd);
+	if (!file)
+		return;
+
+	// Sockets that were in the table at snapshot time are kept.
+	if (fd < saved_fdt->max_fds && saved_fdt->fd[fd] == file)
+		goto out;
+
+	sock = get_inet_socket(file);
+	if (sock && sock->type == SOCK_STREAM) {
+		DBG_PRINT("resetting new socket at fd %u\n", fd);
+		sock_no_linger(sock->sk);
+	}
+
+out:
+	fput(file);
+}
+
+int recover_sockets_snapshot(struct task_data *data)
+{
+	struct open_files_snapshot *files_snap = &data->ss.ss_files;
+	unsigned long *touched = get_touched_fds(files_snap);
+	struct snapshot_socket *ss_sock;
+	struct socket *sock;
+	unsigned int max_fds;
+	unsigned int fd;
+
+	if (!(data->config & AFL_SNAPSHOT_FDS) || !touched)
+		return 0;
+
+	/*
+	 * This runs before the fd table is restored, new sockets are among the
+	 * touched descriptors and get closed right after.
+	 */
+	for_each_set_bit (fd, touched, files_snap->max_fds)
+		reset_new_socket(files_snap, fd);
+
+	if (files_snap->touched_high) {
+		rcu_read_lock();
+		max_fds = files_fdtable(current->files)->max_fds;
+		rcu_read_unlock();
+
+		for (fd = files_snap->max_fds; fd < max_fds; fd++)
+			reset_new_socket(files_snap, fd);
+	}
+
+	list_for_each_entry (ss_sock, &data->ss.sockets, node) {
+		sock = SOCKET_I(file_inode(ss_sock->file));
+
+		if (sock->type == SOCK_DGRAM)
+			drain_receive_queue(sock);
+		else if (sock->sk->sk_state == TCP_LISTEN)
+			drain_accept_queue(sock);
+	}
+
+	return 0;
+}
+
+void clean_sockets_snapshot(struct task_data *data)
+{
+	struct snapshot_socket *ss_sock, *next;
+
+	list_for_each_entry_safe (ss_sock, next, &data->ss.sockets, node) {
+		list_del(&ss_sock->node);
+		fput(ss_sock->file);
+		kfree(ss_sock);
+	}
+}
@@ -0,0 +1,150 @@
+#include "debug.h"
+#include "linux/moduleparam.h"
+#include "linux/uaccess.h"
+#include "task_data.h"
+#include "snapshot.h"
+
+/*
+ * Every restore measures the time spent bringing the memory back, plus, for
+ * a swap, the time the workqueue spent preparing the clone. The copy-on-write
+ * faults taken during the iteration cost about the same with both strategies,
+ * so they are left out. With AFL_SNAPSHOT_AUTO the snapshot starts with the
+ * page restore and tries the swap after a few iterations. The cheaper one is
+ * kept, and the other one is tried again from time to time as the dirty sets
+ * change with the inputs.
+ */
+
+// Iterations measured after a switch before the next decision.
+#define STRATEGY_MEASURE_ITERATIONS 16
+
+// Snapshot options whose restore the swap does not reproduce.
+#define STRATEGY_NO_SWAP                                                    \
+	(AFL_SNAPSHOT_BLOCK | AFL_SNAPSHOT_NOSTACK | AFL_SNAPSHOT_SHARED |   \
+	 AFL_SNAPSHOT_SHADOW | AFL_SNAPSHOT_THREADS)
+
+static unsigned int auto_probe_interval = 4096;
+module_param(auto_probe_interval, uint, 0644);
+MODULE_PARM_DESC(auto_probe_interval,
+		 "Iterations before the restore strategy not in use is tried again");
+
+static int current_strategy(struct task_data *data)
+{
+	return (data->config & AFL_SNAPSHOT_SWAP) ? AFL_SNAPSHOT_STRATEGY_SWAP :
+						    AFL_SNAPSHOT_STRATEGY_PAGE;
+}
+
+void account_restore(struct task_data *data, u64 ns)
+{
+	struct snapshot_stats *st = &data->ss.stats;
+	int strategy = current_strategy(data);
+	u64 cost = ns;
+
+	if (strategy == AFL_SNAPSHOT_STRATEGY_SWAP)
+		cost += st->prepare_ns;
+
+	st->iterations++;
+	st->restore_ns = ns;
+	st->measured++;
+
+	if (st->cost_ns[strategy])
+		st->cost_ns[strategy] = (st->cost_ns[strategy] * 7 + cost) / 8;
+	else
+		st->cost_ns[strategy] = cost;
+}
+
+static bool can_swap(struct task_data *data)
+{
+	return !data->ss.stats.no_swap && !data->ss.depth &&
+	       !(data->config & STRATEGY_NO_SWAP) &&
+	       list_empty(&data->allowlist) && list_empty(&data->blocklist);
+}
+
+// Called right after a restore, the memory is the one of the snapshot.
+static int switch_strategy(struct task_data *data, int strategy)
+{
+	int res;
+
+	if (strategy == AFL_SNAPSHOT_STRATEGY_SWAP) {
+		res = take_swap_snapshot(data);
+		if (res) {
+			data->ss.stats.no_swap = true;
+			return res;
+		}
+
+		data->config |= AFL_SNAPSHOT_SWAP;
+		clean_memory_snapshot(data);
+		return 0;
+	}
+
+	res = take_memory_snapshot(data);
+	if (res) {
+		clean_memory_snapshot(data);
+		return res;
+	}
+
+	clean_swap_snapshot(data);
+	data->config &= ~AFL_SNAPSHOT_SWAP;
+	return 0;
+}
+
+void select_restore_strategy(struct task_data *data)
+{
+	struct snapshot_stats *st = &data->ss.stats;
+	int strategy = current_strategy(data), other = !strategy;
+	bool probe;
+
+	if (!(data->config & AFL_SNAPSHOT_AUTO) ||
+	    st->measured < STRATEGY_MEASURE_ITERATIONS)
+		return;
+
+	if (other == AFL_SNAPSHOT_STRATEGY_SWAP && !can_swap(data))
+		return;
+
+	// Switch when the other one was never measured, when its measure is
+	// stale, or when it is at least 20% cheaper.
+	probe = !st->cost_ns[other] || st->measured >= auto_probe_interval;
+	if (!probe && st->cost_ns[other] * 5 >= st->cost_ns[strategy] * 4)
+		return;
+
+	DBG_PRINT("switching to restore strategy %d, costs %llu/%llu ns\n",
+		  other, st->cost_ns[AFL_SNAPSHOT_STRATEGY_PAGE],
+		  st->cost_ns[AFL_SNAPSHOT_STRATEGY_SWAP]);
+
+	if (switch_strategy(data, other)) {
+		WARNF("could not switch to restore strategy %d", other);
+		st->measured = 0;
+		return;
+	}
+
+	if (probe)
+		st->cost_ns[other] = 0;
+
+	st->measured = 0;
+	st->switches++;
+}
+
+int get_snapshot_stats(struct afl_snapshot_stats __user *arg)
+{
+	struct task_data *data = get_task_data(current);
+	struct afl_snapshot_stats stats;
+	struct snapshot_stats *st;
+
+	if (!data || !have_snapshot(data))
+		return -EINVAL;
+
+	st = &data->ss.stats;
+
+	memset(&stats, 0, sizeof(stats));
+	stats.iterations = st->iterations;
+	stats.dirty_pages = st->dirty_pages;
+	stats.restore_ns = st->restore_ns;
+	stats.page_cost_ns = st->cost_ns[AFL_SNAPSHOT_STRATEGY_PAGE];
+	stats.swap_cost_ns = st->cost_ns[AFL_SNAPSHOT_STRATEGY_SWAP];
+	stats.strategy = current_strategy(data);
+	stats.switches = st->switches;
+
+	if (copy_to_user(arg, &stats, sizeof(stats)))
+		return -EFAULT;
+
+	return 0;
+}
@@ -0,0 +1,203 @@
+#include "debug.h"
+#include "linux/memcontrol.h"
+#include "linux/mmu_context.h"
+#include "linux/sched/coredump.h"
+#include "linux/sched/mm.h"
+#include "linux/sched/signal.h"
+#include "linux/slab.h"
+#include "linux/timekeeping.h"
+#include "linux/vmacache.h"
+#include "linux/workqueue.h"
+#include "task_data.h"
+#include "snapshot.h"
+
+/*
+ * With AFL_SNAPSHOT_SWAP the memory is not tracked page by page. At snapshot
+ * time the address space is duplicated like fork() does into a master copy
+ * that never runs, and a copy-on-write clone of the master is prepared on a
+ * workqueue. A restore swaps the clone in place of the mm of the target, the
+ * old mm is torn down asynchronously and the next clone is prepared while the
+ * target runs. The cost of a restore no longer depends on how many pages the
+ * iteration dirtied, only on the page tables to copy.
+ *
+ * dup_mm() leaves out the MADV_DONTFORK mappings and empties the
+ * MADV_WIPEONFORK ones like fork() does, an address space with such mappings
+ * is not swapped.
+ */
+
+// Mappings a clone would not reproduce.
+#define SWAP_NOT_COPIED (VM_DONTCOPY | VM_WIPEONFORK)
+
+dup_mm_t dup_mm_ptr;
+switch_mm_irqs_off_t switch_mm_irqs_off_ptr;
+sync_mm_rss_t sync_mm_rss_ptr;
+
+struct snapshot_swap {
+	struct task_struct *tsk;
+	struct mem_cgroup *memcg; // of the target, charged for the clones
+	struct mm_struct *master;
+	struct mm_struct *clone; // ready to be swapped in, NULL if not yet
+	u64 prepare_ns;
+	struct work_struct work;
+};
+
+static struct mm_struct *dup_snapshot_mm(struct snapshot_swap *sw)
+{
+	struct mm_struct *mm;
+
+	mm = dup_mm_ptr(sw->tsk, sw->master);
+	if (!mm)
+		return NULL;
+
+	// mm_init() takes these from current, a worker has no mm.
+	mm->flags = (mm->flags & ~MMF_INIT_MASK) |
+		    (sw->master->flags & MMF_INIT_MASK);
+	mm->def_flags = sw->master->def_flags;
+
+	return mm;
+}
+
+static void prepare_clone(struct work_struct *work)
+{
+	struct snapshot_swap *sw =
+		container_of(work, struct snapshot_swap, work);
+	struct mem_cgroup *old_memcg;
+	u64 start = ktime_get_ns();
+
+	// The page tables are charged to the cgroup of the worker otherwise.
+	old_memcg = set_active_memcg(sw->memcg);
+	sw->clone = dup_snapshot_mm(sw);
+	set_active_memcg(old_memcg);
+	sw->prepare_ns = ktime_get_ns() - start;
+	if (!sw->clone)
+		WARNF("could not prepare the next address space clone");
+}
+
+// Like exec_mmap(). The threads left from the iteration are being killed,
+// they hold their own reference to the old mm.
+static void swap_mm(struct task_data *data, struct mm_struct *mm)
+{
+	struct task_struct *tsk = current;
+	struct mm_struct *old_mm = tsk->mm;
+
+	if (sync_mm_rss_ptr)
+		sync_mm_rss_ptr(old_mm);
+
+	task_lock(tsk);
+	local_irq_disable();
+	tsk->active_mm = mm;
+	tsk->mm = mm;
+	switch_mm_irqs_off_ptr(old_mm, mm, tsk);
+	local_irq_enable();
+	vmacache_flush(tsk);
+	task_unlock(tsk);
+
+	WRITE_ONCE(data->mm, mm);
+	// The old mm may be reused for another process once freed.
+	invalidate_task_data_cache(old_mm);
+	invalidate_task_data_cache(mm);
+
+	mmput_async(old_mm);
+}
+
+static bool has_uncopied_vma(struct mm_struct *mm)
+{
+	struct vm_area_struct *vma;
+	bool found = false;
+
+	mmap_read_lock(mm);
+	for (vma = mm->mmap; vma && !found; vma = vma->vm_next)
+		found = vma->vm_flags & SWAP_NOT_COPIED;
+	mmap_read_unlock(mm);
+
+	return found;
+}
+
+int take_swap_snapshot(struct task_data *data)
+{
+	struct snapshot_swap *sw;
+
+	if (!dup_mm_ptr || !switch_mm_irqs_off_ptr) {
+		WARNF("address space swap is not available");
+		return -EOPNOTSUPP;
+	}
+
+	// Another thread or process using the mm would keep the old one.
+	if ((data->config & (AFL_SNAPSHOT_THREADS | AFL_SNAPSHOT_SHADOW)) ||
+	    get_nr_threads(current) > 1 ||
+	    atomic_read(&current->mm->mm_users) > 1) {
+		WARNF("address space swap needs a single threaded target");
+		return -EOPNOTSUPP;
+	}
+
+	if (has_uncopied_vma(current->mm)) {
+		WARNF("address space swap cannot restore MADV_DONTFORK or MADV_WIPEONFORK mappings");
+		return -EOPNOTSUPP;
+	}
+
+	sw = kzalloc(sizeof(struct snapshot_swap), GFP_KERNEL);
+	if (!sw) {
+		FATAL("snapshot_swap allocation failed");
+		return -ENOMEM;
+	}
+
+	sw->tsk = current;
+	sw->memcg = get_mem_cgroup_from_mm(current->mm);
+	INIT_WORK(&sw->work, prepare_clone);
+
+	sw->master = dup_mm_ptr(current, current->mm);
+	if (!sw->master) {
+		FATAL("could not duplicate the address space");
+		mem_cgroup_put(sw->memcg);
+		kfree(sw);
+		return -ENOMEM;
+	}
+
+	data->ss.swap = sw;
+	queue_work(system_unbound_wq, &sw->work);
+
+	return 0;
+}
+
+int recover_swap_snapshot(struct task_data *data)
+{
+	struct snapshot_swap *sw = data->ss.swap;
+	struct mm_struct *mm;
+
+	flush_work(&sw->work);
+	data->ss.stats.prepare_ns = sw->clone ? sw->prepare_ns : 0;
+
+	mm = sw->clone;
+	if (!mm) {
+		mm = dup_snapshot_mm(sw);
+		if (!mm) {
+			FATAL("could not duplicate the address space");
+			return -ENOMEM;
+		}
+	}
+
+	sw->clone = NULL;
+	swap_mm(data, mm);
+
+	queue_work(system_unbound_wq, &sw->work);
+
+	return 0;
+}
+
+void clean_swap_snapshot(struct task_data *data)
+{
+	struct snapshot_swap *sw = data->ss.swap;
+
+	if (!sw)
+		return;
+
+	cancel_work_sync(&sw->work);
+
+	if (sw->clone)
+		mmput(sw->clone);
+	mmput(sw->master);
+
+	mem_cgroup_put(sw->memcg);
+	kfree(sw);
+	data->ss.swap = NULL;
+}
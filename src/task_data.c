@@ -1,6 +1,7 @@
 #include "task_data.h"
 #include "debug.h"
 
+#include <linux/percpu.h>
 #include <linux/slab.h>
 
 static LIST_HEAD(task_data_list);
@@ -23,6 +24,12 @@ static void task_data_free_callback(struct rcu_head *rcu)
 		kfree(range);
 	}
 
+	list_for_each_entry_safe(range, next, &data->shadowlist, node) {
+		list_del(&range->node);
+		kfree(range);
+	}
+
+	free_percpu(data->ss.dirty_logs);
 	kfree(data);
 }
 
@@ -42,6 +49,24 @@ struct task_data *get_task_data(const struct task_struct *tsk)
 	return NULL;
 }
 
+// The memory hooks run in whichever thread faults, not only the one that
+// took the snapshot.
+struct task_data *get_task_data_by_mm(const struct mm_struct *mm)
+{
+	struct task_data *data = NULL;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu (data, &task_data_list, list) {
+		if (data->mm == mm) {
+			rcu_read_unlock();
+			return data;
+		}
+	}
+	rcu_read_unlock();
+
+	return NULL;
+}
+
 struct task_data *ensure_task_data(const struct task_struct *tsk)
 {
 	struct task_data *data = NULL;
@@ -56,16 +81,40 @@ struct task_data *ensure_task_data(const struct task_struct *tsk)
 		return NULL;
 	}
 
+	data->ss.dirty_logs = alloc_percpu(struct llist_head);
+	if (!data->ss.dirty_logs) {
+		FATAL("allocation of dirty page logs failed!\n");
+		kfree(data);
+		return NULL;
+	}
+
 	data->tsk = tsk;
+	data->mm = tsk->mm;
 
 	INIT_LIST_HEAD(&data->ss.all_vmas);
 	INIT_LIST_HEAD(&data->ss.snapshotted_vmas);
+	INIT_LIST_HEAD(&data->ss.shadow_vmas);
+	INIT_LIST_HEAD(&data->ss.levels);
 
 	hash_init(data->ss.ss_pages);
-	INIT_LIST_HEAD(&data->ss.dirty_pages);
+	spin_lock_init(&data->ss.ss_pages_lock);
+	INIT_LIST_HEAD(&data->ss.prot_changes);
+	xa_init(&data->ss.shadow_touched);
+	INIT_LIST_HEAD(&data->ss.dirty_files);
+	mutex_init(&data->ss.dirty_files_lock);
+	INIT_LIST_HEAD(&data->ss.streams);
+	INIT_LIST_HEAD(&data->ss.event_files);
+	INIT_LIST_HEAD(&data->ss.sockets);
+	INIT_LIST_HEAD(&data->ss.children);
+	INIT_LIST_HEAD(&data->ss.threads);
+	INIT_LIST_HEAD(&data->ss.new_threads);
+	init_waitqueue_head(&data->ss.threads_release.wq);
+	data->ss.threads_release.gen = 0;
+	init_iteration_budget(data);
 
 	INIT_LIST_HEAD(&data->allowlist);
 	INIT_LIST_HEAD(&data->blocklist);
+	INIT_LIST_HEAD(&data->shadowlist);
 
 	spin_lock(&task_data_lock);
 	list_add_rcu(&data->list, &task_data_list);
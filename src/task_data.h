@@ -14,10 +14,11 @@ struct vmrange {
 
 struct task_data {
 	const struct task_struct *tsk;
+	const struct mm_struct *mm;
 
 	struct snapshot ss;
 
-	struct list_head allowlist, blocklist;
+	struct list_head allowlist, blocklist, shadowlist;
 	int config;
 
 	struct list_head list;
@@ -25,6 +26,7 @@ struct task_data {
 };
 
 struct task_data *get_task_data(const struct task_struct *tsk);
+struct task_data *get_task_data_by_mm(const struct mm_struct *mm);
 struct task_data *ensure_task_data(const struct task_struct *tsk);
 void              remove_task_data(struct task_data *data);
 
@@ -3,6 +3,11 @@
 #include "task_data.h"
 #include "snapshot.h"
 
+#include <asm/syscall.h>
+#include <linux/refcount.h>
+#include <linux/task_work.h>
+#include <linux/wait.h>
+
 static struct task_struct *next_tid(struct task_struct *start) {
 
   struct task_struct *pos = NULL;
@@ -23,35 +28,307 @@ static struct task_struct *next_tid(struct task_struct *start) {
 
 }
 
-/* void take_threads_snapshot(struct task_data * data) {
+/*
+ * Other threads are parked with a task work, it runs in their own context
+ * when they return to user mode, so their user registers are complete and
+ * they hold no kernel locks. A parked thread waits until the snapshotting
+ * thread is done with the memory, then it saves or rewinds its context, or
+ * exits if it was created during the iteration.
+ */
+
+static void save_thread_context(struct snapshot_thread *th) {
+
+  struct pt_regs *regs = task_pt_regs(current);
+
+  th->regs = *regs;
+
+  // The task work runs before the syscall restart fixup, do it here so
+  // the saved context restarts the interrupted syscall.
+  if (syscall_get_nr(current, regs) >= 0) {
+
+    switch (syscall_get_error(current, regs)) {
+
+      case -ERESTARTNOHAND:
+      case -ERESTARTSYS:
+      case -ERESTARTNOINTR:
+        th->regs.ax = th->regs.orig_ax;
+        th->regs.ip -= 2;
+        break;
+
+      case -ERESTART_RESTARTBLOCK:
+        // The restart block is not saved, report an interruption.
+        th->regs.ax = -EINTR;
+        break;
+
+    }
+
+  }
+
+  th->regs.orig_ax = -1;
+
+  if (save_ext_regs(&th->ext_regs))
+    WARNF("thread %d: extended registers not saved", task_pid_nr(current));
+  th->blocked = current->blocked;
+
+}
+
+static void rewind_thread_context(struct snapshot_thread *th) {
+
+  *task_pt_regs(current) = th->regs;
+  restore_ext_regs(&th->ext_regs);
+
+  set_current_blocked(&th->blocked);
+
+}
+
+static void put_snapshot_thread(struct snapshot_thread *th) {
+
+  if (refcount_dec_and_test(&th->refs)) kfree(th);
+
+}
+
+static void park_thread(struct callback_head *work) {
+
+  struct snapshot_thread *th =
+      container_of(work, struct snapshot_thread, work);
+  struct snapshot_release    *release = th->release;
+  u64                         gen = th->release_gen;
+  enum snapshot_thread_action action = th->action;
+
+  if (action == SNAPSHOT_THREAD_SAVE) save_thread_context(th);
+
+  complete(&th->parked);
+  if (wait_event_killable(release->wq, READ_ONCE(release->gen) != gen)) {
+
+    if (action == SNAPSHOT_THREAD_EXIT) put_snapshot_thread(th);
+    return;
+
+  }
+
+  switch (action) {
+
+    case SNAPSHOT_THREAD_REWIND:
+      rewind_thread_context(th);
+      break;
+
+    case SNAPSHOT_THREAD_EXIT:
+      put_snapshot_thread(th);
+      do_exit_orig(0);
+      break;
+
+    default:
+      break;
+
+  }
+
+}
+
+static int park_threads(struct task_data *data, struct list_head *threads) {
+
+  struct snapshot_thread *th, *n;
+  int                     res;
+
+  list_for_each_entry_safe(th, n, threads, node) {
+
+    th->release = &data->ss.threads_release;
+    th->release_gen = data->ss.threads_release.gen;
+    init_completion(&th->parked);
+    init_task_work(&th->work, park_thread);
+
+    if (task_work_add(th->tsk, &th->work, TWA_SIGNAL)) {
+
+      // The thread is exiting on its own.
+      DBG_PRINT("thread %d is gone\n", task_pid_nr(th->tsk));
+      if (th->action == SNAPSHOT_THREAD_EXIT) put_snapshot_thread(th);
+      th->action = SNAPSHOT_THREAD_GONE;
+      continue;
+
+    }
+
+  }
+
+  list_for_each_entry(th, threads, node) {
+
+    if (th->action == SNAPSHOT_THREAD_GONE) continue;
+
+    res = wait_for_completion_killable(&th->parked);
+    if (res) return res;
+
+  }
+
+  return 0;
+
+}
+
+static struct snapshot_thread *alloc_snapshot_thread(struct task_struct *t,
+                                                     int action) {
+
+  struct snapshot_thread *th;
+
+  th = kzalloc(sizeof(struct snapshot_thread), GFP_KERNEL);
+  if (!th) {
+
+    FATAL("snapshot_thread allocation failed");
+    return NULL;
+
+  }
 
-  struct task_struct *t = data->tsk->group_leader;
   get_task_struct(t);
+  th->tsk = t;
+  th->action = action;
+  // A new thread drops its own reference once released.
+  refcount_set(&th->refs, action == SNAPSHOT_THREAD_EXIT ? 2 : 1);
+  INIT_LIST_HEAD(&th->node);
+
+  return th;
+
+}
+
+static struct snapshot_thread *find_snapshot_thread(struct task_data *data,
+                                                    struct task_struct *t) {
+
+  struct snapshot_thread *th;
+
+  list_for_each_entry(th, &data->ss.threads, node) {
+
+    if (th->tsk == t) return th;
+
+  }
+
+  return NULL;
+
+}
+
+int take_threads_snapshot(struct task_data *data) {
+
+  struct task_struct     *t;
+  struct snapshot_thread *th;
+
+  if (!(data->config & AFL_SNAPSHOT_THREADS)) return 0;
+
+  t = data->tsk->group_leader;
+  get_task_struct(t);
+
   while (t) {
 
-    if (t != data->tsk)
-      add_snapshot_thread(data, t);
+    if (t != data->tsk) {
+
+      th = alloc_snapshot_thread(t, SNAPSHOT_THREAD_SAVE);
+      if (!th) {
+
+        put_task_struct(t);
+        return -ENOMEM;
+
+      }
+
+      list_add_tail(&th->node, &data->ss.threads);
+
+    }
+
     t = next_tid(t);
 
   }
 
-} */
+  return park_threads(data, &data->ss.threads);
+
+}
 
 void recover_threads_snapshot(struct task_data *data) {
 
-  struct task_struct *t = data->tsk->group_leader;
+  struct task_struct     *t;
+  struct snapshot_thread *th, *n;
+
+  if (!(data->config & AFL_SNAPSHOT_THREADS)) {
+
+    t = data->tsk->group_leader;
+    get_task_struct(t);
+
+    while (t) {
+
+      if (t != data->tsk) send_sig(SIGKILL, t, 1);
+      t = next_tid(t);
+
+    }
+
+    return;
+
+  }
+
+  // Threads created during the iteration are parked too, they exit once
+  // released.
+  t = data->tsk->group_leader;
   get_task_struct(t);
 
   while (t) {
 
-    if (t != data->tsk) send_sig(SIGKILL, t, 1);
+    if (t != data->tsk && !find_snapshot_thread(data, t)) {
+
+      th = alloc_snapshot_thread(t, SNAPSHOT_THREAD_EXIT);
+      if (th) list_add_tail(&th->node, &data->ss.new_threads);
+
+    }
+
     t = next_tid(t);
 
   }
 
+  list_for_each_entry_safe(th, n, &data->ss.threads, node) {
+
+    if (th->action == SNAPSHOT_THREAD_GONE) continue;
+    th->action = SNAPSHOT_THREAD_REWIND;
+
+  }
+
+  if (park_threads(data, &data->ss.threads) ||
+      park_threads(data, &data->ss.new_threads))
+    WARNF("could not park all the threads");
+
 }
 
-/* void clean_thareds_snapshot(struct task_data * data) {
+void release_threads_snapshot(struct task_data *data) {
+
+  struct snapshot_thread *th, *n;
 
-} */
+  if (!(data->config & AFL_SNAPSHOT_THREADS)) return;
 
+  // A thread that exited cannot be brought back, warn once and forget it.
+  list_for_each_entry_safe(th, n, &data->ss.threads, node) {
+
+    if (th->action != SNAPSHOT_THREAD_GONE) continue;
+
+    WARNF("thread %d exited during the iteration and is not restored",
+          task_pid_nr(th->tsk));
+    list_del(&th->node);
+    put_task_struct(th->tsk);
+    free_ext_regs(&th->ext_regs);
+    kfree(th);
+
+  }
+
+  list_for_each_entry_safe(th, n, &data->ss.new_threads, node) {
+
+    list_del(&th->node);
+    put_task_struct(th->tsk);
+    put_snapshot_thread(th);
+
+  }
+
+  WRITE_ONCE(data->ss.threads_release.gen, data->ss.threads_release.gen + 1);
+  wake_up_all(&data->ss.threads_release.wq);
+
+}
+
+void clean_threads_snapshot(struct task_data *data) {
+
+  struct snapshot_thread *th, *n;
+
+  list_for_each_entry_safe(th, n, &data->ss.threads, node) {
+
+    list_del(&th->node);
+    put_task_struct(th->tsk);
+    free_ext_regs(&th->ext_regs);
+    kfree(th);
+
+  }
+
+}
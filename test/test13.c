@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "libaflsnapshot.h"
+
+#define MAP_CONTENT 0x42
+
+static bool has_prot(void *addr, const char *prot) {
+  FILE *maps = fopen("/proc/self/maps", "r");
+  if (!maps) {
+    perror("Could not open /proc/self/maps");
+    exit(1);
+  }
+
+  char          line[512];
+  unsigned long start, end;
+  char          perms[5];
+  bool          found = false;
+
+  while (fgets(line, sizeof(line), maps)) {
+    if (sscanf(line, "%lx-%lx %4s", &start, &end, perms) != 3) continue;
+    if ((unsigned long)addr >= start && (unsigned long)addr < end) {
+      found = !strncmp(perms, prot, 3);
+      break;
+    }
+  }
+
+  fclose(maps);
+  return found;
+}
+
+int main(void) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  if (page_size == -1) {
+    perror("Could not retrieve page size");
+    exit(1);
+  }
+
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  unsigned char *map_addr = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (map_addr == MAP_FAILED) {
+    perror("Could not map memory");
+    exit(1);
+  }
+
+  map_addr[0] = MAP_CONTENT;
+
+  puts("The mapping should be writable and hold its content in both runs.");
+
+  bool is_restored = false;
+  if (afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_FDS |
+                        AFL_SNAPSHOT_REGS)) {
+    puts("Snapshot taken");
+    is_restored = false;
+  } else {
+    puts("Snapshot restored");
+    is_restored = true;
+  }
+
+  if (!has_prot(map_addr, "rw-")) {
+    puts("Protection not restored");
+    exit(1);
+  }
+
+  if (map_addr[0] != MAP_CONTENT) {
+    printf("Content not restored: 0x%x != 0x%x\n", map_addr[0], MAP_CONTENT);
+    exit(1);
+  }
+
+  map_addr[0] = 0;
+
+  // Flip the page the way a JIT does once it has emitted code.
+  if (mprotect(map_addr, page_size, PROT_READ | PROT_EXEC) == -1) {
+    perror("Could not make memory executable");
+    exit(1);
+  }
+
+  if (!is_restored) {
+    puts("Restoring snapshot");
+    afl_snapshot_restore();
+  }
+
+  puts("Success!");
+
+  return 0;
+}
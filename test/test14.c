@@ -0,0 +1,79 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "libaflsnapshot.h"
+
+#define MAP_CONTENT 0x42
+
+int main(void) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  if (page_size == -1) {
+    perror("Could not retrieve page size");
+    exit(1);
+  }
+
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  int memfd = memfd_create("test14", 0);
+  if (memfd == -1 || ftruncate(memfd, page_size * 2) == -1) {
+    perror("Could not create memfd");
+    exit(1);
+  }
+
+  unsigned char *state = mmap(NULL, page_size * 2, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, memfd, 0);
+  unsigned char *bitmap = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_ANON, -1, 0);
+  if (state == MAP_FAILED || bitmap == MAP_FAILED) {
+    perror("Could not map shared memory");
+    exit(1);
+  }
+
+  // state[0] is mapped at snapshot time, state[page_size] is not.
+  state[0] = MAP_CONTENT;
+
+  // The bitmap stands in for the AFL coverage map and must survive restores.
+  afl_snapshot_exclude_vmrange(bitmap, bitmap + page_size);
+
+  puts("The memfd pages should be restored, the bitmap should not.");
+
+  bool is_restored = false;
+  if (afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_FDS |
+                        AFL_SNAPSHOT_REGS | AFL_SNAPSHOT_SHARED)) {
+    puts("Snapshot taken");
+    is_restored = false;
+  } else {
+    puts("Snapshot restored");
+    is_restored = true;
+  }
+
+  if (state[0] != MAP_CONTENT || state[page_size] != 0) {
+    printf("Content not restored: 0x%x 0x%x\n", state[0], state[page_size]);
+    exit(1);
+  }
+
+  state[0] += 1;
+  state[page_size] += 1;
+  bitmap[0] += 1;
+
+  if (!is_restored) {
+    puts("Restoring snapshot");
+    afl_snapshot_restore();
+  }
+
+  if (bitmap[0] != 2) {
+    printf("Excluded shared page was restored: %d != 2\n", bitmap[0]);
+    exit(1);
+  }
+
+  puts("Success!");
+
+  return 0;
+}
@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "libaflsnapshot.h"
+
+// Large enough to be picked up as shadow memory, cheap since it is NORESERVE.
+#define SHADOW_SIZE (1UL << 40)
+#define SHADOW_CONTENT 0x42
+
+int main(void) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  if (page_size == -1) {
+    perror("Could not retrieve page size");
+    exit(1);
+  }
+
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  unsigned char *shadow =
+      mmap(NULL, SHADOW_SIZE, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+  if (shadow == MAP_FAILED) {
+    perror("Could not map shadow memory");
+    exit(1);
+  }
+
+  // Poisoned before the snapshot, this page must keep its content.
+  shadow[0] = SHADOW_CONTENT;
+  // Touched but zero, this page is dropped when the snapshot is taken.
+  shadow[SHADOW_SIZE / 2] = 0;
+
+  puts("Shadow pages touched after the snapshot should read back as zero.");
+
+  bool is_restored = false;
+  if (afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_FDS |
+                        AFL_SNAPSHOT_REGS | AFL_SNAPSHOT_SHADOW)) {
+    puts("Snapshot taken");
+    is_restored = false;
+  } else {
+    puts("Snapshot restored");
+    is_restored = true;
+  }
+
+  if (shadow[0] != SHADOW_CONTENT || shadow[SHADOW_SIZE / 2] != 0 ||
+      shadow[SHADOW_SIZE - page_size] != 0) {
+    printf("Shadow not restored: 0x%x 0x%x 0x%x\n", shadow[0],
+           shadow[SHADOW_SIZE / 2], shadow[SHADOW_SIZE - page_size]);
+    exit(1);
+  }
+
+  shadow[0] += 1;
+  shadow[SHADOW_SIZE / 2] += 1;
+  shadow[SHADOW_SIZE - page_size] += 1;
+
+  if (!is_restored) {
+    puts("Restoring snapshot");
+    afl_snapshot_restore();
+  }
+
+  puts("Success!");
+
+  return 0;
+}
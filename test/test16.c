@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "libaflsnapshot.h"
+
+#define FRAME_SIZE 4096
+#define DEPTH 64
+
+// Dirties DEPTH pages of stack below the snapshot stack pointer.
+static int __attribute__((noinline)) deep(int depth) {
+  volatile char frame[FRAME_SIZE];
+
+  memset((char *)frame, depth, sizeof(frame));
+  if (depth == 0)
+    return frame[0];
+
+  return deep(depth - 1) + frame[FRAME_SIZE - 1];
+}
+
+int main(void) {
+  // Lives in a caller frame above the snapshot stack pointer.
+  volatile int state = 0x42;
+  int expected = deep(DEPTH);
+
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  puts("Frames above the snapshot sp should be restored.");
+
+  bool is_restored = false;
+  if (afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_FDS |
+                        AFL_SNAPSHOT_REGS)) {
+    puts("Snapshot taken");
+    is_restored = false;
+  } else {
+    puts("Snapshot restored");
+    is_restored = true;
+  }
+
+  if (state != 0x42) {
+    printf("Stack frame not restored: 0x%x != 0x42\n", state);
+    exit(1);
+  }
+
+  state += 1;
+  if (deep(DEPTH) != expected) {
+    puts("Stack below the snapshot sp is not usable");
+    exit(1);
+  }
+
+  if (!is_restored) {
+    puts("Restoring snapshot");
+    afl_snapshot_restore();
+  }
+
+  puts("Success!");
+
+  return 0;
+}
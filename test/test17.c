@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libaflsnapshot.h"
+
+#define NUM_FDS 64
+
+int main(void) {
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  int fds[NUM_FDS];
+  for (int i = 0; i < NUM_FDS; i++) {
+    fds[i] = open("/dev/zero", O_RDONLY);
+    if (fds[i] < 0) {
+      perror("Could not open /dev/zero");
+      exit(1);
+    }
+  }
+
+  int pipefd[2];
+  if (pipe(pipefd) == -1) {
+    perror("Could not create pipe");
+    exit(1);
+  }
+
+  puts("Closed, replaced and new fds should be back to the snapshot.");
+
+  bool is_restored = false;
+  if (afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_FDS |
+                        AFL_SNAPSHOT_REGS)) {
+    puts("Snapshot taken");
+    is_restored = false;
+  } else {
+    puts("Snapshot restored");
+    is_restored = true;
+  }
+
+  // Both ends of the pipe must be the original ones.
+  char c = 'x';
+  if (write(pipefd[1], &c, 1) != 1 || read(pipefd[0], &c, 1) != 1 ||
+      c != 'x') {
+    puts("Pipe not restored");
+    exit(1);
+  }
+
+  if (fcntl(fds[0], F_GETFD) == -1 || fcntl(fds[1], F_GETFD) == -1) {
+    puts("Closed fd not restored");
+    exit(1);
+  }
+
+  int new_fd = open("/dev/null", O_RDONLY);
+  if (new_fd < 0) {
+    perror("Could not open /dev/null");
+    exit(1);
+  }
+
+  if (is_restored) {
+    if (new_fd != pipefd[1] + 1) {
+      printf("New fd not closed: %d != %d\n", new_fd, pipefd[1] + 1);
+      exit(1);
+    }
+  } else {
+    close(fds[0]);
+    dup2(new_fd, pipefd[0]);
+    dup2(new_fd, fds[1]);
+  }
+
+  if (!is_restored) {
+    puts("Restoring snapshot");
+    afl_snapshot_restore();
+  }
+
+  puts("Success!");
+
+  return 0;
+}
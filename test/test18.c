@@ -0,0 +1,115 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "libaflsnapshot.h"
+
+#define FILE_NAME "./filedata.tmp"
+#define ORIGINAL "original file content"
+#define ITERATIONS 10000
+
+// Survives restores, it is excluded from the snapshot.
+struct bench {
+  int iteration;
+  struct timespec start;
+};
+
+static double elapsed_ms(struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) * 1e3 +
+         (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void write_original(void) {
+  int fd = open(FILE_NAME, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || write(fd, ORIGINAL, strlen(ORIGINAL)) != strlen(ORIGINAL)) {
+    perror("Could not write the test file");
+    exit(1);
+  }
+  close(fd);
+}
+
+static bool check_original(void) {
+  char buf[64] = {0};
+  int fd = open(FILE_NAME, O_RDONLY);
+  if (fd < 0) return false;
+  ssize_t len = read(fd, buf, sizeof(buf));
+  close(fd);
+  return len == strlen(ORIGINAL) && !memcmp(buf, ORIGINAL, len);
+}
+
+// What the target does to its output file in one iteration.
+static void run_target(void) {
+  int fd = open(FILE_NAME, O_RDWR);
+  pwrite(fd, "MODIFIED", 8, 0);
+  ftruncate(fd, 4);
+  lseek(fd, 0, SEEK_END);
+  write(fd, "appended data that grows the file", 33);
+  close(fd);
+}
+
+int main(void) {
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  long page_size = sysconf(_SC_PAGESIZE);
+  struct bench *bench = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (bench == MAP_FAILED) {
+    perror("Could not map the benchmark state");
+    exit(1);
+  }
+  afl_snapshot_exclude_vmrange(bench, (char *)bench + page_size);
+
+  write_original();
+
+  // Baseline: fork the target and rewrite the file after every run.
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < ITERATIONS; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      run_target();
+      _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    write_original();
+  }
+  printf("fork + cleanup: %.2f ms for %d iterations\n", elapsed_ms(&start),
+         ITERATIONS);
+
+  bench->iteration = 0;
+  clock_gettime(CLOCK_MONOTONIC, &bench->start);
+
+  afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_FDS | AFL_SNAPSHOT_REGS |
+                    AFL_SNAPSHOT_FILEDATA);
+
+  if (!check_original()) {
+    printf("File content not restored after %d iterations\n",
+           bench->iteration);
+    exit(1);
+  }
+
+  if (bench->iteration++ < ITERATIONS) {
+    run_target();
+    afl_snapshot_restore();
+  }
+
+  printf("snapshot: %.2f ms for %d iterations\n", elapsed_ms(&bench->start),
+         ITERATIONS);
+
+  unlink(FILE_NAME);
+  puts("Success!");
+
+  return 0;
+}
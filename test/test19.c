@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "libaflsnapshot.h"
+
+#define INPUT "fuzzing input"
+
+static bool read_input(int fd) {
+  char buf[sizeof(INPUT)] = {0};
+  ssize_t len = read(fd, buf, sizeof(INPUT) - 1);
+
+  return len == sizeof(INPUT) - 1 && !strcmp(buf, INPUT);
+}
+
+int main(void) {
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  int pipefd[2];
+  int sv[2];
+  if (pipe(pipefd) == -1 || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+    perror("Could not create pipe or socketpair");
+    exit(1);
+  }
+
+  // Queued before the snapshot, like input waiting on stdin.
+  write(pipefd[1], INPUT, sizeof(INPUT) - 1);
+  write(sv[1], INPUT, sizeof(INPUT) - 1);
+
+  puts("Consumed pipe and socket data should be available again.");
+
+  bool is_restored = false;
+  if (afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_FDS |
+                        AFL_SNAPSHOT_REGS | AFL_SNAPSHOT_STREAMS)) {
+    puts("Snapshot taken");
+    is_restored = false;
+  } else {
+    puts("Snapshot restored");
+    is_restored = true;
+  }
+
+  if (!read_input(pipefd[0])) {
+    puts("Pipe data not restored");
+    exit(1);
+  }
+
+  if (!read_input(sv[0])) {
+    puts("Socket data not restored");
+    exit(1);
+  }
+
+  // Leftovers of the iteration must be dropped on restore.
+  write(pipefd[1], "junk", 4);
+
+  if (!is_restored) {
+    puts("Restoring snapshot");
+    afl_snapshot_restore();
+  }
+
+  puts("Success!");
+
+  return 0;
+}
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "libaflsnapshot.h"
+
+#define EVENT_COUNT 3
+#define EVENT_DATA 7
+
+int main(void) {
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  int efd = eventfd(EVENT_COUNT, EFD_NONBLOCK);
+  int epfd = epoll_create1(0);
+  int tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+  if (efd == -1 || epfd == -1 || tfd == -1) {
+    perror("Could not create event objects");
+    exit(1);
+  }
+
+  struct epoll_event ev = {.events = EPOLLIN, .data.u64 = EVENT_DATA};
+  struct itimerspec its = {.it_value = {.tv_sec = 1000}};
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &ev) == -1 ||
+      timerfd_settime(tfd, 0, &its, NULL) == -1) {
+    perror("Could not set up event objects");
+    exit(1);
+  }
+
+  puts("Event object state should be restored.");
+
+  bool is_restored = false;
+  if (afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_FDS |
+                        AFL_SNAPSHOT_REGS)) {
+    puts("Snapshot taken");
+    is_restored = false;
+  } else {
+    puts("Snapshot restored");
+    is_restored = true;
+  }
+
+  struct epoll_event out;
+  if (epoll_wait(epfd, &out, 1, 0) != 1 || out.data.u64 != EVENT_DATA) {
+    puts("Epoll interest list not restored");
+    exit(1);
+  }
+
+  uint64_t count = 0;
+  if (read(efd, &count, sizeof(count)) != sizeof(count) ||
+      count != EVENT_COUNT) {
+    printf("Eventfd counter not restored: %lu\n", (unsigned long)count);
+    exit(1);
+  }
+
+  struct itimerspec cur;
+  if (timerfd_gettime(tfd, &cur) == -1 || cur.it_value.tv_sec == 0) {
+    puts("Timerfd not restored");
+    exit(1);
+  }
+
+  // Change everything before restoring.
+  epoll_ctl(epfd, EPOLL_CTL_DEL, efd, NULL);
+  its.it_value.tv_sec = 0;
+  timerfd_settime(tfd, 0, &its, NULL);
+
+  if (!is_restored) {
+    puts("Restoring snapshot");
+    afl_snapshot_restore();
+  }
+
+  puts("Success!");
+
+  return 0;
+}
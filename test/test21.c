@@ -0,0 +1,87 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "libaflsnapshot.h"
+
+static int bind_loopback(int type, struct sockaddr_in *addr) {
+  socklen_t len = sizeof(*addr);
+  int fd = socket(AF_INET, type, 0);
+
+  addr->sin_family = AF_INET;
+  addr->sin_port = 0;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd == -1 || bind(fd, (struct sockaddr *)addr, sizeof(*addr)) == -1 ||
+      getsockname(fd, (struct sockaddr *)addr, &len) == -1) {
+    perror("Could not bind loopback socket");
+    exit(1);
+  }
+
+  return fd;
+}
+
+int main(void) {
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  struct sockaddr_in tcp_addr, udp_addr;
+  int listen_fd = bind_loopback(SOCK_STREAM, &tcp_addr);
+  int udp_fd = bind_loopback(SOCK_DGRAM, &udp_addr);
+  if (listen(listen_fd, 16) == -1) {
+    perror("Could not listen");
+    exit(1);
+  }
+
+  puts("Pending connections and datagrams should be dropped on restore.");
+
+  bool is_restored = false;
+  if (afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_FDS |
+                        AFL_SNAPSHOT_REGS)) {
+    puts("Snapshot taken");
+    is_restored = false;
+  } else {
+    puts("Snapshot restored");
+    is_restored = true;
+  }
+
+  if (accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK) != -1 ||
+      errno != EAGAIN) {
+    puts("Stale connection left in the accept queue");
+    exit(1);
+  }
+
+  char c;
+  if (recv(udp_fd, &c, 1, MSG_DONTWAIT) != -1 || errno != EAGAIN) {
+    puts("Stale datagram left in the receive queue");
+    exit(1);
+  }
+
+  // Leave a connection in the backlog, one accepted and a datagram.
+  int client = socket(AF_INET, SOCK_STREAM, 0);
+  int pending = socket(AF_INET, SOCK_STREAM, 0);
+  if (connect(client, (struct sockaddr *)&tcp_addr, sizeof(tcp_addr)) == -1 ||
+      connect(pending, (struct sockaddr *)&tcp_addr, sizeof(tcp_addr)) == -1 ||
+      accept(listen_fd, NULL, NULL) == -1 ||
+      sendto(udp_fd, "x", 1, 0, (struct sockaddr *)&udp_addr,
+             sizeof(udp_addr)) != 1) {
+    perror("Could not use the loopback sockets");
+    exit(1);
+  }
+
+  if (!is_restored) {
+    puts("Restoring snapshot");
+    afl_snapshot_restore();
+  }
+
+  puts("Success!");
+
+  return 0;
+}
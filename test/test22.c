@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "libaflsnapshot.h"
+
+static volatile int worker_count;
+
+static void *worker(void *arg) {
+  (void)arg;
+
+  for (;;) {
+    worker_count++;
+    usleep(1000);
+  }
+
+  return NULL;
+}
+
+static void *sleeper(void *arg) {
+  (void)arg;
+
+  for (;;)
+    pause();
+
+  return NULL;
+}
+
+static int count_threads(void) {
+  DIR *dir = opendir("/proc/self/task");
+  if (!dir) {
+    perror("Could not open /proc/self/task");
+    exit(1);
+  }
+
+  int count = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dir)))
+    if (ent->d_name[0] != '.') count++;
+
+  closedir(dir);
+  return count;
+}
+
+int main(void) {
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  pthread_t th;
+  if (pthread_create(&th, NULL, worker, NULL)) {
+    perror("Could not create thread");
+    exit(1);
+  }
+
+  while (worker_count < 10)
+    usleep(1000);
+
+  puts("The worker thread should survive the restore.");
+
+  bool is_restored = false;
+  if (afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_REGS |
+                        AFL_SNAPSHOT_THREADS)) {
+    puts("Snapshot taken");
+    is_restored = false;
+  } else {
+    puts("Snapshot restored");
+    is_restored = true;
+  }
+
+  // The worker must be running again after the restore.
+  int start = worker_count;
+  for (int i = 0; i < 1000 && worker_count - start < 10; i++)
+    usleep(1000);
+
+  if (worker_count - start < 10) {
+    puts("Worker thread not running");
+    exit(1);
+  }
+
+  // Threads created during the iteration must be gone after the restore.
+  if (is_restored && count_threads() != 2) {
+    puts("Threads created during the iteration are still alive");
+    exit(1);
+  }
+
+  pthread_t tmp;
+  if (pthread_create(&tmp, NULL, sleeper, NULL)) {
+    perror("Could not create thread");
+    exit(1);
+  }
+
+  if (!is_restored) afl_snapshot_restore();
+
+  puts("Success!");
+  return 0;
+}
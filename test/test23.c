@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "libaflsnapshot.h"
+
+#define NUM_THREADS 8
+#define NUM_PAGES 4096
+#define ROUNDS 16
+
+static char *mapped;   // written before the snapshot
+static char *fresh;    // never touched before the snapshot
+static long  page_size;
+
+static void *hammer(void *arg) {
+  long id = (long)arg;
+
+  // Neighbouring pages belong to different threads, so the faults of all
+  // the threads interleave over the same range.
+  for (int round = 0; round < ROUNDS; round++) {
+    for (long i = id; i < NUM_PAGES; i += NUM_THREADS) {
+      mapped[i * page_size + round] = (char)(id + 1);
+      fresh[i * page_size + round] = (char)(id + 1);
+    }
+  }
+
+  return NULL;
+}
+
+int main(void) {
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  page_size = sysconf(_SC_PAGESIZE);
+
+  mapped = mmap(NULL, NUM_PAGES * page_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  fresh = mmap(NULL, NUM_PAGES * page_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapped == MAP_FAILED || fresh == MAP_FAILED) {
+    perror("Could not map memory");
+    exit(1);
+  }
+
+  memset(mapped, 'A', NUM_PAGES * page_size);
+
+  puts("Pages dirtied by many threads at once should be restored.");
+
+  bool is_restored = false;
+  if (afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_REGS)) {
+    puts("Snapshot taken");
+    is_restored = false;
+  } else {
+    puts("Snapshot restored");
+    is_restored = true;
+  }
+
+  for (long i = 0; i < NUM_PAGES * page_size; i++) {
+    if (mapped[i] != 'A' || fresh[i] != 0) {
+      printf("Byte %ld not restored\n", i);
+      exit(1);
+    }
+  }
+
+  pthread_t threads[NUM_THREADS];
+  for (long i = 0; i < NUM_THREADS; i++) {
+    if (pthread_create(&threads[i], NULL, hammer, (void *)i)) {
+      perror("Could not create thread");
+      exit(1);
+    }
+  }
+
+  for (int i = 0; i < NUM_THREADS; i++)
+    pthread_join(threads[i], NULL);
+
+  if (!is_restored) afl_snapshot_restore();
+
+  puts("Success!");
+  return 0;
+}
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <asm/prctl.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <xmmintrin.h>
+
+#include "libaflsnapshot.h"
+
+#define SNAPSHOT_MXCSR (_MM_ROUND_UP | _MM_MASK_MASK)
+#define SNAPSHOT_GSBASE 0x1000UL
+
+static unsigned long get_gsbase(void) {
+  unsigned long base = 0;
+  if (syscall(SYS_arch_prctl, ARCH_GET_GS, &base)) {
+    perror("Could not read gs base");
+    exit(1);
+  }
+
+  return base;
+}
+
+static void set_gsbase(unsigned long base) {
+  if (syscall(SYS_arch_prctl, ARCH_SET_GS, base)) {
+    perror("Could not set gs base");
+    exit(1);
+  }
+}
+
+static const unsigned char pattern[32] = {
+    0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef, 0xfe, 0xdc, 0xba,
+    0x98, 0x76, 0x54, 0x32, 0x10, 0x0f, 0x1e, 0x2d, 0x3c, 0x4b, 0x5a,
+    0x69, 0x78, 0x87, 0x96, 0xa5, 0xb4, 0xc3, 0xd2, 0xe1, 0xf0};
+
+// The vector register is loaded right before the ioctl and read right after
+// it, so no library code runs in between to clobber it. After a restore the
+// execution resumes after the syscall instruction.
+static long take_with_vector(int dev, int config, bool avx,
+                             unsigned char *out) {
+  long ret;
+
+  if (avx) {
+    asm volatile(
+        "vmovdqu (%[in]), %%ymm15\n"
+        "syscall\n"
+        "vmovdqu %%ymm15, (%[out])\n"
+        : "=a"(ret)
+        : "a"(SYS_ioctl), "D"(dev), "S"(AFL_SNAPSHOT_IOCTL_TAKE), "d"(config),
+          [in] "r"(pattern), [out] "r"(out)
+        : "rcx", "r11", "memory", "xmm15");
+  } else {
+    asm volatile(
+        "movdqu (%[in]), %%xmm15\n"
+        "syscall\n"
+        "movdqu %%xmm15, (%[out])\n"
+        : "=a"(ret)
+        : "a"(SYS_ioctl), "D"(dev), "S"(AFL_SNAPSHOT_IOCTL_TAKE), "d"(config),
+          [in] "r"(pattern), [out] "r"(out)
+        : "rcx", "r11", "memory", "xmm15");
+  }
+
+  return ret;
+}
+
+static void clobber_vector(bool avx) {
+  if (avx)
+    asm volatile("vpcmpeqd %%ymm15, %%ymm15, %%ymm15" : : : "xmm15");
+  else
+    asm volatile("pcmpeqd %%xmm15, %%xmm15" : : : "xmm15");
+}
+
+int main(void) {
+  int dev = afl_snapshot_init();
+  if (dev == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  puts("MXCSR, the gs base and the vector registers should be back to the "
+       "snapshot values.");
+
+  _mm_setcsr(SNAPSHOT_MXCSR);
+  set_gsbase(SNAPSHOT_GSBASE);
+
+  bool          avx = __builtin_cpu_supports("avx");
+  size_t        vector_size = avx ? 32 : 16;
+  unsigned char vector[32] = {0};
+
+  bool is_restored = false;
+  if (take_with_vector(dev, AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_REGS, avx,
+                       vector)) {
+    puts("Snapshot taken");
+    is_restored = false;
+  } else {
+    puts("Snapshot restored");
+    is_restored = true;
+  }
+
+  if (_mm_getcsr() != SNAPSHOT_MXCSR) {
+    printf("MXCSR not restored: 0x%x\n", _mm_getcsr());
+    exit(1);
+  }
+
+  if (get_gsbase() != SNAPSHOT_GSBASE) {
+    printf("gs base not restored: 0x%lx\n", get_gsbase());
+    exit(1);
+  }
+
+  if (memcmp(vector, pattern, vector_size)) {
+    printf("%s15 not restored\n", avx ? "ymm" : "xmm");
+    exit(1);
+  }
+
+  _mm_setcsr(_MM_ROUND_DOWN | _MM_MASK_MASK);
+  set_gsbase(SNAPSHOT_GSBASE * 2);
+  clobber_vector(avx);
+
+  if (!is_restored) afl_snapshot_restore();
+
+  puts("Success!");
+  return 0;
+}
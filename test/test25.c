@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "libaflsnapshot.h"
+
+static void handler(int sig) {
+  (void)sig;
+}
+
+int main(void) {
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  struct sigaction sa = {0};
+  sa.sa_handler = handler;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGUSR1, &sa, NULL)) {
+    perror("Could not install handler");
+    exit(1);
+  }
+
+  puts("Handlers, mask, pending signals and itimers should be restored.");
+
+  bool is_restored = false;
+  if (afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_REGS |
+                        AFL_SNAPSHOT_SIGNALS)) {
+    puts("Snapshot taken");
+    is_restored = false;
+  } else {
+    puts("Snapshot restored");
+    is_restored = true;
+  }
+
+  struct sigaction old;
+  if (sigaction(SIGUSR1, NULL, &old) || old.sa_handler != handler) {
+    puts("Signal handler not restored");
+    exit(1);
+  }
+
+  sigset_t set;
+  sigprocmask(SIG_BLOCK, NULL, &set);
+  if (sigismember(&set, SIGUSR2)) {
+    puts("Blocked mask not restored");
+    exit(1);
+  }
+
+  sigpending(&set);
+  if (sigismember(&set, SIGUSR2)) {
+    puts("Pending signal not dropped");
+    exit(1);
+  }
+
+  struct itimerval timer;
+  getitimer(ITIMER_REAL, &timer);
+  if (timer.it_value.tv_sec || timer.it_value.tv_usec) {
+    puts("Interval timer not restored");
+    exit(1);
+  }
+
+  // Leave every kind of signal state changed for the restore.
+  signal(SIGUSR1, SIG_IGN);
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR2);
+  sigprocmask(SIG_BLOCK, &set, NULL);
+  raise(SIGUSR2);
+  alarm(100);
+
+  if (!is_restored) afl_snapshot_restore();
+
+  puts("Success!");
+  return 0;
+}
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "libaflsnapshot.h"
+
+int main(void) {
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  // Runs across the restores, it must not be touched.
+  pid_t helper = fork();
+  if (helper == 0) {
+    for (;;)
+      pause();
+  }
+
+  puts("Children spawned during the iteration should be killed and reaped.");
+
+  bool is_restored = false;
+  if (afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_REGS |
+                        AFL_SNAPSHOT_CHILDREN)) {
+    puts("Snapshot taken");
+    is_restored = false;
+  } else {
+    puts("Snapshot restored");
+    is_restored = true;
+  }
+
+  if (kill(helper, 0)) {
+    puts("Child from before the snapshot was killed");
+    exit(1);
+  }
+
+  // Only the helper is left, the iteration's child is already reaped.
+  if (is_restored && waitpid(-1, NULL, WNOHANG) != 0) {
+    puts("Child spawned during the iteration not reaped");
+    exit(1);
+  }
+
+  // Both in a group of their own, so the last iteration can kill them.
+  pid_t child = fork();
+  if (child == 0) {
+    setpgid(0, 0);
+
+    // A grandchild that outlives its parent.
+    if (fork() == 0) {
+      for (;;)
+        pause();
+    }
+
+    for (;;)
+      pause();
+  }
+
+  setpgid(child, child);
+
+  if (!is_restored) afl_snapshot_restore();
+
+  // No restore follows, nothing cleans them up for us.
+  kill(-child, SIGKILL);
+  waitpid(child, NULL, 0);
+
+  kill(helper, SIGKILL);
+  waitpid(helper, NULL, 0);
+
+  puts("Success!");
+  return 0;
+}
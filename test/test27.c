@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "libaflsnapshot.h"
+
+#define PAGE_SZ 4096
+
+int value = 0;
+char *region = NULL;
+
+int main(void) {
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  // Shared mappings are not snapshotted, the counter survives the restores.
+  int *visits = mmap(NULL, PAGE_SZ, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (visits == MAP_FAILED) {
+    perror("mmap failed");
+    exit(1);
+  }
+
+  puts("Nested levels should restore to their own state.");
+
+  if (afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_REGS)) {
+    puts("Snapshot taken");
+  } else {
+    puts("Snapshot restored");
+
+    if (*visits != 3) {
+      puts("Base snapshot restored too early");
+      exit(1);
+    }
+
+    if (value != 0 || region != NULL) {
+      puts("Base snapshot state not restored");
+      exit(1);
+    }
+
+    puts("Success!");
+    return 0;
+  }
+
+  value = 1;
+  region = mmap(NULL, 2 * PAGE_SZ, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED) {
+    perror("mmap failed");
+    exit(1);
+  }
+  strcpy(region, "level 1");
+
+  if (afl_snapshot_push() == 1) {
+    puts("Level 1 pushed");
+  } else {
+    puts("Level 1 restored");
+  }
+
+  if (value != 1 || strcmp(region, "level 1") ||
+      region[PAGE_SZ] != 0) {
+    puts("Level 1 state not restored");
+    exit(1);
+  }
+
+  ++*visits;
+
+  value = 2;
+  strcpy(region, "iteration");
+  region[PAGE_SZ] = 1;
+
+  if (*visits < 3) afl_snapshot_restore();
+
+  afl_snapshot_restore_level(0);
+
+  puts("Restore returned");
+  return 1;
+}
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "libaflsnapshot.h"
+
+#define PAGE_SZ 4096
+
+int value = 0;
+char *region = NULL;
+
+int main(void) {
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  // Shared mappings are not snapshotted, the counter survives the restores.
+  int *iterations = mmap(NULL, PAGE_SZ, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (iterations == MAP_FAILED) {
+    perror("mmap failed");
+    exit(1);
+  }
+
+  puts("A rebased snapshot should restore the state at the rebase point.");
+
+  if (afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_REGS) != 1) {
+    puts("Snapshot restored before the rebase");
+    exit(1);
+  }
+
+  // Slow one-time initialisation.
+  value = 1;
+  region = mmap(NULL, 2 * PAGE_SZ, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED) {
+    perror("mmap failed");
+    exit(1);
+  }
+  strcpy(region, "initialised");
+
+  bool is_restored = false;
+  if (afl_snapshot_rebase() == 1) {
+    puts("Snapshot rebased");
+  } else {
+    puts("Snapshot restored");
+    is_restored = true;
+  }
+
+  if (value != 1 || strcmp(region, "initialised") || region[PAGE_SZ] != 0) {
+    puts("Rebased state not restored");
+    exit(1);
+  }
+
+  value = 2;
+  strcpy(region, "iteration");
+  region[PAGE_SZ] = 1;
+
+  if (++*iterations < 3) afl_snapshot_restore();
+
+  if (!is_restored) {
+    puts("Restore returned");
+    exit(1);
+  }
+
+  puts("Success!");
+  return 0;
+}
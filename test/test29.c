@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "libaflsnapshot.h"
+
+int value = 0;
+
+int main(void) {
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  pid_t parent = getpid();
+
+  puts("A worker forked from the snapshot should start from the snapshot.");
+
+  bool is_restored = false;
+  if (afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_REGS)) {
+    puts("Snapshot taken");
+  } else {
+    puts("Snapshot restored");
+    is_restored = true;
+  }
+
+  if (value != 0) {
+    puts("Snapshot state not restored");
+    exit(1);
+  }
+
+  value = 1;
+
+  if (getpid() != parent) {
+    // The worker runs an iteration on its own snapshot.
+    if (!is_restored) afl_snapshot_restore();
+    exit(0);
+  }
+
+  pid_t worker = afl_snapshot_fork();
+  if (worker == -1) {
+    perror("afl_snapshot_fork failed");
+    exit(1);
+  }
+
+  int status;
+  if (waitpid(worker, &status, 0) != worker || !WIFEXITED(status) ||
+      WEXITSTATUS(status)) {
+    puts("Worker failed");
+    exit(1);
+  }
+
+  if (value != 1) {
+    puts("Parent state changed by the fork");
+    exit(1);
+  }
+
+  puts("Success!");
+  return 0;
+}
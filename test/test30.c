@@ -0,0 +1,119 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/personality.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "libaflsnapshot.h"
+
+#define SNAPSHOT_PATH "/tmp/afl_snapshot_test30"
+
+int value = 0;
+char *heap = NULL;
+pid_t saver = 0;
+
+// Initialised data the saver never touches, it has to come from the binary.
+char pristine[8192] __attribute__((aligned(4096))) = {
+    [0] = 'a', [4096] = 'b', [8191] = 'c'};
+
+// Deeper than the stack mapping at take time, it has to grow.
+static int grow_stack(int depth) {
+  volatile char frame[16384];
+
+  frame[0] = depth;
+  if (depth == 0) {
+    return frame[0];
+  }
+
+  return grow_stack(depth - 1) + frame[0];
+}
+
+int main(int argc, char **argv) {
+  // Both runs need the same layout.
+  if (!(personality(0xffffffff) & ADDR_NO_RANDOMIZE)) {
+    personality(ADDR_NO_RANDOMIZE);
+    execv("/proc/self/exe", argv);
+    perror("execv failed");
+    exit(1);
+  }
+
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  if (argc > 1) {
+    int fd = open(SNAPSHOT_PATH, O_RDONLY);
+    if (fd == -1) {
+      perror("open failed");
+      exit(1);
+    }
+
+    afl_snapshot_load(fd);
+    perror("Load failed");
+    exit(1);
+  }
+
+  puts("A saved snapshot should load into a fresh process.");
+
+  value = 42;
+  heap = malloc(64);
+  strcpy(heap, "initialised");
+  saver = getpid();
+
+  fflush(stdout);
+  if (afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_REGS) != 1) {
+    puts("Snapshot not taken");
+    exit(1);
+  }
+
+  if (value != 42 || strcmp(heap, "initialised")) {
+    puts("Saved state not loaded");
+    exit(1);
+  }
+
+  if (getpid() != saver) {
+    if (pristine[0] != 'a' || pristine[4096] != 'b' ||
+        pristine[8191] != 'c') {
+      puts("Untouched initialised data not loaded");
+      exit(1);
+    }
+
+    grow_stack(64);
+    puts("Snapshot loaded");
+    exit(0);
+  }
+
+  int fd = open(SNAPSHOT_PATH, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1 || afl_snapshot_save(fd)) {
+    perror("Save failed");
+    exit(1);
+  }
+
+  close(fd);
+
+  // The state changed after the save is not in the file.
+  value = 0;
+  strcpy(heap, "changed");
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    execl("/proc/self/exe", argv[0], "load", NULL);
+    perror("execl failed");
+    _exit(1);
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  unlink(SNAPSHOT_PATH);
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+    puts("Loading process failed");
+    exit(1);
+  }
+
+  puts("Success!");
+  return 0;
+}
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "libaflsnapshot.h"
+
+#define PAGE_SZ 4096
+#define NR_PAGES 256
+
+int value = 0;
+char *region = NULL;
+char *added = NULL;
+
+int main(void) {
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  // Shared mappings are kept by the clone, the counter survives the swaps.
+  int *visits = mmap(NULL, PAGE_SZ, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  region = mmap(NULL, NR_PAGES * PAGE_SZ, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (visits == MAP_FAILED || region == MAP_FAILED) {
+    perror("mmap failed");
+    exit(1);
+  }
+
+  puts("Swapping the address space should restore every dirtied page.");
+
+  if (afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_REGS |
+                        AFL_SNAPSHOT_SWAP)) {
+    puts("Snapshot taken");
+  } else {
+    puts("Snapshot restored");
+  }
+
+  if (value != 0 || added != NULL) {
+    puts("Snapshot state not restored");
+    exit(1);
+  }
+
+  for (int i = 0; i < NR_PAGES; i++) {
+    if (region[i * PAGE_SZ] != 0) {
+      puts("Dirtied page not restored");
+      exit(1);
+    }
+  }
+
+  if (*visits == 3) {
+    puts("Success!");
+    return 0;
+  }
+
+  ++*visits;
+
+  // Dirty the whole region, the case the swap is meant for.
+  value = 1;
+  for (int i = 0; i < NR_PAGES; i++)
+    region[i * PAGE_SZ] = 1;
+
+  added = mmap(NULL, PAGE_SZ, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  afl_snapshot_restore();
+
+  puts("Restore returned");
+  return 1;
+}
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "libaflsnapshot.h"
+
+#define PAGE_SZ 4096
+#define NR_PAGES 512
+#define ITERATIONS 64
+
+int value = 0;
+char *region = NULL;
+
+int main(void) {
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  int *visits = mmap(NULL, PAGE_SZ, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  region = mmap(NULL, NR_PAGES * PAGE_SZ, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (visits == MAP_FAILED || region == MAP_FAILED) {
+    perror("mmap failed");
+    exit(1);
+  }
+
+  puts("The automatic strategy should restore the same state and report it.");
+
+  afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_REGS | AFL_SNAPSHOT_AUTO);
+
+  if (value != 0) {
+    puts("Snapshot state not restored");
+    exit(1);
+  }
+
+  for (int i = 0; i < NR_PAGES; i++) {
+    if (region[i * PAGE_SZ] != 0) {
+      puts("Dirtied page not restored");
+      exit(1);
+    }
+  }
+
+  if (*visits == ITERATIONS) {
+    struct afl_snapshot_stats stats;
+    if (afl_snapshot_stats(&stats)) {
+      perror("Stats failed");
+      exit(1);
+    }
+
+    printf("strategy %u, switches %u, page %llu ns, swap %llu ns\n",
+           stats.strategy, stats.switches, stats.page_cost_ns,
+           stats.swap_cost_ns);
+
+    if (stats.iterations != ITERATIONS || !stats.page_cost_ns) {
+      puts("Restores not accounted");
+      exit(1);
+    }
+
+    puts("Success!");
+    return 0;
+  }
+
+  ++*visits;
+
+  // Every iteration dirties the whole region.
+  value = 1;
+  for (int i = 0; i < NR_PAGES; i++)
+    region[i * PAGE_SZ] = 1;
+
+  afl_snapshot_restore();
+
+  puts("Restore returned");
+  return 1;
+}
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "libaflsnapshot.h"
+
+#define PAGE_SZ 4096
+
+volatile int value = 0;
+
+int main(void) {
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  int *visits = mmap(NULL, PAGE_SZ, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (visits == MAP_FAILED) {
+    perror("mmap failed");
+    exit(1);
+  }
+
+  struct afl_snapshot_limits limits = {.timeout_us = 100000};
+  if (afl_snapshot_limits(&limits)) {
+    perror("Setting limits failed");
+    exit(1);
+  }
+
+  puts("A hung iteration should be restored by the watchdog.");
+
+  int status = afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_REGS);
+  if (status == AFL_SNAPSHOT_STATUS_TAKEN) {
+    puts("Snapshot taken");
+  } else if (status == AFL_SNAPSHOT_STATUS_TIMEOUT) {
+    puts("Snapshot restored on timeout");
+
+    if (value != 0) {
+      puts("Snapshot state not restored");
+      exit(1);
+    }
+  } else {
+    puts("Unexpected status");
+    exit(1);
+  }
+
+  // The input would be read here, the timeout runs from now on.
+  if (afl_snapshot_start()) {
+    perror("Starting the iteration failed");
+    exit(1);
+  }
+
+  if (*visits == 2) {
+    puts("Success!");
+    return 0;
+  }
+
+  ++*visits;
+
+  // Spin in user mode first, then block in a syscall.
+  if (*visits == 1) {
+    for (;;)
+      value++;
+  }
+
+  value = 1;
+  pause();
+
+  puts("Watchdog did not fire");
+  return 1;
+}
@@ -0,0 +1,73 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "libaflsnapshot.h"
+
+#define PAGE_SZ 4096
+
+int value = 0;
+
+int main(void) {
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  int *visits = mmap(NULL, PAGE_SZ, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (visits == MAP_FAILED) {
+    perror("mmap failed");
+    exit(1);
+  }
+
+  puts("A crashing iteration should be restored instead of killed.");
+
+  fflush(stdout);
+  int status = afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_REGS |
+                                 AFL_SNAPSHOT_CRASH);
+  if (status == AFL_SNAPSHOT_STATUS_TAKEN) {
+    puts("Snapshot taken");
+  } else if (status == AFL_SNAPSHOT_STATUS_CRASH) {
+    struct afl_snapshot_crash_report report;
+    if (afl_snapshot_crash_report(&report)) {
+      perror("Crash report failed");
+      exit(1);
+    }
+
+    int expected = *visits == 1 ? SIGSEGV : SIGABRT;
+    printf("Snapshot restored on signal %d\n", report.signo);
+
+    if (report.signo != expected || report.count != *visits) {
+      puts("Wrong crash report");
+      exit(1);
+    }
+
+    if (value != 0) {
+      puts("Snapshot state not restored");
+      exit(1);
+    }
+  } else {
+    puts("Unexpected status");
+    exit(1);
+  }
+
+  if (*visits == 2) {
+    puts("Success!");
+    return 0;
+  }
+
+  ++*visits;
+  value = 1;
+
+  // A fault first, then a raised signal.
+  if (*visits == 1)
+    *(volatile int *)NULL = 0;
+  else
+    abort();
+
+  puts("Crash not intercepted");
+  return 1;
+}
@@ -0,0 +1,76 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "libaflsnapshot.h"
+
+#define NUM_THREADS 4
+#define NUM_PAGES 8192
+#define ROUNDS 32
+
+static char *mapped;
+static long  page_size;
+
+// Keeps faulting while the snapshot is cleaned and its pages are freed.
+static void *hammer(void *arg) {
+  long id = (long)arg;
+
+  for (long i = id; i < NUM_PAGES; i += NUM_THREADS)
+    mapped[i * page_size] = (char)(id + 1);
+
+  return NULL;
+}
+
+int main(void) {
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  page_size = sysconf(_SC_PAGESIZE);
+
+  mapped = mmap(NULL, NUM_PAGES * page_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapped == MAP_FAILED) {
+    perror("Could not map memory");
+    exit(1);
+  }
+
+  puts("A new snapshot should not be disturbed by the teardown of the last.");
+
+  for (int round = 0; round < ROUNDS; round++) {
+    memset(mapped, 'A' + round % 26, NUM_PAGES * page_size);
+
+    if (afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_REGS)) {
+      // Every page is saved, the teardown is deferred.
+      memset(mapped, 'x', NUM_PAGES * page_size);
+      afl_snapshot_restore();
+    }
+
+    for (long i = 0; i < NUM_PAGES * page_size; i++) {
+      if (mapped[i] != 'A' + round % 26) {
+        printf("Byte %ld not restored in round %d\n", i, round);
+        exit(1);
+      }
+    }
+
+    pthread_t threads[NUM_THREADS];
+    for (long i = 0; i < NUM_THREADS; i++) {
+      if (pthread_create(&threads[i], NULL, hammer, (void *)i)) {
+        perror("Could not create thread");
+        exit(1);
+      }
+    }
+
+    afl_snapshot_clean();
+
+    for (int i = 0; i < NUM_THREADS; i++)
+      pthread_join(threads[i], NULL);
+  }
+
+  puts("Success!");
+  return 0;
+}
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "libaflsnapshot.h"
+
+#define PAGE_SZ 4096
+#define NR_PAGES 1024
+#define MAX_DIRTY_PAGES 64
+
+int value = 0;
+
+int main(void) {
+  if (afl_snapshot_init() == -1) {
+    perror("Initialization failed");
+    exit(1);
+  }
+
+  struct afl_snapshot_limits limits = {.max_dirty_pages = MAX_DIRTY_PAGES};
+  if (afl_snapshot_limits(&limits)) {
+    perror("Setting limits failed");
+    exit(1);
+  }
+
+  puts("Memory allocated during an iteration should count against the budget.");
+
+  int status = afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_REGS);
+  if (status == AFL_SNAPSHOT_STATUS_TAKEN) {
+    puts("Snapshot taken");
+  } else if (status == AFL_SNAPSHOT_STATUS_BUDGET) {
+    puts("Snapshot restored over budget");
+
+    if (value != 0) {
+      puts("Snapshot state not restored");
+      exit(1);
+    }
+
+    puts("Success!");
+    return 0;
+  } else {
+    puts("Iteration not cut short");
+    exit(1);
+  }
+
+  value = 1;
+
+  // A mapping the snapshot knows nothing about.
+  char *region = mmap(NULL, NR_PAGES * PAGE_SZ, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED) {
+    perror("mmap failed");
+    exit(1);
+  }
+
+  for (int i = 0; i < NR_PAGES; i++)
+    region[i * PAGE_SZ] = 1;
+
+  // The restore is forced on the way back to user mode at the latest.
+  afl_snapshot_restore();
+
+  puts("Restore returned");
+  return 1;
+}